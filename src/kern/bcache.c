@@ -0,0 +1,899 @@
+// bcache.c - Block buffer cache
+//
+// Buffers are found through a hash table keyed by device and block number.
+// Unreferenced buffers are also on an LRU list, least recently used first; a
+// miss takes a new buffer while there are fewer than BCACHE_NBUF and reuses
+// the head of the LRU list after that. A buffer being read from the device is
+// marked loading, and threads that find it wait for the read to finish rather
+// than issue their own.
+//
+// Writes are delayed. The flusher thread wakes up every BCACHE_WB_INTERVAL and
+// writes back buffers that have been dirty for BCACHE_WB_DELAY, or all dirty
+// buffers once there are BCACHE_WB_THRESH of them. Dirty buffers are never
+// reused, so a miss that finds only dirty buffers waits for the flusher.
+//
+// Blocks passed to bcache_prefetch are queued for BCACHE_RA_WORKERS read-ahead
+// threads, so that several reads are in flight while the thread that asked
+// for them carries on.
+//
+
+#ifdef BCACHE_TRACE
+#define TRACE
+#endif
+
+#ifdef BCACHE_DEBUG
+#define DEBUG
+#endif
+
+#include "bcache.h"
+
+#include "console.h"
+#include "csr.h"
+#include "error.h"
+#include "halt.h"
+#include "heap.h"
+#include "intr.h"
+#include "memory.h"
+#include "string.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// BCACHE_NBUF is the maximum number of buffers in the cache
+
+#ifndef BCACHE_NBUF
+#define BCACHE_NBUF 256
+#endif
+
+// BCACHE_NBUCKET is the number of hash buckets (must be a power of two)
+
+#ifndef BCACHE_NBUCKET
+#define BCACHE_NBUCKET 64
+#endif
+
+// BCACHE_RA_QLEN is the length of the read-ahead queue and BCACHE_RA_WORKERS
+// the number of threads that serve it
+
+#ifndef BCACHE_RA_QLEN
+#define BCACHE_RA_QLEN 64
+#endif
+
+#ifndef BCACHE_RA_WORKERS
+#define BCACHE_RA_WORKERS 4
+#endif
+
+// Write-back policy: how often the flusher runs, how long a buffer may stay
+// dirty and how many dirty buffers make the flusher write back all of them
+
+#ifndef BCACHE_WB_INTERVAL
+#define BCACHE_WB_INTERVAL (TIMER_FREQ / 2)
+#endif
+
+#ifndef BCACHE_WB_DELAY
+#define BCACHE_WB_DELAY (2 * TIMER_FREQ)
+#endif
+
+#ifndef BCACHE_WB_THRESH
+#define BCACHE_WB_THRESH (BCACHE_NBUF / 4)
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct bcache_ra_req {
+    struct io_intf * dev;
+    uint64_t blkno;
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct bcache_buf * bcache_buckets[BCACHE_NBUCKET];
+static struct bcache_buf * bcache_bufs[BCACHE_NBUF]; // all buffers
+static struct bcache_buf * lru_head; // least recently used
+static struct bcache_buf * lru_tail; // most recently used
+static struct bcache_stats stats;
+
+static struct condition buf_loaded = {
+    .name = "bcache.loaded",
+    .wait_list = { NULL, NULL }
+};
+
+static struct condition buf_free = {
+    .name = "bcache.free",
+    .wait_list = { NULL, NULL }
+};
+
+static struct bcache_ra_req ra_queue[BCACHE_RA_QLEN];
+static unsigned int ra_head; // next request to serve
+static unsigned int ra_tail; // next free slot
+static char ra_started;
+
+static struct condition ra_ready = {
+    .name = "bcache.ra",
+    .wait_list = { NULL, NULL }
+};
+
+static char wb_started;
+
+static struct condition wb_kick = {
+    .name = "bcache.wb",
+    .wait_list = { NULL, NULL }
+};
+
+static struct condition wb_done = {
+    .name = "bcache.wb_done",
+    .wait_list = { NULL, NULL }
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct bcache_buf ** bcache_bucket(struct io_intf * dev, uint64_t blkno);
+static struct bcache_buf * bcache_lookup(struct io_intf * dev, uint64_t blkno);
+static struct bcache_buf * bcache_alloc(void);
+static void bcache_unhash(struct bcache_buf * buf);
+static void bcache_filled(struct bcache_buf * buf);
+static void lru_unlink(struct bcache_buf * buf);
+static void lru_append(struct bcache_buf * buf);
+static void bcache_ra_worker(void);
+static void bcache_flusher(void);
+static int bcache_writeback(struct io_intf * dev, int all);
+static int bcache_zero_part (
+    struct io_intf * dev, unsigned long long pos, uint32_t n);
+static void bcache_hold(struct io_intf * dev, uint64_t first, uint64_t last);
+static void bcache_settle (
+    struct io_intf * dev, uint64_t first, uint64_t last, int zero, int ok);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int bcache_get (
+    struct io_intf * dev, uint64_t blkno, int flags,
+    struct bcache_buf ** bufptr)
+{
+    struct bcache_buf ** pp;
+    struct bcache_buf * buf;
+    int saved_intr_state;
+    long result;
+
+    trace("%s(dev=%p,blkno=%lu,flags=%d)", __func__, dev, blkno, flags);
+
+    saved_intr_state = intr_disable();
+
+    buf = bcache_lookup(dev, blkno);
+
+    if (buf != NULL) {
+        if (buf->refcnt++ == 0)
+            lru_unlink(buf);
+
+        while (buf->loading)
+            condition_wait(&buf_loaded);
+
+        // If the read failed, the buffer is no longer in the hash table and
+        // the caller gets the error from a read of its own.
+
+        if (buf->valid) {
+            stats.hits += 1;
+            intr_restore(saved_intr_state);
+            *bufptr = buf;
+            return 0;
+        }
+
+        bcache_put(buf);
+    }
+
+    stats.misses += 1;
+
+    // Take a new buffer or the least recently used unreferenced one
+
+    while ((buf = bcache_alloc()) == NULL)
+        condition_wait(&buf_free);
+
+    buf->dev = dev;
+    buf->blkno = blkno;
+    buf->refcnt = 1;
+
+    // A buffer is in the hash table exactly when it is valid or loading. A
+    // BCACHE_NOREAD buffer stays loading until the caller has filled it (see
+    // bcache_filled), so that nobody else sees its old contents.
+
+    buf->valid = 0;
+    buf->loading = 1;
+
+    pp = bcache_bucket(dev, blkno);
+    buf->hnext = *pp;
+    *pp = buf;
+
+    intr_restore(saved_intr_state);
+
+    if (flags & BCACHE_NOREAD) {
+        *bufptr = buf;
+        return 0;
+    }
+
+    result = ioreadat(dev, blkno * BCACHE_BLKSZ, buf->data, BCACHE_BLKSZ);
+
+    // The last block of a device may be short
+
+    if (0 < result && result < BCACHE_BLKSZ)
+        memset(buf->data + result, 0, BCACHE_BLKSZ - result);
+
+    saved_intr_state = intr_disable();
+
+    buf->loading = 0;
+    buf->valid = (0 < result);
+    condition_broadcast(&buf_loaded);
+
+    if (!buf->valid) {
+        bcache_unhash(buf);
+        bcache_put(buf);
+        intr_restore(saved_intr_state);
+        return (result < 0) ? result : -EIO;
+    }
+
+    intr_restore(saved_intr_state);
+
+    *bufptr = buf;
+    return 0;
+}
+
+void bcache_put(struct bcache_buf * buf) {
+    int saved_intr_state;
+
+    trace("%s(dev=%p,blkno=%lu)", __func__, buf->dev, buf->blkno);
+
+    saved_intr_state = intr_disable();
+
+    assert (0 < buf->refcnt);
+
+    // A BCACHE_NOREAD buffer dropped without being filled is discarded, like
+    // a buffer whose read failed.
+
+    if (buf->loading) {
+        buf->loading = 0;
+        condition_broadcast(&buf_loaded);
+        bcache_unhash(buf);
+    }
+
+    if (--buf->refcnt == 0) {
+        lru_append(buf);
+        condition_broadcast(&buf_free);
+    }
+
+    intr_restore(saved_intr_state);
+}
+
+void bcache_dirty(struct bcache_buf * buf) {
+    int saved_intr_state;
+    int start_flusher;
+
+    trace("%s(dev=%p,blkno=%lu)", __func__, buf->dev, buf->blkno);
+
+    saved_intr_state = intr_disable();
+
+    bcache_filled(buf);
+
+    if (!buf->dirty) {
+        buf->dirty = 1;
+        buf->dirty_time = csrr_time();
+        stats.ndirty += 1;
+
+        if (BCACHE_WB_THRESH <= stats.ndirty)
+            condition_signal(&wb_kick);
+    }
+
+    start_flusher = !wb_started;
+    wb_started = 1;
+
+    intr_restore(saved_intr_state);
+
+    if (start_flusher)
+        thread_spawn_detached("bcache.wb", bcache_flusher, NULL);
+}
+
+int bcache_write(struct bcache_buf * buf) {
+    long result;
+
+    trace("%s(dev=%p,blkno=%lu)", __func__, buf->dev, buf->blkno);
+
+    bcache_filled(buf);
+
+    result = iowriteat(buf->dev,
+        buf->blkno * BCACHE_BLKSZ, buf->data, BCACHE_BLKSZ);
+
+    if (result < 0)
+        return result;
+    else if (result != BCACHE_BLKSZ)
+        return -EIO;
+    else
+        return 0;
+}
+
+long bcache_readat (
+    struct io_intf * dev, unsigned long long pos,
+    void * buf, unsigned long n)
+{
+    struct bcache_buf * cbuf;
+    unsigned long done = 0;
+    uint32_t blkoff, len;
+    int result;
+
+    while (done < n) {
+        blkoff = (pos + done) % BCACHE_BLKSZ;
+        len = BCACHE_BLKSZ - blkoff;
+        if (n - done < len)
+            len = n - done;
+
+        result = bcache_get(dev, (pos + done) / BCACHE_BLKSZ, 0, &cbuf);
+
+        if (result != 0)
+            return (done != 0) ? done : result;
+
+        memcpy(buf + done, cbuf->data + blkoff, len);
+        bcache_put(cbuf);
+        done += len;
+    }
+
+    return done;
+}
+
+long bcache_writeat (
+    struct io_intf * dev, unsigned long long pos,
+    const void * buf, unsigned long n)
+{
+    struct bcache_buf * cbuf;
+    unsigned long done = 0;
+    uint32_t blkoff, len;
+    int result;
+
+    while (done < n) {
+        blkoff = (pos + done) % BCACHE_BLKSZ;
+        len = BCACHE_BLKSZ - blkoff;
+        if (n - done < len)
+            len = n - done;
+
+        result = bcache_get(dev, (pos + done) / BCACHE_BLKSZ,
+            (len == BCACHE_BLKSZ) ? BCACHE_NOREAD : 0, &cbuf);
+
+        if (result == 0) {
+            memcpy(cbuf->data + blkoff, buf + done, len);
+            bcache_dirty(cbuf);
+            bcache_put(cbuf);
+        }
+
+        if (result != 0)
+            return (done != 0) ? done : result;
+
+        done += len;
+    }
+
+    return done;
+}
+
+int bcache_cached(struct io_intf * dev, uint64_t blkno) {
+    struct bcache_buf * buf;
+    int saved_intr_state;
+    int cached;
+
+    saved_intr_state = intr_disable();
+    buf = bcache_lookup(dev, blkno);
+    cached = (buf != NULL && buf->valid);
+    intr_restore(saved_intr_state);
+
+    return cached;
+}
+
+void bcache_prefetch(struct io_intf * dev, uint64_t blkno) {
+    int saved_intr_state;
+    int start_workers;
+    unsigned int i;
+
+    trace("%s(dev=%p,blkno=%lu)", __func__, dev, blkno);
+
+    saved_intr_state = intr_disable();
+
+    if (bcache_lookup(dev, blkno) != NULL ||
+        ra_tail - ra_head == BCACHE_RA_QLEN)
+    {
+        intr_restore(saved_intr_state);
+        return;
+    }
+
+    for (i = ra_head; i != ra_tail; i++) {
+        if (ra_queue[i % BCACHE_RA_QLEN].dev == dev &&
+            ra_queue[i % BCACHE_RA_QLEN].blkno == blkno)
+        {
+            intr_restore(saved_intr_state);
+            return;
+        }
+    }
+
+    ra_queue[ra_tail % BCACHE_RA_QLEN].dev = dev;
+    ra_queue[ra_tail % BCACHE_RA_QLEN].blkno = blkno;
+    ra_tail += 1;
+    stats.prefetches += 1;
+    condition_signal(&ra_ready);
+
+    start_workers = !ra_started;
+    ra_started = 1;
+
+    intr_restore(saved_intr_state);
+
+    // Start the workers on first use, so that the cache works before the
+    // thread manager does.
+
+    if (start_workers) {
+        for (i = 0; i < BCACHE_RA_WORKERS; i++)
+            thread_spawn_detached("bcache.ra", bcache_ra_worker, NULL);
+    }
+}
+
+int bcache_sync(struct io_intf * dev) {
+    int saved_intr_state;
+    int result;
+    int i;
+
+    trace("%s(dev=%p)", __func__, dev);
+
+    result = bcache_writeback(dev, 1);
+
+    // The flusher may be writing back some of our buffers
+
+    saved_intr_state = intr_disable();
+
+    for (i = 0; i < stats.nbuf; i++) {
+        while (bcache_bufs[i]->dev == dev && bcache_bufs[i]->writing)
+            condition_wait(&wb_done);
+    }
+
+    intr_restore(saved_intr_state);
+
+    if (result != 0)
+        return result;
+
+    result = ioctl(dev, IOCTL_FLUSH, NULL);
+    return (result == -ENOTSUP) ? 0 : result;
+}
+
+void bcache_invalidate(struct io_intf * dev) {
+    struct bcache_buf * buf;
+    int saved_intr_state;
+
+    trace("%s(dev=%p)", __func__, dev);
+
+    saved_intr_state = intr_disable();
+
+    for (buf = lru_head; buf != NULL; buf = buf->lru_next) {
+        if (buf->dev == dev && buf->valid) {
+            bcache_unhash(buf);
+            buf->valid = 0;
+
+            if (buf->dirty) {
+                buf->dirty = 0;
+                stats.ndirty -= 1;
+            }
+        }
+    }
+
+    intr_restore(saved_intr_state);
+}
+
+int bcache_zeroat (
+    struct io_intf * dev, unsigned long long pos, unsigned long long n)
+{
+    struct bcache_buf * buf;
+    struct io_range range;
+    int saved_intr_state;
+    uint64_t blkno;
+    uint32_t len;
+    int result;
+
+    trace("%s(dev=%p,pos=%llu,n=%llu)", __func__, dev, pos, n);
+
+    // Zero partial blocks at either end in the cache
+
+    if (n != 0 && pos % BCACHE_BLKSZ != 0) {
+        len = BCACHE_BLKSZ - pos % BCACHE_BLKSZ;
+        if (n < len)
+            len = n;
+
+        result = bcache_zero_part(dev, pos, len);
+        if (result != 0)
+            return result;
+
+        pos += len;
+        n -= len;
+    }
+
+    if (n % BCACHE_BLKSZ != 0) {
+        len = n % BCACHE_BLKSZ;
+        result = bcache_zero_part(dev, pos + n - len, len);
+        if (result != 0)
+            return result;
+
+        n -= len;
+    }
+
+    if (n == 0)
+        return 0;
+
+    // If the device zeroes the whole blocks, their cached copies become clean
+    // zero blocks, which is what the device holds. If it fails, they keep
+    // their data and any dirty ones are still written back.
+
+    saved_intr_state = intr_disable();
+    bcache_hold(dev, pos / BCACHE_BLKSZ, (pos + n) / BCACHE_BLKSZ);
+    intr_restore(saved_intr_state);
+
+    range.pos = pos;
+    range.len = n;
+    result = ioctl(dev, IOCTL_WRITE_ZEROES, &range);
+
+    saved_intr_state = intr_disable();
+    bcache_settle(dev, pos / BCACHE_BLKSZ, (pos + n) / BCACHE_BLKSZ, 1,
+        result == 0);
+    intr_restore(saved_intr_state);
+
+    if (result != -ENOTSUP)
+        return result;
+
+    for (blkno = pos / BCACHE_BLKSZ; blkno < (pos + n) / BCACHE_BLKSZ; blkno++) {
+        result = bcache_get(dev, blkno, BCACHE_NOREAD, &buf);
+        if (result != 0)
+            return result;
+
+        memset(buf->data, 0, BCACHE_BLKSZ);
+        bcache_dirty(buf);
+        bcache_put(buf);
+    }
+
+    return 0;
+}
+
+int bcache_discard (
+    struct io_intf * dev, unsigned long long pos, unsigned long long n)
+{
+    const uint64_t first = (pos + BCACHE_BLKSZ - 1) / BCACHE_BLKSZ;
+    const uint64_t last = (pos + n) / BCACHE_BLKSZ;
+    struct io_range range;
+    int saved_intr_state;
+    int result;
+
+    trace("%s(dev=%p,pos=%llu,n=%llu)", __func__, dev, pos, n);
+
+    if (last <= first)
+        return 0;
+
+    saved_intr_state = intr_disable();
+    bcache_hold(dev, first, last);
+    intr_restore(saved_intr_state);
+
+    range.pos = first * BCACHE_BLKSZ;
+    range.len = (last - first) * BCACHE_BLKSZ;
+    result = ioctl(dev, IOCTL_DISCARD, &range);
+
+    saved_intr_state = intr_disable();
+    bcache_settle(dev, first, last, 0, result == 0);
+    intr_restore(saved_intr_state);
+
+    return (result == -ENOTSUP) ? 0 : result;
+}
+
+void bcache_get_stats(struct bcache_stats * st) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    *st = stats;
+    intr_restore(saved_intr_state);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+struct bcache_buf ** bcache_bucket(struct io_intf * dev, uint64_t blkno) {
+    // Devices are heap objects, so the low bits of their address carry little
+    // information.
+
+    const uintptr_t h = blkno ^ ((uintptr_t)dev >> 4);
+    return &bcache_buckets[h % BCACHE_NBUCKET];
+}
+
+struct bcache_buf * bcache_lookup(struct io_intf * dev, uint64_t blkno) {
+    struct bcache_buf * buf;
+
+    for (buf = *bcache_bucket(dev, blkno); buf != NULL; buf = buf->hnext) {
+        if (buf->dev == dev && buf->blkno == blkno)
+            return buf;
+    }
+
+    return NULL;
+}
+
+// Returns a buffer that is not in the hash table nor on the LRU list, or NULL
+// if all BCACHE_NBUF buffers are referenced. Must be called with interrupts
+// disabled.
+
+struct bcache_buf * bcache_alloc(void) {
+    struct bcache_buf * buf;
+
+    if (stats.nbuf < BCACHE_NBUF) {
+        buf = kmalloc(sizeof(struct bcache_buf));
+        memset(buf, 0, sizeof(struct bcache_buf));
+        buf->data = memory_alloc_page();
+        bcache_bufs[stats.nbuf++] = buf;
+        return buf;
+    }
+
+    buf = lru_head;
+
+    while (buf != NULL && buf->dirty)
+        buf = buf->lru_next;
+
+    if (buf == NULL) {
+        condition_signal(&wb_kick); // only dirty buffers left
+        return NULL;
+    }
+
+    lru_unlink(buf);
+
+    if (buf->valid)
+        bcache_unhash(buf);
+
+    return buf;
+}
+
+void bcache_unhash(struct bcache_buf * buf) {
+    struct bcache_buf ** pp;
+
+    for (pp = bcache_bucket(buf->dev, buf->blkno); *pp != buf; pp = &(*pp)->hnext)
+        assert (*pp != NULL);
+
+    *pp = buf->hnext;
+    buf->hnext = NULL;
+}
+
+// Makes a BCACHE_NOREAD buffer, which the caller has filled, valid and wakes up
+// the threads waiting for it. Does nothing for any other buffer.
+
+void bcache_filled(struct bcache_buf * buf) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    if (buf->loading) {
+        buf->loading = 0;
+        buf->valid = 1;
+        condition_broadcast(&buf_loaded);
+    }
+
+    intr_restore(saved_intr_state);
+}
+
+// The read-ahead workers and the flusher serve all processes, so they do not
+// belong to any.
+
+void bcache_ra_worker(void) {
+    struct bcache_ra_req req;
+    struct bcache_buf * buf;
+    int saved_intr_state;
+
+    for (;;) {
+        saved_intr_state = intr_disable();
+
+        while (ra_head == ra_tail)
+            condition_wait(&ra_ready);
+
+        req = ra_queue[ra_head % BCACHE_RA_QLEN];
+        ra_head += 1;
+
+        intr_restore(saved_intr_state);
+
+        if (bcache_get(req.dev, req.blkno, 0, &buf) == 0)
+            bcache_put(buf);
+    }
+}
+
+void bcache_flusher(void) {
+    int saved_intr_state;
+    int result = 0;
+
+    for (;;) {
+        saved_intr_state = intr_disable();
+
+        while (stats.ndirty == 0)
+            condition_wait(&wb_kick);
+
+        // Wait for the next period unless many buffers are dirty. After a
+        // failed write-back, always wait, so that a broken device does not
+        // keep us busy.
+
+        if (stats.ndirty < BCACHE_WB_THRESH || result != 0)
+            condition_wait_timeout(&wb_kick, BCACHE_WB_INTERVAL);
+
+        intr_restore(saved_intr_state);
+
+        result = bcache_writeback(NULL, BCACHE_WB_THRESH <= stats.ndirty);
+    }
+}
+
+// Writes back the dirty buffers of /dev/ (of all devices if /dev/ is NULL).
+// Unless /all/ is set, only buffers dirty for at least BCACHE_WB_DELAY are
+// written. A buffer that fails to write stays dirty. Returns 0 or the error
+// of the last failed write.
+
+int bcache_writeback(struct io_intf * dev, int all) {
+    const uint64_t now = csrr_time();
+    struct bcache_buf * buf;
+    int saved_intr_state;
+    int result = 0;
+    int err;
+    int i;
+
+    for (i = 0; i < stats.nbuf; i++) {
+        saved_intr_state = intr_disable();
+
+        buf = bcache_bufs[i];
+
+        if (!buf->dirty || buf->writing || buf->held ||
+            (dev != NULL && buf->dev != dev) ||
+            (!all && now - buf->dirty_time < BCACHE_WB_DELAY))
+        {
+            intr_restore(saved_intr_state);
+            continue;
+        }
+
+        // Hold a reference so that the buffer is not reused. If it is dirtied
+        // again while we write, it is written again later.
+
+        if (buf->refcnt++ == 0)
+            lru_unlink(buf);
+
+        buf->dirty = 0;
+        buf->writing = 1;
+        stats.ndirty -= 1;
+
+        intr_restore(saved_intr_state);
+
+        err = bcache_write(buf);
+
+        saved_intr_state = intr_disable();
+
+        buf->writing = 0;
+        stats.writebacks += 1;
+
+        if (err != 0) {
+            kprintf("bcache: write-back of block %lu failed (%d)\n",
+                buf->blkno, err);
+            stats.wb_errors += 1;
+            result = err;
+
+            if (!buf->dirty) {
+                buf->dirty = 1;
+                buf->dirty_time = csrr_time();
+                stats.ndirty += 1;
+            }
+        }
+
+        condition_broadcast(&wb_done);
+        intr_restore(saved_intr_state);
+
+        bcache_put(buf);
+    }
+
+    return result;
+}
+
+// Zeroes /n/ bytes at /pos/, which lie in one block, in the cached block.
+
+int bcache_zero_part (
+    struct io_intf * dev, unsigned long long pos, uint32_t n)
+{
+    struct bcache_buf * buf;
+    int result;
+
+    result = bcache_get(dev, pos / BCACHE_BLKSZ, 0, &buf);
+    if (result != 0)
+        return result;
+
+    memset(buf->data + pos % BCACHE_BLKSZ, 0, n);
+    bcache_dirty(buf);
+    bcache_put(buf);
+    return 0;
+}
+
+// Prepares the cached blocks /first/ to /last/ (exclusive) of /dev/ for a
+// device command that overwrites them: waits for reads and write-backs in
+// progress, which would otherwise land after the command, and holds the
+// buffers, so that they are not written back while the command runs. Must be
+// called with interrupts disabled.
+
+void bcache_hold(struct io_intf * dev, uint64_t first, uint64_t last) {
+    struct bcache_buf * buf;
+    int i;
+
+    for (i = 0; i < stats.nbuf; i++) {
+        buf = bcache_bufs[i];
+
+        while (buf->dev == dev && first <= buf->blkno && buf->blkno < last &&
+            (buf->loading || buf->writing))
+        {
+            condition_wait(buf->loading ? &buf_loaded : &wb_done);
+        }
+
+        if (buf->dev == dev && first <= buf->blkno && buf->blkno < last &&
+            buf->valid)
+        {
+            buf->held = 1;
+        }
+    }
+}
+
+// Releases the buffers held by bcache_hold once the device command is done.
+// If it succeeded (/ok/ is set), the buffers are marked clean, and their data
+// is zeroed if /zero/ is set; otherwise the unreferenced ones are dropped. If
+// it failed, they are left as they are, so dirty ones are still written back.
+// Must be called with interrupts disabled.
+
+void bcache_settle (
+    struct io_intf * dev, uint64_t first, uint64_t last, int zero, int ok)
+{
+    struct bcache_buf * buf;
+    int i;
+
+    for (i = 0; i < stats.nbuf; i++) {
+        buf = bcache_bufs[i];
+
+        if (buf->dev != dev || buf->blkno < first || last <= buf->blkno)
+            continue;
+
+        buf->held = 0;
+
+        if (!ok || !buf->valid)
+            continue;
+
+        if (buf->dirty) {
+            buf->dirty = 0;
+            stats.ndirty -= 1;
+        }
+
+        if (zero)
+            memset(buf->data, 0, BCACHE_BLKSZ);
+        else if (buf->refcnt == 0) {
+            bcache_unhash(buf);
+            buf->valid = 0;
+        }
+    }
+}
+
+void lru_unlink(struct bcache_buf * buf) {
+    if (buf->lru_prev != NULL)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        lru_head = buf->lru_next;
+
+    if (buf->lru_next != NULL)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        lru_tail = buf->lru_prev;
+
+    buf->lru_prev = NULL;
+    buf->lru_next = NULL;
+}
+
+void lru_append(struct bcache_buf * buf) {
+    buf->lru_prev = lru_tail;
+    buf->lru_next = NULL;
+
+    if (lru_tail != NULL)
+        lru_tail->lru_next = buf;
+    else
+        lru_head = buf;
+
+    lru_tail = buf;
+}
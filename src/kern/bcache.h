@@ -0,0 +1,154 @@
+// bcache.h - Block buffer cache
+//
+// The buffer cache keeps recently used blocks of block devices in memory. A
+// block is BCACHE_BLKSZ bytes at byte offset blkno*BCACHE_BLKSZ of the device
+// and is read and written with ioreadat and iowriteat. A buffer stays in the
+// cache while it is referenced; unreferenced buffers are reused in least
+// recently used order.
+//
+// Modified buffers are written back later by a flusher thread: once they have
+// been dirty for a while, or sooner if many buffers are dirty. bcache_sync
+// writes them back right away and asks the device to make them durable.
+//
+
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include "io.h"
+
+#include <stdint.h>
+
+#define BCACHE_BLKSZ 4096
+
+// Flags for bcache_get
+
+#define BCACHE_NOREAD 1 // caller overwrites the whole block; skip the read
+
+struct bcache_buf {
+    struct io_intf * dev;
+    uint64_t blkno;
+    void * data; // BCACHE_BLKSZ bytes
+    // The fields below are private to bcache.c
+    struct bcache_buf * hnext; // next in hash chain
+    struct bcache_buf * lru_prev; // LRU list links (unreferenced only)
+    struct bcache_buf * lru_next;
+    int refcnt;
+    char valid; // data holds the block
+    char loading; // read in progress
+    char dirty; // data differs from the device
+    char writing; // write-back in progress
+    char held; // not written back during a device command, see bcache_hold
+    uint64_t dirty_time; // when the buffer became dirty
+};
+
+struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetches; // blocks queued by bcache_prefetch
+    uint64_t writebacks; // buffers written back
+    uint64_t wb_errors; // failed write-backs
+    uint32_t nbuf; // number of buffers allocated
+    uint32_t ndirty; // number of dirty buffers
+};
+
+// int bcache_get(struct io_intf * dev, uint64_t blkno, int flags,
+//     struct bcache_buf ** bufptr)
+// Returns a referenced buffer holding block /blkno/ of /dev/ in /*bufptr/,
+// reading it from the device on a miss unless /flags/ has BCACHE_NOREAD.
+// Waits if every buffer is referenced. Returns 0 or a negative error code.
+// With BCACHE_NOREAD, the caller must fill the whole buffer and then call
+// bcache_dirty or bcache_write; until then, other threads that want the block
+// wait for it. Dropping the buffer unfilled discards it.
+
+extern int bcache_get (
+    struct io_intf * dev, uint64_t blkno, int flags,
+    struct bcache_buf ** bufptr);
+
+// void bcache_put(struct bcache_buf * buf)
+// Drops a reference obtained from bcache_get.
+
+extern void bcache_put(struct bcache_buf * buf);
+
+// void bcache_dirty(struct bcache_buf * buf)
+// Marks a referenced buffer, which the caller has modified, to be written back
+// to its device later.
+
+extern void bcache_dirty(struct bcache_buf * buf);
+
+// int bcache_write(struct bcache_buf * buf)
+// Writes a referenced buffer, which the caller has modified, to its device
+// right away. Returns 0 or a negative error code.
+
+extern int bcache_write(struct bcache_buf * buf);
+
+// long bcache_readat(struct io_intf * dev, unsigned long long pos,
+//     void * buf, unsigned long n)
+// long bcache_writeat(struct io_intf * dev, unsigned long long pos,
+//     const void * buf, unsigned long n)
+// Like ioreadat and iowriteat on /dev/, but through the cache. Written data
+// reaches the device later, see bcache_sync. Return the number of bytes
+// transferred or a negative error code.
+
+extern long bcache_readat (
+    struct io_intf * dev, unsigned long long pos,
+    void * buf, unsigned long n);
+
+extern long bcache_writeat (
+    struct io_intf * dev, unsigned long long pos,
+    const void * buf, unsigned long n);
+
+// int bcache_cached(struct io_intf * dev, uint64_t blkno)
+// Returns 1 if block /blkno/ of /dev/ is in the cache, so that bcache_get
+// would not read it from the device, and 0 otherwise.
+
+extern int bcache_cached(struct io_intf * dev, uint64_t blkno);
+
+// void bcache_prefetch(struct io_intf * dev, uint64_t blkno)
+// Starts reading block /blkno/ of /dev/ into the cache in the background, so
+// that a later bcache_get finds it. Does nothing if the block is cached or
+// already queued, or if the read-ahead queue is full.
+
+extern void bcache_prefetch(struct io_intf * dev, uint64_t blkno);
+
+// int bcache_sync(struct io_intf * dev)
+// Writes back all dirty buffers of /dev/, waits for write-backs in progress,
+// then issues IOCTL_FLUSH to /dev/ so that the data is durable. Returns 0 or
+// a negative error code.
+
+extern int bcache_sync(struct io_intf * dev);
+
+// void bcache_invalidate(struct io_intf * dev)
+// Drops the unreferenced cached blocks of /dev/, for example before a
+// different device is mounted at the same address. Dirty blocks are dropped
+// too, so call bcache_sync first to keep their data.
+
+extern void bcache_invalidate(struct io_intf * dev);
+
+// int bcache_zeroat(struct io_intf * dev, unsigned long long pos,
+//     unsigned long long n)
+// Makes /n/ bytes at /pos/ of /dev/ read as zeros. The whole blocks in the
+// range are zeroed with one IOCTL_WRITE_ZEROES if /dev/ supports it and
+// written as zero blocks through the cache otherwise. Other access to the
+// range must not run concurrently. Returns 0 or a negative error code.
+
+extern int bcache_zeroat (
+    struct io_intf * dev, unsigned long long pos, unsigned long long n);
+
+// int bcache_discard(struct io_intf * dev, unsigned long long pos,
+//     unsigned long long n)
+// Tells /dev/ with IOCTL_DISCARD that the whole blocks in /n/ bytes at /pos/
+// are no longer needed and, if that succeeds, drops their cached copies, so
+// that their contents are unspecified afterwards. Does nothing if /dev/ does
+// not support discard.
+// Other access to the range must not run concurrently. Returns 0 or a
+// negative error code.
+
+extern int bcache_discard (
+    struct io_intf * dev, unsigned long long pos, unsigned long long n);
+
+// void bcache_get_stats(struct bcache_stats * st)
+// Copies the cache statistics to /st/.
+
+extern void bcache_get_stats(struct bcache_stats * st);
+
+#endif // _BCACHE_H_
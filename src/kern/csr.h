@@ -248,6 +248,16 @@ static inline void csrc_mstatus(intptr_t mask) {
 #define RISCV_SSTATUS_SPP (1UL << 8)
 #define RISCV_SSTATUS_SUM (1UL << 18)
 
+// The FS field tracks the state of the floating-point registers. While it is
+// Off, any FP instruction raises an illegal instruction exception. The hart
+// sets it to Dirty when an FP register or fcsr is written.
+
+#define RISCV_SSTATUS_FS (3UL << 13)
+#define RISCV_SSTATUS_FS_OFF (0UL << 13)
+#define RISCV_SSTATUS_FS_INITIAL (1UL << 13)
+#define RISCV_SSTATUS_FS_CLEAN (2UL << 13)
+#define RISCV_SSTATUS_FS_DIRTY (3UL << 13)
+
 static inline intptr_t csrr_sstatus(void) {
     intptr_t val;
 
@@ -298,4 +308,20 @@ static inline uintptr_t csrrw_satp(uintptr_t satp_new) {
     return satp_old;
 }
 
+// time and cycle counters (enabled for S mode in start.s)
+
+static inline uint64_t csrr_time(void) {
+    uint64_t val;
+
+    asm inline volatile ("rdtime %0" : "=r" (val));
+    return val;
+}
+
+static inline uint64_t csrr_cycle(void) {
+    uint64_t val;
+
+    asm inline volatile ("rdcycle %0" : "=r" (val));
+    return val;
+}
+
 #endif // _CSR_H_
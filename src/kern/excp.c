@@ -5,6 +5,7 @@
 #include "csr.h"
 #include "halt.h"
 #include "memory.h"
+#include "thread.h"
 
 #include <stddef.h>
 
@@ -64,6 +65,10 @@ void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
     case RISCV_SCAUSE_ECALL_FROM_UMODE: // ecall excpetion
         syscall_handler(tfr); // call syscall handler
         break;
+    case RISCV_SCAUSE_ILLEGAL_INSTR: // first FP instruction since switch
+        if (!thread_fpu_trap())
+            default_excp_handler(code, tfr);
+        break;
     case RISCV_SCAUSE_STORE_PAGE_FAULT: // page fault exception
         memory_handle_page_fault((void *)csrr_stval()); // call memory handler
         break;
@@ -19,6 +19,7 @@
 #include "string.h"
 #include "halt.h"
 #include "memory.h"
+#include "spinlock.h"
 
 #include <stdint.h>
 
@@ -32,6 +33,7 @@ char heap_initialized = 0;
 
 static void * heap_start;
 static void * heap_end;
+static struct spinlock heap_lock;
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -41,11 +43,14 @@ void heap_init(void * start, void * end) {
     assert (start < end);
     heap_start = start;
     heap_end = end;
+    spinlock_init(&heap_lock, "heap");
     heap_initialized = 1;
 }
 
 void * kmalloc(size_t size) {
     void * new_block;
+    void * block;
+    int saved_intr_state;
 
     trace("%s(%zu)", __func__, size);
 
@@ -57,11 +62,17 @@ void * kmalloc(size_t size) {
     
     // If the request fits in the current heap block, allocate from it.
 
+    saved_intr_state = spin_lock_irqsave(&heap_lock);
+
     if (size <= heap_end - heap_start) {
         heap_end -= size;
-        return heap_end;
+        block = heap_end;
+        spin_unlock_irqrestore(&heap_lock, saved_intr_state);
+        return block;
     }
 
+    spin_unlock_irqrestore(&heap_lock, saved_intr_state);
+
     // The request is no more than a page, but we don't have room for it in the
     // current block of heap memory. Get a direct-mapped page of physical memory
     // from the memory manager.
@@ -72,13 +83,18 @@ void * kmalloc(size_t size) {
     // switch to the new one, or just use the new block for this request and
     // stay with the current block?
 
+    saved_intr_state = spin_lock_irqsave(&heap_lock);
+
     if (heap_end - heap_start < PAGE_SIZE - size) {
         // switch to new block
         heap_start = new_block;
         heap_end = new_block + PAGE_SIZE - size;
-        return heap_end;
+        block = heap_end;
     } else
-        return new_block;
+        block = new_block;
+    
+    spin_unlock_irqrestore(&heap_lock, saved_intr_state);
+    return block;
 }
 
 void * kcalloc(size_t n, size_t size) {
@@ -0,0 +1,169 @@
+// futex.c - Fast user-space mutex support
+//
+// Waiters are keyed by the physical address of the futex word, so threads in
+// different processes that share a page find each other. Each waiter has its
+// own condition variable and sits on the list of one of FUTEX_NBUCKET hash
+// buckets. futex_wake walks that list and signals matching waiters only.
+//
+
+#ifdef FUTEX_TRACE
+#define TRACE
+#endif
+
+#ifdef FUTEX_DEBUG
+#define DEBUG
+#endif
+
+#include "futex.h"
+
+#include "console.h"
+#include "error.h"
+#include "halt.h"
+#include "intr.h"
+#include "memory.h"
+#include "thread.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// FUTEX_NBUCKET is the number of hash buckets (must be a power of two)
+
+#ifndef FUTEX_NBUCKET
+#define FUTEX_NBUCKET 64
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct futex_waiter {
+    struct futex_waiter * next;
+    uintptr_t key; // physical address of futex word
+    struct condition cond;
+    char woken;
+};
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct futex_waiter * futex_buckets[FUTEX_NBUCKET];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static uintptr_t futex_key(volatile int * uaddr);
+static struct futex_waiter ** futex_bucket(uintptr_t key);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int futex_wait(volatile int * uaddr, int val, uint64_t tcnt) {
+    const uintptr_t key = futex_key(uaddr);
+    struct futex_waiter ** pp;
+    struct futex_waiter w;
+    int saved_intr_state;
+    int result;
+
+    trace("%s(uaddr=%p,val=%d,tcnt=%lu)", __func__, uaddr, val, tcnt);
+
+    if (key == 0)
+        return -EINVAL;
+
+    condition_init(&w.cond, "futex");
+    w.key = key;
+    w.woken = 0;
+
+    // With interrupts disabled, no other thread can change the futex word or
+    // call futex_wake between our check and the start of the wait.
+
+    saved_intr_state = intr_disable();
+
+    if (*uaddr != val) {
+        intr_restore(saved_intr_state);
+        return -EAGAIN;
+    }
+
+    pp = futex_bucket(key);
+    w.next = *pp;
+    *pp = &w;
+
+    if (tcnt != 0)
+        result = condition_wait_timeout_intr(&w.cond, tcnt);
+    else
+        result = condition_wait_intr(&w.cond);
+
+    // On timeout or interrupt we are still on the bucket list. A wake that came in after
+    // the timeout counts.
+
+    if (!w.woken) {
+        for (pp = futex_bucket(key); *pp != &w; pp = &(*pp)->next)
+            assert (*pp != NULL);
+        *pp = w.next;
+    } else
+        result = 0;
+
+    intr_restore(saved_intr_state);
+    return result;
+}
+
+int futex_wake(volatile int * uaddr, int cnt) {
+    const uintptr_t key = futex_key(uaddr);
+    struct futex_waiter ** pp;
+    struct futex_waiter * w;
+    int saved_intr_state;
+    int n;
+
+    trace("%s(uaddr=%p,cnt=%d)", __func__, uaddr, cnt);
+
+    if (key == 0)
+        return -EINVAL;
+
+    n = 0;
+    saved_intr_state = intr_disable();
+
+    // The bucket list is in LIFO order, so wake the waiters that have waited
+    // longest by waking from the end. Walking to the end is cheap since
+    // buckets are short.
+
+    while (n < cnt) {
+        w = NULL;
+        for (pp = futex_bucket(key); *pp != NULL; pp = &(*pp)->next) {
+            if ((*pp)->key == key)
+                w = *pp;
+        }
+
+        if (w == NULL)
+            break;
+
+        for (pp = futex_bucket(key); *pp != w; pp = &(*pp)->next)
+            continue;
+        *pp = w->next;
+
+        w->woken = 1;
+        condition_signal(&w->cond);
+        n += 1;
+    }
+
+    intr_restore(saved_intr_state);
+    return n;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+uintptr_t futex_key(volatile int * uaddr) {
+    if ((uintptr_t)uaddr % sizeof(int) != 0)
+        return 0;
+
+    return memory_translate((const void*)uaddr, PTE_R | PTE_U);
+}
+
+struct futex_waiter ** futex_bucket(uintptr_t key) {
+    // Futex words are at least int-aligned; mix in the page number so that
+    // futexes at the same offset in different pages spread out.
+
+    const uintptr_t h = (key >> 2) ^ (key >> PAGE_ORDER);
+    return &futex_buckets[h % FUTEX_NBUCKET];
+}
@@ -0,0 +1,25 @@
+// futex.h - Fast user-space mutex support
+//
+
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <stdint.h>
+
+// int futex_wait(volatile int * uaddr, int val, uint64_t tcnt)
+// If the int at user address /uaddr/ still holds /val/, waits until another
+// thread calls futex_wake on the same location, or for /tcnt/ timer ticks if
+// /tcnt/ is not zero. The check and the start of the wait are atomic with
+// respect to futex_wake. Returns 0 when woken, -EAGAIN if the value differed,
+// -ETIMEDOUT on timeout and -EINVAL if /uaddr/ is not a mapped, aligned user
+// address.
+
+extern int futex_wait(volatile int * uaddr, int val, uint64_t tcnt);
+
+// int futex_wake(volatile int * uaddr, int cnt)
+// Wakes up to /cnt/ threads waiting on user address /uaddr/. Returns the
+// number of threads woken or -EINVAL.
+
+extern int futex_wake(volatile int * uaddr, int cnt);
+
+#endif // _FUTEX_H_
@@ -0,0 +1,81 @@
+// idmap.c - Identifier allocator
+//
+
+#include "idmap.h"
+#include "error.h"
+#include "halt.h"
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void idmap_init (
+    struct idmap * map, uint64_t * free, uint64_t * summary,
+    unsigned int size)
+{
+    const unsigned int nwords = IDMAP_WORDS(size);
+    unsigned int i;
+
+    map->size = size;
+    map->free = free;
+    map->summary = summary;
+
+    for (i = 0; i < nwords; i++)
+        free[i] = UINT64_MAX;
+    
+    // Bits past the end of the id space are never free
+
+    if (size % 64 != 0)
+        free[nwords-1] = (UINT64_C(1) << (size % 64)) - 1;
+    
+    for (i = 0; i < IDMAP_SUMMARY_WORDS(size); i++)
+        summary[i] = 0;
+    
+    for (i = 0; i < nwords; i++)
+        summary[i / 64] |= UINT64_C(1) << (i % 64);
+}
+
+int idmap_alloc(struct idmap * map) {
+    unsigned int i, w, b;
+
+    for (i = 0; i < IDMAP_SUMMARY_WORDS(map->size); i++) {
+        if (map->summary[i] != 0) {
+            w = 64 * i + __builtin_ctzl(map->summary[i]);
+            b = __builtin_ctzl(map->free[w]);
+
+            map->free[w] &= ~(UINT64_C(1) << b);
+            if (map->free[w] == 0)
+                map->summary[i] &= ~(UINT64_C(1) << (w % 64));
+            
+            return 64 * w + b;
+        }
+    }
+
+    return -1;
+}
+
+int idmap_reserve(struct idmap * map, int id) {
+    const unsigned int w = id / 64;
+    const uint64_t mask = UINT64_C(1) << (id % 64);
+
+    assert (0 <= id && id < map->size);
+
+    if ((map->free[w] & mask) == 0)
+        return -EBUSY;
+    
+    map->free[w] &= ~mask;
+    if (map->free[w] == 0)
+        map->summary[w / 64] &= ~(UINT64_C(1) << (w % 64));
+
+    return 0;
+}
+
+void idmap_free(struct idmap * map, int id) {
+    const unsigned int w = id / 64;
+    const uint64_t mask = UINT64_C(1) << (id % 64);
+
+    assert (0 <= id && id < map->size);
+    assert ((map->free[w] & mask) == 0);
+
+    map->free[w] |= mask;
+    map->summary[w / 64] |= UINT64_C(1) << (w % 64);
+}
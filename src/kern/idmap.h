@@ -0,0 +1,49 @@
+// idmap.h - Identifier allocator
+//
+
+#ifndef _IDMAP_H_
+#define _IDMAP_H_
+
+#include <stdint.h>
+
+// An idmap hands out small integer identifiers (e.g. thread and process ids),
+// always the lowest free one. Free ids are kept in a bitmap with one bit per
+// id, and a second-level bitmap with one bit per word of the first, so that
+// allocating and freeing an id takes a couple of count-trailing-zeroes
+// operations rather than a scan of the id space. The caller provides the
+// storage for both bitmaps, sized using IDMAP_WORDS and IDMAP_SUMMARY_WORDS.
+
+#define IDMAP_WORDS(n) (((n) + 63) / 64)
+#define IDMAP_SUMMARY_WORDS(n) IDMAP_WORDS(IDMAP_WORDS(n))
+
+struct idmap {
+    unsigned int size; // number of ids
+    uint64_t * free; // bit set if id is free
+    uint64_t * summary; // bit set if word of /free/ is non-zero
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Initializes an idmap for ids 0 to /size/-1, all of which are initially
+// free. The /free/ array must have IDMAP_WORDS(size) elements and the
+// /summary/ array IDMAP_SUMMARY_WORDS(size) elements.
+
+extern void idmap_init (
+    struct idmap * map, uint64_t * free, uint64_t * summary,
+    unsigned int size);
+
+// Allocates the lowest free id. Returns the id, or -1 if all ids are in use.
+
+extern int idmap_alloc(struct idmap * map);
+
+// Marks a specific id as allocated. Returns 0 on success and -EBUSY if the id
+// is already in use.
+
+extern int idmap_reserve(struct idmap * map, int id);
+
+// Returns an id to the free pool.
+
+extern void idmap_free(struct idmap * map, int id);
+
+#endif // _IDMAP_H_
@@ -105,10 +105,13 @@ void intr_handler(int code, struct trap_frame * tfr) {
         break;
     }
 
-    // If we were running user mode, yield thread.
+    // If we were running user mode, yield thread. The kernel is preempted
+    // only if the interrupt made a more urgent thread ready.
 
     if ((tfr->sstatus & RISCV_SSTATUS_SPP) == 0)
-        thread_yield();
+        thread_preempt();
+    else
+        preempt_intr_return();
 }
 
 // INTERNAL FUNCTION DEFINITIONS
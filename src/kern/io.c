@@ -4,11 +4,24 @@
 #include "io.h"
 #include "string.h"
 #include "error.h"
+#include "intr.h"
+#include "thread.h"
+#include "memory.h"
 
 #include <stddef.h>
 #include <stdint.h>
 // #include <console.h>
 
+// COMPILE-TIME PARAMETERS
+//
+
+// Number of worker threads that serve requests submitted with
+// iosubmit_generic
+
+#ifndef IO_ASYNC_WORKERS
+#define IO_ASYNC_WORKERS 4
+#endif
+
 //           INTERNAL TYPE DEFINITIONS
 //          
 
@@ -17,6 +30,17 @@ struct iovprintf_state {
     int err;
 };
 
+// A snapshot file lives in a single page, see iosnap_alloc
+
+struct io_snap {
+    struct io_intf io_intf;
+    size_t len;
+    size_t pos;
+    char buf[]; // rest of page
+};
+
+#define IOSNAP_BUFSZ (PAGE_SIZE - offsetof(struct io_snap, buf))
+
 
 
 //           INTERNAL FUNCTION DECLARATIONS
@@ -30,13 +54,44 @@ static int ioterm_ioctl(struct io_intf * io, int cmd, void * arg);
 static long iolit_read(struct io_intf * io, void * buf, size_t len);
 static long iolit_write(struct io_intf * io, const void * buf, size_t len);
 static int iolit_ioctl(struct io_intf * io, int cmd, void * arg);
+static long iolit_readat(struct io_intf * io,
+    unsigned long long pos, void * buf, unsigned long len);
+static long iolit_writeat(struct io_intf * io,
+    unsigned long long pos, const void * buf, unsigned long len);
 // static void iolit_close(struct io_intf * io);
 
+static void iosnap_close(struct io_intf * io);
+static long iosnap_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static int iosnap_ioctl(struct io_intf * io, int cmd, void * arg);
+
 
 
 
 static void iovprintf_putc(char c, void * aux);
 
+static void io_async_worker(void);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Requests waiting for a generic worker, oldest first
+
+static struct io_req * io_queue_head;
+static struct io_req * io_queue_tail;
+static char io_workers_started;
+
+static struct condition io_queue_ready = {
+    .name = "io.queue",
+    .wait_list = { NULL, NULL }
+};
+
+// Broadcast whenever a request completes
+
+static struct condition io_req_done = {
+    .name = "io.done",
+    .wait_list = { NULL, NULL }
+};
+
 //           EXPORTED FUNCTION DEFINITIONS
 //          
 
@@ -76,7 +131,140 @@ long iowrite(struct io_intf * io, const void * buf, unsigned long n) {
     return acc;
 }
 
-//           Initialize an io_lit. This function should be called with an io_lit, a buffer, and the size of the device.
+long iowriteat(struct io_intf * io, unsigned long long pos, const void * buf, unsigned long n) {
+    long cnt, acc = 0;
+    int result;
+
+    if (io->ops->writeat == NULL) {
+        result = ioseek(io, pos);
+        if (result < 0)
+            return result;
+        return iowrite(io, buf, n);
+    }
+
+    while (acc < n) {
+        cnt = io->ops->writeat(io, pos+acc, buf+acc, n-acc);
+        if (cnt < 0)
+            return cnt;
+        else if (cnt == 0)
+            return acc;
+        acc += cnt;
+    }
+
+    return acc;
+}
+
+int iosubmit(struct io_intf * io, struct io_req * req) {
+    if (req->op != IO_REQ_READ && req->op != IO_REQ_WRITE)
+        return -EINVAL;
+
+    req->io = io;
+    req->result = 0;
+    req->done = 0;
+
+    if (io->ops->submit != NULL)
+        return io->ops->submit(io, req);
+    else
+        return iosubmit_generic(io, req);
+}
+
+int iosubmit_generic(struct io_intf * io, struct io_req * req) {
+    int start_workers;
+    int saved_intr_state;
+    int i;
+
+    req->io = io;
+    req->next = NULL;
+
+    saved_intr_state = intr_disable();
+
+    if (io_queue_tail != NULL)
+        io_queue_tail->next = req;
+    else
+        io_queue_head = req;
+    io_queue_tail = req;
+
+    condition_signal(&io_queue_ready);
+
+    start_workers = !io_workers_started;
+    io_workers_started = 1;
+
+    intr_restore(saved_intr_state);
+
+    if (start_workers) {
+        for (i = 0; i < IO_ASYNC_WORKERS; i++)
+            thread_spawn_detached("io.async", io_async_worker, NULL);
+    }
+
+    return 0;
+}
+
+int iocancel(struct io_intf * io, struct io_req * req) {
+    struct io_req * prev = NULL;
+    struct io_req * r;
+    int saved_intr_state;
+
+    // A request still waiting for a generic worker is ours to cancel, even
+    // if the object has its own submit operation.
+
+    saved_intr_state = intr_disable();
+
+    for (r = io_queue_head; r != NULL; prev = r, r = r->next) {
+        if (r == req) {
+            if (prev != NULL)
+                prev->next = req->next;
+            else
+                io_queue_head = req->next;
+
+            if (io_queue_tail == req)
+                io_queue_tail = prev;
+
+            io_req_complete(req, -ECANCELED);
+            intr_restore(saved_intr_state);
+            return 0;
+        }
+    }
+
+    intr_restore(saved_intr_state);
+
+    if (!req->done && io->ops->cancel != NULL)
+        return io->ops->cancel(io, req);
+    else
+        return -EBUSY;
+}
+
+long iowait(struct io_req * req) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    while (!req->done)
+        condition_wait(&io_req_done);
+
+    intr_restore(saved_intr_state);
+    return req->result;
+}
+
+void io_req_complete(struct io_req * req, long result) {
+    int saved_intr_state;
+
+    req->result = result;
+
+    // The callback runs first: once done is set, a thread in iowait may
+    // return and free or reuse the request.
+
+    if (req->done_fn != NULL)
+        req->done_fn(req);
+
+    saved_intr_state = intr_disable();
+
+    req->done = 1;
+    condition_broadcast(&io_req_done);
+
+    intr_restore(saved_intr_state);
+}
+
+//           Initialize an io_lit.
 //           It should set up all fields within the io_lit struct so that I/O operations can be performed on the io_lit
 //           through the io_intf interface. This function should return a pointer to an io_intf object that can be used 
 //           to perform I/O operations on the device.
@@ -91,7 +279,9 @@ struct io_intf * iolit_init (
         .close = NULL,
         .read = iolit_read,
         .write = iolit_write,
-        .ctl = iolit_ioctl
+        .ctl = iolit_ioctl,
+        .readat = iolit_readat,
+        .writeat = iolit_writeat
     };
 
     size_t pos = 0;
@@ -154,6 +344,46 @@ static long iolit_write(struct io_intf * io, const void * buf, size_t len){
     return len;
 }
 
+/*
+Inputs: io, pos, buf, len
+Outputs: long bytes
+Purpose: Reads from the io_lit at offset pos without touching its position. Clips the read at the end of the buffer.
+*/
+long iolit_readat(struct io_intf * io, unsigned long long pos, void * buf, unsigned long len){
+    struct io_lit * const dev = (void*)io - offsetof(struct io_lit, io_intf);       // retrieve the original io_lit given the io_intf
+
+    if (pos >= dev->size){                          // nothing to read past the end
+        return 0;
+    }
+
+    if (dev->size - pos < len){                     // clip the length of the read
+        len = dev->size - pos;
+    }
+
+    memcpy(buf, (char *)dev->buf + pos, len);
+    return len;
+}
+
+/*
+Inputs: io, pos, buf, len
+Outputs: long bytes
+Purpose: Writes to the io_lit at offset pos without touching its position. Clips the write at the end of the buffer.
+*/
+long iolit_writeat(struct io_intf * io, unsigned long long pos, const void * buf, unsigned long len){
+    struct io_lit * const dev = (void*)io - offsetof(struct io_lit, io_intf);       // retrieve the original io_lit given the io_intf
+
+    if (pos >= dev->size){                          // io_lit cannot grow
+        return 0;
+    }
+
+    if (dev->size - pos < len){                     // clip the length of the write
+        len = dev->size - pos;
+    }
+
+    memcpy((char *)dev->buf + pos, buf, len);
+    return len;
+}
+
 /*
 Inputs: io, cmd, arg
 Outputs: int status
@@ -177,6 +407,72 @@ int iolit_ioctl(struct io_intf * io, int cmd, void * arg){
     }
 }
 
+char * iosnap_alloc(size_t * sizeptr) {
+    struct io_snap * const snap = memory_alloc_page();
+
+    *sizeptr = IOSNAP_BUFSZ;
+    return snap->buf;
+}
+
+struct io_intf * iosnap_init(char * buf, size_t len) {
+    static const struct io_ops iosnap_ops = {
+        .close = iosnap_close,
+        .read = iosnap_read,
+        .ctl = iosnap_ioctl
+    };
+
+    struct io_snap * const snap = (void*)buf - offsetof(struct io_snap, buf);
+
+    // snprintf returns the untruncated length
+
+    if (IOSNAP_BUFSZ <= len)
+        len = IOSNAP_BUFSZ - 1;
+
+    snap->io_intf.ops = &iosnap_ops;
+    snap->io_intf.refcnt = 1;
+    snap->len = len;
+    snap->pos = 0;
+    return &snap->io_intf;
+}
+
+void iosnap_close(struct io_intf * io) {
+    struct io_snap * const snap = (void*)io - offsetof(struct io_snap, io_intf);
+    
+    if (--io->refcnt == 0)
+        memory_free_page(snap);
+}
+
+long iosnap_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct io_snap * const snap = (void*)io - offsetof(struct io_snap, io_intf);
+    
+    if (snap->len - snap->pos < bufsz)
+        bufsz = snap->len - snap->pos;
+    
+    memcpy(buf, snap->buf + snap->pos, bufsz);
+    snap->pos += bufsz;
+    return bufsz;
+}
+
+int iosnap_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct io_snap * const snap = (void*)io - offsetof(struct io_snap, io_intf);
+    
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t*)arg = snap->len;
+        return 0;
+    case IOCTL_GETPOS:
+        *(uint64_t*)arg = snap->pos;
+        return 0;
+    case IOCTL_SETPOS:
+        if (snap->len < *(uint64_t*)arg)
+            return -EINVAL;
+        snap->pos = *(uint64_t*)arg;
+        return 0;
+    default:
+        return -ENOTSUP;
+    }
+}
+
 
 
 //           I/O term provides three features:
@@ -535,3 +831,33 @@ void iovprintf_putc(char c, void * aux) {
             state->err = result;
     }
 }
+
+// Worker thread for iosubmit_generic. Workers are shared by all processes, so
+// they do not belong to any.
+
+void io_async_worker(void) {
+    struct io_req * req;
+    int saved_intr_state;
+    long result;
+
+    for (;;) {
+        saved_intr_state = intr_disable();
+
+        while (io_queue_head == NULL)
+            condition_wait(&io_queue_ready);
+
+        req = io_queue_head;
+        io_queue_head = req->next;
+        if (io_queue_head == NULL)
+            io_queue_tail = NULL;
+
+        intr_restore(saved_intr_state);
+
+        if (req->op == IO_REQ_READ)
+            result = ioreadat(req->io, req->pos, req->buf, req->len);
+        else
+            result = iowriteat(req->io, req->pos, req->buf, req->len);
+
+        io_req_complete(req, result);
+    }
+}
@@ -14,6 +14,7 @@
 //
 
 struct io_intf; // forward decl.
+struct io_req; // forward decl.
 
 // I/O operations provided by the interface. Do not call these directly, use the
 // function below instead (e.g. ioread). The /read/ function is allowed to read
@@ -21,13 +22,23 @@ struct io_intf; // forward decl.
 // from /read/ indicates an end-of-file condition. The /write/ function is
 // allowed to write fewer than /n/ bytes, but must write at least one. A return
 // value of 0 from /write/ indicates an end-of-file condition (for files that
-// cannot grow).
+// cannot grow). The optional /readat/ and /writeat/ functions behave like
+// /read/ and /write/, but transfer data at byte offset /pos/ and neither use
+// nor change the current position, so concurrent callers do not race on it.
+// The optional /submit/ function starts an asynchronous request and returns
+// without waiting for it, and /cancel/ tries to stop one; see iosubmit.
 
 struct io_ops {
 	void (*close)(struct io_intf * io);
 	long (*read)(struct io_intf * io, void * buf, unsigned long bufsz);
 	long (*write)(struct io_intf * io, const void * buf, unsigned long n);
 	int (*ctl)(struct io_intf * io, int cmd, void * arg);
+	long (*readat)(struct io_intf * io,
+		unsigned long long pos, void * buf, unsigned long bufsz);
+	long (*writeat)(struct io_intf * io,
+		unsigned long long pos, const void * buf, unsigned long n);
+	int (*submit)(struct io_intf * io, struct io_req * req);
+	int (*cancel)(struct io_intf * io, struct io_req * req);
 };
 
 struct io_intf {
@@ -49,6 +60,31 @@ struct io_term {
     int8_t cr_in;
 };
 
+// An asynchronous request to read or write /len/ bytes at byte offset /pos/.
+// The submitter fills in the fields up to /aux/ and must not touch the request
+// again until it is done. On completion, /result/ holds what ioreadat or
+// iowriteat would have returned, /done_fn/, if not NULL, is called, and then
+// /done/ is set, after which the request is no longer used. The callback may
+// run in an interrupt handler, so it must not sleep.
+
+struct io_req {
+    int op; // IO_REQ_READ or IO_REQ_WRITE
+    unsigned long long pos;
+    void * buf;
+    unsigned long len;
+    void (*done_fn)(struct io_req * req);
+    void * aux; // for done_fn
+    long result;
+    volatile char done;
+    // The fields below are private to the implementation
+    struct io_intf * io;
+    struct io_req * next;
+    int pending;
+};
+
+#define IO_REQ_READ         1
+#define IO_REQ_WRITE        2
+
 // IOCTL numbers (0..7 are reserved)
 
 #define IOCTL_GETLEN        1   // arg is pointer to uint64_t
@@ -57,6 +93,25 @@ struct io_term {
 #define IOCTL_SETPOS        4   // arg is pointer to uint64_t
 #define IOCTL_FLUSH         5   // arg is ignored
 #define IOCTL_GETBLKSZ      6   // arg is pointer to uint32_t
+#define IOCTL_ADVISE        7   // arg is pointer to int (IOADV_*)
+#define IOCTL_DISCARD       8   // arg is pointer to struct io_range
+#define IOCTL_WRITE_ZEROES  9   // arg is pointer to struct io_range
+
+// Access pattern advice for IOCTL_ADVISE
+
+#define IOADV_NORMAL        0   // detect sequential access
+#define IOADV_SEQUENTIAL    1   // read ahead aggressively
+#define IOADV_RANDOM        2   // do not read ahead
+
+// Byte range for IOCTL_DISCARD and IOCTL_WRITE_ZEROES. After IOCTL_DISCARD,
+// the contents of the range are unspecified; after IOCTL_WRITE_ZEROES, the
+// range reads as zeros. Block devices require both fields to be multiples of
+// the block size.
+
+struct io_range {
+    uint64_t pos;
+    uint64_t len;
+};
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -111,6 +166,62 @@ extern long
 __attribute__ ((nonnull(1,2)))
 iowrite(struct io_intf * io, const void * buf, unsigned long n);
 
+// The ioreadat and iowriteat functions are like ioread and iowrite, but read
+// or write at byte offset /pos/ without using the current position. If the
+// object does not provide readat or writeat, they fall back to seeking and
+// then reading or writing, which is not safe against concurrent callers.
+
+static inline long
+__attribute__ ((nonnull(1,3)))
+ioreadat (
+    struct io_intf * io, unsigned long long pos,
+    void * buf, unsigned long bufsz);
+
+extern long
+__attribute__ ((nonnull(1,3)))
+iowriteat (
+    struct io_intf * io, unsigned long long pos,
+    const void * buf, unsigned long n);
+
+// The iosubmit function starts asynchronous request /req/ on the I/O object
+// and returns without waiting for it to complete. Objects that do not provide
+// a submit operation, or that cannot serve a particular request themselves,
+// use iosubmit_generic, which hands the request to a pool of worker threads
+// that call ioreadat or iowriteat. The buffer of a request served by a worker
+// must therefore be a kernel address, and the object must stay open until the
+// request is done. Returns 0 if the request was started or a negative error
+// code (in which case it will not complete).
+
+extern int
+__attribute__ ((nonnull(1,2)))
+iosubmit(struct io_intf * io, struct io_req * req);
+
+extern int
+__attribute__ ((nonnull(1,2)))
+iosubmit_generic(struct io_intf * io, struct io_req * req);
+
+// The iocancel function tries to stop a submitted request. A request that has
+// not started yet completes with result -ECANCELED and iocancel returns 0.
+// Returns -EBUSY if the request is already in progress or done.
+
+extern int
+__attribute__ ((nonnull(1,2)))
+iocancel(struct io_intf * io, struct io_req * req);
+
+// The iowait function waits until a submitted request is done and returns its
+// result.
+
+extern long
+__attribute__ ((nonnull(1)))
+iowait(struct io_req * req);
+
+// Called by implementations of submit when a request is done. May be called
+// from an interrupt handler.
+
+extern void
+__attribute__ ((nonnull(1)))
+io_req_complete(struct io_req * req, long result);
+
 // The ioctl function invokes special functions on the I/O object. See the IOCTL
 // numbers defined above.
 
@@ -164,6 +275,20 @@ extern struct io_intf *
 __attribute__ ((nonnull(1,2)))
 iolit_init(struct io_lit * lit, void * buf, size_t size);
 
+// A snapshot file is a read-only text file that is produced in one go, such as
+// the statistics a device returns when it is opened. It lives in a page that
+// is freed when the file is closed. iosnap_alloc allocates the page and returns
+// the text buffer, setting /*sizeptr/ to its size. After writing the text, the
+// caller passes its length to iosnap_init, which returns the file. A length
+// that does not fit, like the untruncated length snprintf returns, is cut to
+// the buffer.
+
+extern char * iosnap_alloc(size_t * sizeptr);
+
+extern struct io_intf *
+__attribute__ ((nonnull(1)))
+iosnap_init(char * buf, size_t len);
+
 // An io_term object is a wrapper around a "raw" I/O object. It provides newline
 // conversion and interactive line-editing for string input.
 //
@@ -205,6 +330,22 @@ static inline long ioread (
         return -ENOTSUP;
 }
 
+static inline long ioreadat (
+    struct io_intf * io, unsigned long long pos,
+    void * buf, unsigned long bufsz)
+{
+    int result;
+
+    if (io->ops->readat)
+        return io->ops->readat(io, pos, buf, bufsz);
+    
+    result = ioseek(io, pos);
+    if (result < 0)
+        return result;
+    
+    return ioread(io, buf, bufsz);
+}
+
 static inline int ioctl(struct io_intf * io, int cmd, void * arg) {
     if (io->ops->ctl)
         return io->ops->ctl(io, cmd, arg);
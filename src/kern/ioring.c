@@ -0,0 +1,282 @@
+// ioring.c - Shared submission and completion rings
+//
+// See ../user/ioring.h for the layout of the shared page. Each process with a
+// ring has a kernel worker thread that runs in the process's memory space and
+// executes submitted operations one at a time, so the submitting thread can
+// return to user mode right away.
+//
+
+#ifdef IORING_TRACE
+#define TRACE
+#endif
+
+#ifdef IORING_DEBUG
+#define DEBUG
+#endif
+
+#include "process.h"
+#include "../user/ioring.h"
+
+#include "config.h"
+#include "console.h"
+#include "error.h"
+#include "halt.h"
+#include "heap.h"
+#include "intr.h"
+#include "io.h"
+#include "memory.h"
+#include "string.h"
+#include "thread.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct ioring_ctx {
+    struct ioring * ring; // shared page (user address)
+    struct process * proc;
+    int worker_tid;
+    uint32_t sq_submitted; // SQ index up to which entries were submitted
+    uint32_t sq_done; // number of operations completed
+    char closing; // set by ioring_release
+    char worker_done; // set by worker when it stops touching the ring
+    struct condition sq_ready; // signalled on submit and on release
+    struct condition cq_ready; // signalled when a CQE is posted
+    struct condition cq_space; // signalled when the process may have reaped
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void ioring_worker(struct ioring_ctx * ctx);
+static int64_t ioring_execute(struct process * proc,
+    const struct ioring_sqe * sqe);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int64_t ioring_setup(struct process * proc) {
+    struct ioring_ctx * ctx;
+    int tid;
+
+    trace("%s() in process %d", __func__, proc->id);
+
+    if (proc->ioring != NULL)
+        return -EBUSY;
+
+    ctx = kmalloc(sizeof(struct ioring_ctx));
+    memset(ctx, 0, sizeof(struct ioring_ctx));
+
+    ctx->ring = memory_alloc_and_map_page(IORING_VMA, PTE_R | PTE_W | PTE_U);
+    memset(ctx->ring, 0, PAGE_SIZE);
+
+    ctx->proc = proc;
+    condition_init(&ctx->sq_ready, "ioring.sq_ready");
+    condition_init(&ctx->cq_ready, "ioring.cq_ready");
+    condition_init(&ctx->cq_space, "ioring.cq_space");
+
+    // The worker inherits our process and hence our memory space
+
+    tid = thread_spawn("ioring", (void (*)(void))ioring_worker, ctx);
+
+    if (tid < 0) {
+        kfree(ctx);
+        return tid;
+    }
+
+    ctx->worker_tid = tid;
+    proc->ioring = ctx;
+
+    return (int64_t)ctx->ring;
+}
+
+int ioring_enter(struct process * proc,
+    unsigned int to_submit, unsigned int min_complete)
+{
+    struct ioring_ctx * const ctx = proc->ioring;
+    struct ioring * ring;
+    int saved_intr_state;
+    uint32_t n;
+
+    trace("%s(to_submit=%u,min_complete=%u) in process %d",
+        __func__, to_submit, min_complete, proc->id);
+
+    if (ctx == NULL)
+        return -EINVAL;
+
+    ring = ctx->ring;
+
+    saved_intr_state = intr_disable();
+
+    // Submit up to /to_submit/ new entries. The indices come from user
+    // memory, so do not trust them to be consistent.
+
+    n = ring->sq_tail - ctx->sq_submitted;
+
+    if (IORING_SQ_ENTRIES < n)
+        n = 0;
+    if (to_submit < n)
+        n = to_submit;
+
+    if (n != 0) {
+        ctx->sq_submitted += n;
+        condition_broadcast(&ctx->sq_ready);
+    }
+
+    // The process may have reaped CQEs since we last looked
+
+    condition_broadcast(&ctx->cq_space);
+
+    // Wait until /min_complete/ CQEs are available or nothing is in flight.
+    // If we are interrupted, the process is exiting and nobody will look at
+    // the CQEs.
+
+    while (ring->cq_tail - ring->cq_head < min_complete &&
+        ctx->sq_done != ctx->sq_submitted)
+    {
+        if (condition_wait_intr(&ctx->cq_ready) < 0)
+            break;
+    }
+
+    intr_restore(saved_intr_state);
+
+    return n;
+}
+
+void ioring_release(struct process * proc) {
+    struct ioring_ctx * const ctx = proc->ioring;
+    int saved_intr_state;
+
+    if (ctx == NULL)
+        return;
+
+    trace("%s() in process %d", __func__, proc->id);
+
+    // Stop the worker before the ring page goes away with the memory space.
+    // It finishes the operation it is working on, if any. An operation that
+    // may never finish, like a console read, is interrupted.
+
+    saved_intr_state = intr_disable();
+
+    ctx->closing = 1;
+    condition_broadcast(&ctx->sq_ready);
+    condition_broadcast(&ctx->cq_space);
+
+    if (!ctx->worker_done)
+        thread_interrupt(ctx->worker_tid);
+
+    while (!ctx->worker_done)
+        condition_wait(&ctx->cq_ready);
+
+    intr_restore(saved_intr_state);
+
+    // If we started the worker, collect it. Otherwise it is collected by its
+    // parent like any other thread.
+
+    thread_join(ctx->worker_tid);
+
+    proc->ioring = NULL;
+    kfree(ctx);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void ioring_worker(struct ioring_ctx * ctx) {
+    struct ioring * const ring = ctx->ring;
+    struct ioring_sqe sqe;
+    struct ioring_cqe * cqe;
+    int saved_intr_state;
+    int64_t res;
+
+    saved_intr_state = intr_disable();
+
+    for (;;) {
+        while (!ctx->closing && ring->sq_head == ctx->sq_submitted)
+            condition_wait(&ctx->sq_ready);
+
+        if (ctx->closing)
+            break;
+
+        // Copy the SQE and release its slot before executing it
+
+        sqe = ring->sq[ring->sq_head % IORING_SQ_ENTRIES];
+        __sync_synchronize();
+        ring->sq_head += 1;
+
+        intr_restore(saved_intr_state);
+        res = ioring_execute(ctx->proc, &sqe);
+        saved_intr_state = intr_disable();
+
+        // Post the completion, waiting for the process to make room if the
+        // CQ is full
+
+        while (!ctx->closing &&
+            IORING_CQ_ENTRIES <= ring->cq_tail - ring->cq_head)
+            condition_wait(&ctx->cq_space);
+
+        if (ctx->closing)
+            break;
+
+        cqe = &ring->cq[ring->cq_tail % IORING_CQ_ENTRIES];
+        cqe->user_data = sqe.user_data;
+        cqe->res = res;
+        __sync_synchronize();
+        ring->cq_tail += 1;
+
+        ctx->sq_done += 1;
+        condition_broadcast(&ctx->cq_ready);
+    }
+
+    // We do not switch threads between here and thread_exit, so the process
+    // may tear down its memory space as soon as it sees worker_done.
+
+    ctx->worker_done = 1;
+    condition_broadcast(&ctx->cq_ready);
+    thread_set_process(running_thread(), NULL);
+    thread_exit();
+}
+
+int64_t ioring_execute(struct process * proc, const struct ioring_sqe * sqe) {
+    struct io_intf * io;
+    int64_t res;
+
+    debug("ioring op %d fd %d len %lu", sqe->op, sqe->fd, sqe->len);
+
+    if (sqe->op == IORING_OP_NOP)
+        return 0;
+
+    if (sqe->fd < 0 || PROCESS_IOMAX <= sqe->fd || proc->iotab[sqe->fd] == NULL)
+        return -EBADFD;
+
+    // Hold a reference so that the file stays open while we use it
+
+    io = proc->iotab[sqe->fd];
+    ioref(io);
+
+    switch (sqe->op) {
+    case IORING_OP_READ:
+        if (sqe->off == IORING_OFF_CUR)
+            res = ioread(io, (void*)sqe->addr, sqe->len);
+        else
+            res = ioreadat(io, sqe->off, (void*)sqe->addr, sqe->len);
+        break;
+    case IORING_OP_WRITE:
+        if (sqe->off == IORING_OFF_CUR)
+            res = iowrite(io, (const void*)sqe->addr, sqe->len);
+        else
+            res = iowriteat(io, sqe->off, (const void*)sqe->addr, sqe->len);
+        break;
+    case IORING_OP_IOCTL:
+        res = ioctl(io, (int)sqe->len, (void*)sqe->addr);
+        break;
+    default:
+        res = -EINVAL;
+        break;
+    }
+
+    ioclose(io);
+    return res;
+}
@@ -3,23 +3,45 @@
 #include <string.h>
 #include "console.h"
 #include "lock.h"
+#include "spinlock.h"
+#include "bcache.h"
 
 #define IN_USE      1
 #define UNUSED      0
 #define FS_BLKSZ      4096
 #define FS_NAMELEN    32
 
+// Read-ahead window limits, in blocks
+
+#ifndef FS_RA_MIN
+#define FS_RA_MIN     4
+#endif
+
+#ifndef FS_RA_MAX
+#define FS_RA_MAX     32
+#endif
+
 extern char _companion_f_start[];
 extern char _companion_f_end[];
 
-struct lock kfs_lock;
+// kfs_lock is taken shared by lookups and reads and exclusively by writes.
+// files_lock protects the flags of the open file table.
+
+struct rwlock kfs_lock;
+static struct spinlock files_lock;
 
 struct file_t{
     struct io_intf io_intf;
+    struct lock lock;       // serializes use of position
     uint64_t position;
     uint64_t file_size;
     uint64_t inode;
     uint64_t flags;
+    struct spinlock ra_lock; // protects advice and the read-ahead state below
+    uint64_t ra_next;       // position after the last read, for sequential access detection
+    uint64_t ra_end;        // file block up to which read-ahead has been issued
+    uint32_t ra_window;     // current read-ahead window in blocks
+    int advice;             // IOADV_* from IOCTL_ADVISE
 };
 
 typedef struct dentry_t{
@@ -46,11 +68,21 @@ int fs_open(const char * name, struct io_intf ** ioptr);
 void fs_close(struct io_intf * io);
 long fs_write(struct io_intf * io, const void* buf, unsigned long n);
 long fs_read(struct io_intf * io, void* buf, unsigned long n);
+long fs_writeat(struct io_intf * io, unsigned long long pos, const void* buf, unsigned long n);
+long fs_readat(struct io_intf * io, unsigned long long pos, void* buf, unsigned long n);
+int fs_submit(struct io_intf * io, struct io_req * req);
 int fs_ioctl(struct io_intf * io, int cmd, void* arg);
 int fs_getlen(struct file_t * fd, void* arg);
+int fs_setlen(struct file_t * fd, void* arg);
 int fs_getpos(struct file_t * fd, void* arg);
 int fs_setpos(struct file_t * fd, void* arg);
 int fs_getblksz(struct file_t * fd, void* arg);
+int fs_advise(struct file_t * fd, void* arg);
+int fs_flush(struct file_t * fd);
+int fs_zero(struct file_t * fd, void* arg);
+static void fs_readahead(struct file_t * fd, uint64_t pos, uint64_t n);
+static int fs_data_loc(uint64_t inode, uint64_t inode_offset, uint64_t * locptr);
+static int fs_cached(struct file_t * fd, uint64_t pos, uint64_t n);
 
 
 struct file_t files[32]; // global array for open files
@@ -63,25 +95,46 @@ static const struct io_ops file_ops = {         // ops are the same for all file
     .close = fs_close,
     .ctl = fs_ioctl,
     .read = fs_read,
-    .write = fs_write
+    .write = fs_write,
+    .readat = fs_readat,
+    .writeat = fs_writeat,
+    .submit = fs_submit
 };
 
 /*
 Inputs: blkio
 Outputs: int status
 Purpose: takes in a pointer and reads data from it into a filesystem. Can create a filesystem from any io_intf pointer.
-        Reads  4096 bytes from device or io_lit to set up boot_block with all the necessary information.
+        Reads  4096 bytes from device or io_lit to set up boot_block with all the necessary information. All reads and
+        writes of the device go through the buffer cache, which first writes back and then forgets anything it
+        cached for an earlier device at the same address.
 */
 
 int fs_mount(struct io_intf * blkio){
+    int result;
+    int j;
 
     if (blkio == NULL){             // return error if NULL incoming pointer
         return -1;
     }
 
-    ioseek(blkio, 0);               // set posiiton of device to 0
+    rwlock_init(&kfs_lock, "kfs_lock");
+    spinlock_init(&files_lock, "kfs_files");
+    for (j = 0; j < 32; j++){
+        spinlock_init(&files[j].ra_lock, "kfs_ra");
+    }
+
     vioblk = blkio;
-    ioread(blkio, &boot_block, 4096);   // read in boot block from device
+
+    result = bcache_sync(blkio);    // invalidating drops dirty buffers, so write them back first
+    if (result != 0){
+        return result;
+    }
+
+    bcache_invalidate(blkio);
+    if (bcache_readat(blkio, 0, &boot_block, 4096) != 4096){   // read in boot block from device
+        return -EIO;
+    }
 
     return 0;
 }
@@ -96,27 +149,37 @@ Purpose: Finds an open slot in the open files array and stores the information o
 
 int fs_open(const char * name, struct io_intf ** ioptr){
 
-    
-    lock_init(&kfs_lock, "kfs_lock");
-    
     int i = 0;
+    rwlock_acquire_read(&kfs_lock);                     // directory lookup only reads metadata
     // console_printf("%s\n", boot_block.dir_entries[i].file_name);
     // console_printf("%s\n", name);
     while (i < 63){
         if (strcmp((char*)boot_block.dir_entries[i].file_name, (char*)name) == 0){      // check for the correct file using the name
             uint64_t inode = boot_block.dir_entries[i].inode;                           
-            ioseek(vioblk, 4096 + FS_BLKSZ*inode);                                      // change position for current inode from the device
-            inode_t inode_obj;
-            ioread(vioblk, &inode_obj, 4096);                          // read in current inode
+            uint32_t byte_len;
+            long result = bcache_readat(vioblk, FS_BLKSZ + FS_BLKSZ*inode, &byte_len, sizeof(byte_len));   // read file size from the inode
+            rwlock_release_read(&kfs_lock);
+
+            if (result != sizeof(byte_len)){
+                return -EIO;
+            }
             
-            uint64_t size = inode_obj.byte_len;
+            uint64_t size = byte_len;
             int j = 0;
+            int s = spin_lock_irqsave(&files_lock);
             while (j < 32){
                 if (files[j].flags == UNUSED){                                          // check for open spot in array and store curr file info into there
-                    files[j].position = 0;
                     files[j].flags = IN_USE;
+                    spin_unlock_irqrestore(&files_lock, s);
+
+                    files[j].position = 0;
                     files[j].inode = inode;
                     files[j].file_size = size;
+                    files[j].ra_next = 0;
+                    files[j].ra_end = 0;
+                    files[j].ra_window = 0;
+                    files[j].advice = IOADV_NORMAL;
+                    lock_init(&files[j].lock, "kfs_file");
                 
                     files[j].io_intf.ops = &file_ops;
                     // files[j].io_intf.refcnt = 0;                                    
@@ -128,13 +191,15 @@ int fs_open(const char * name, struct io_intf ** ioptr){
 
                 j++;
             }
+            spin_unlock_irqrestore(&files_lock, s);
 
-            return -2;                                                      // return error for full file struct
+            return -EMFILE;                                                 // return error for full file struct
         }
 
         i++;
     }
 
+    rwlock_release_read(&kfs_lock);
     return -ENOENT;                                             // return error for not finding file
 }
 
@@ -146,205 +211,215 @@ Purpose: Closes a file in the file system by setting its flag to UNUSED. The pos
 
 void fs_close(struct io_intf * io){
     if (--io->refcnt == 0) {                                // only close if ref count is 0
-        int i = 0;
-
-        while (i < 32){
-            if (&files[i].io_intf == io){
-                files[i].flags = UNUSED;                    // set current file from io_intf to Unused which opens up that slot
-            }
-
-            i++;
-        }
+        struct file_t * curr = (void *)io - offsetof(struct file_t, io_intf);      // find file for io_intf
+        int s = spin_lock_irqsave(&files_lock);
+        curr->flags = UNUSED;                               // set current file from io_intf to Unused which opens up that slot
+        spin_unlock_irqrestore(&files_lock, s);
     }
 }
 
 /*
 Inputs: io, buf, n
 Outputs: int bytes
-Purpose: Takes in an io_intf pointer and writes n bytes to the file. Checks to make sure that writing is done across blocks that may not be contigious.
-        Writes by finding offsets and writing directly to the original device that was mounted. Updates file position as needed and returns the amount 
-        of bytes that was written.
+Purpose: Takes in an io_intf pointer and writes n bytes to the file at its current position with fs_writeat. Updates file position as needed
+        and returns the amount of bytes that was written.
 */
 
 long fs_write(struct io_intf * io, const void* buf, unsigned long n){
-    lock_acquire(&kfs_lock);
-    int i = 0;
-    struct file_t * curr;
-    
-    
-    while (i < 32){
-        if (&files[i].io_intf == io){           // find correct file based on pointer
-            
-            curr = &files[i];
-            uint64_t size = files[i].file_size;     // find current file size
-            
-            if (size - files[i].position < n){
-                n = size - files[i].position;               // clip the size based on the file size
-                
-            }
+    struct file_t * curr = (void *)io - offsetof(struct file_t, io_intf);      // find correct file based on pointer
+    long result;
 
-            
-            uint64_t pos = curr->position;
+    lock_acquire(&curr->lock);
 
+    result = fs_writeat(io, curr->position, buf, n);
+    if (result > 0){
+        curr->position += result;                   // update position in file
+    }
 
-        
-            inode_t inode;
+    lock_release(&curr->lock);
+    return result;
+}
 
-            ioseek(vioblk, curr->inode*FS_BLKSZ + 4096);            // read in the current inode for this file
-            int inode_bytes = ioread(vioblk, &inode, 4096);
-            if (inode_bytes != 4096){
-                lock_release(&kfs_lock);
-                return -EINVAL;
-            }
+/*
+Inputs: io, buf, n
+Outputs: long bytes
+Purpose: Takes in an io_intf pointer and reads n bytes from the file at its current position with fs_readat. Updates file position as needed
+        and returns the amount of bytes that was read.
+*/
 
-            uint64_t inode_offset = pos/FS_BLKSZ;           // which block of this file
-            uint64_t block_pos = pos % FS_BLKSZ;            // find position in said block
-            uint64_t byte_count;
-            uint64_t data_block_num = inode.data_block_num[inode_offset];   // get the correct data block number
-            
-            
-            uint64_t write_loc = (FS_BLKSZ + (boot_block.num_inodes*FS_BLKSZ) + (data_block_num*FS_BLKSZ) + block_pos);     // calculate location based on offsets
-            uint64_t write_bytes = 0;
-            uint64_t total_bytes_write = 0;
-
-            while (1){
-                if (n + block_pos < FS_BLKSZ){                  // write will not reach end of block
-                    byte_count = n;
-                    
-                }
-                else{
-                    byte_count = FS_BLKSZ - block_pos;          // write will reach end of block, cut off size
-                }
-               
-                ioseek(vioblk, write_loc);                      // set position to location based on size
-                write_bytes = iowrite(vioblk, buf + total_bytes_write, byte_count);     // write bytes
+long fs_read(struct io_intf * io, void* buf, unsigned long n){
+    struct file_t * curr = (void *)io - offsetof(struct file_t, io_intf);      // find file associated with io_intf
+    long result;
 
-                if (write_bytes != byte_count){
-                    lock_release(&kfs_lock);
-                    return -EIO;
-                }
+    lock_acquire(&curr->lock);
 
-                n -= write_bytes;                   // subtract bytes that were written
-                total_bytes_write += write_bytes;
-                if (n <= 0){                        // write is over, exit
-                    break;
-                }
-                 
-                inode_offset++;                     
-                data_block_num = inode.data_block_num[inode_offset];            // get new data block
-                block_pos = 0;
-                write_loc = (FS_BLKSZ + (boot_block.num_inodes*FS_BLKSZ) + (data_block_num*FS_BLKSZ) + block_pos);      // recalculate read location
-    
-            }
-            
-            curr->position += total_bytes_write;                    // update position in file
-            lock_release(&kfs_lock);
-            return total_bytes_write;
+    result = fs_readat(io, curr->position, buf, n);
+    if (result > 0){
+        curr->position += result;                   // update position
+    }
 
+    lock_release(&curr->lock);
+    return result;
+}
+
+/*
+Inputs: io, pos, buf, n
+Outputs: long bytes
+Purpose: Writes n bytes to the file starting at byte offset pos without using its position. Checks to make sure that writing is done across blocks
+        that may not be contigious. Writes by finding offsets and writing through the buffer cache to the original device that was mounted. The
+        data reaches the device later, when the cache writes it back, or on IOCTL_FLUSH. Holds kfs_lock exclusively, since writers change file data
+        under readers.
+*/
+
+long fs_writeat(struct io_intf * io, unsigned long long pos, const void* buf, unsigned long n){
+    struct file_t * curr = (void *)io - offsetof(struct file_t, io_intf);      // find correct file based on pointer
+    uint64_t write_loc;
+    uint64_t byte_count;
+    uint64_t write_bytes = 0;
+    uint64_t total_bytes_write = 0;
+    int result;
+
+    uint64_t size = curr->file_size;                // find current file size
+
+    if (pos >= size){                               // nothing to write past end of file
+        return 0;
+    }
+
+    if (size - pos < n){
+        n = size - pos;                             // clip the size based on the file size
+    }
+
+    uint64_t inode_offset = pos/FS_BLKSZ;           // which block of this file
+    uint64_t block_pos = pos % FS_BLKSZ;            // find position in said block
+
+    rwlock_acquire_write(&kfs_lock);
+
+    while (n > 0){
+        result = fs_data_loc(curr->inode, inode_offset, &write_loc);     // get the correct data block location
+        if (result != 0){
+            rwlock_release_write(&kfs_lock);
+            return result;
         }
 
-        i++;
+        if (n + block_pos < FS_BLKSZ){                  // write will not reach end of block
+            byte_count = n;
+        }
+        else{
+            byte_count = FS_BLKSZ - block_pos;          // write will reach end of block, cut off size
+        }
+
+        write_bytes = bcache_writeat(vioblk, write_loc + block_pos, buf + total_bytes_write, byte_count);     // write bytes
+
+        if (write_bytes != byte_count){
+            rwlock_release_write(&kfs_lock);
+            return -EIO;
+        }
 
+        n -= write_bytes;                   // subtract bytes that were written
+        total_bytes_write += write_bytes;
+        inode_offset++;                     
+        block_pos = 0;
     }
-    lock_release(&kfs_lock);
-    return -1;                      // file was not found
+
+    rwlock_release_write(&kfs_lock);
+    return total_bytes_write;
 }
 
 /*
-Inputs: io, buf, n
+Inputs: io, pos, buf, n
 Outputs: long bytes
-Purpose: Takes in an io_intf pointer and reads n bytes to the file. Checks to make sure that reading is done across blocks that may not be contigious.
-        Reads by finding offsets and writing directly to the original device that was mounted. Updates file position as needed and returns the amount 
-        of bytes that was read.
+Purpose: Reads n bytes from the file starting at byte offset pos without using its position. Checks to make sure that reading is done across
+        blocks that may not be contigious. Reads by finding offsets and reading through the buffer cache from the original device that was mounted.
+        Starts read-ahead of the blocks that follow before reading, so they load while we copy. Holds kfs_lock shared, so reads of different files
+        (or the same file through different opens) run concurrently.
 */
 
-long fs_read(struct io_intf * io, void* buf, unsigned long n){
-    lock_acquire(&kfs_lock);
-    int i = 0;
-    struct file_t * curr;
-    
-    
-    while (i < 32){
-        if (&files[i].io_intf == io){                   // find io_intf associated with file
-            
-            curr = &files[i];
-            uint64_t size = files[i].file_size;
-            
-            if (size - files[i].position < n){
-                n = size - files[i].position;
-                
-            }
+long fs_readat(struct io_intf * io, unsigned long long pos, void* buf, unsigned long n){
+    struct file_t * curr = (void *)io - offsetof(struct file_t, io_intf);      // find file associated with io_intf
+    uint64_t read_loc;
+    uint64_t byte_count;
+    uint64_t read_bytes = 0;
+    uint64_t total_bytes_read = 0;
+    int result;
+    int s;
 
-            
-            uint64_t pos = curr->position;
+    uint64_t size = curr->file_size;
 
-            inode_t inode;
+    if (pos >= size){                               // end of file
+        return 0;
+    }
 
-            ioseek(vioblk, curr->inode*FS_BLKSZ + 4096);                // read in inode for file
-            int inode_bytes = ioread(vioblk, &inode, 4096);             
-            if (inode_bytes != 4096){
-                lock_release(&kfs_lock);
-                return -EINVAL;
-            }
+    if (size - pos < n){
+        n = size - pos;
+    }
 
-            
+    uint64_t inode_offset = pos/FS_BLKSZ;                   // which data block in inode
+    uint64_t block_pos = pos % FS_BLKSZ;                    // position within said block
 
-            uint64_t inode_offset = pos/FS_BLKSZ;                   // which data block in inode
-            uint64_t block_pos = pos % FS_BLKSZ;                    // position within said block
-            uint64_t byte_count;
+    rwlock_acquire_read(&kfs_lock);
 
-            uint64_t data_block_num = inode.data_block_num[inode_offset];       // find data block from inode data
-            
-            uint64_t read_loc = (FS_BLKSZ + (boot_block.num_inodes*FS_BLKSZ) + (data_block_num*FS_BLKSZ) + block_pos);      // calculate read location based on offsets
-            uint64_t read_bytes = 0;        
-            uint64_t total_bytes_read = 0;
+    fs_readahead(curr, pos, n);
 
-            
-            
+    while (n > 0){
+        result = fs_data_loc(curr->inode, inode_offset, &read_loc);      // find data block location from inode data
+        if (result != 0){
+            rwlock_release_read(&kfs_lock);
+            return result;
+        }
 
-            while (1){
-                if (n + block_pos < FS_BLKSZ){              // read with not reach end of block
-                    byte_count = n;
-                    
-                }
-                else{
-                    byte_count = FS_BLKSZ - block_pos;              // read will reach end of block, cut off bytes
-                }
-               
-                ioseek(vioblk, read_loc);                           // set position in device to read
-                read_bytes = ioread(vioblk, buf + total_bytes_read, byte_count);            // read bytes
+        if (n + block_pos < FS_BLKSZ){              // read with not reach end of block
+            byte_count = n;
+        }
+        else{
+            byte_count = FS_BLKSZ - block_pos;              // read will reach end of block, cut off bytes
+        }
 
+        read_bytes = bcache_readat(vioblk, read_loc + block_pos, buf + total_bytes_read, byte_count);            // read bytes
 
-               
+        if (read_bytes != byte_count){
+            rwlock_release_read(&kfs_lock);
+            return -EIO;
+        }
 
-                if (read_bytes != byte_count){
-                    lock_release(&kfs_lock);
-                    return -EIO;
-                }
-                n -= read_bytes;                        // subtact of bytes that were already read
-                total_bytes_read += read_bytes;         
-                if (n <= 0){                            // read is over, exit
-                    break;
-                }
-                 
-                inode_offset++;
-                data_block_num = inode.data_block_num[inode_offset];            // find next data block
-                block_pos = 0;
-                read_loc = (FS_BLKSZ + (boot_block.num_inodes*FS_BLKSZ) + (data_block_num*FS_BLKSZ) + block_pos);       // update location to read from device
-    
-            }
-            
-            curr->position += total_bytes_read;             // update position
-            lock_release(&kfs_lock);
-            return total_bytes_read;
+        n -= read_bytes;                        // subtact of bytes that were already read
+        total_bytes_read += read_bytes;         
+        inode_offset++;
+        block_pos = 0;
+    }
 
-        }
+    rwlock_release_read(&kfs_lock);
 
-        i++;
+    s = spin_lock_irqsave(&curr->ra_lock);
+    curr->ra_next = pos + total_bytes_read;         // for sequential access detection
+    spin_unlock_irqrestore(&curr->ra_lock, s);
+    return total_bytes_read;
+}
+
+/*
+Inputs: io, req
+Outputs: int status
+Purpose: Starts an asynchronous read or write of the file (see iosubmit). If every block the request touches is in the buffer cache, it is
+        served right away, since neither reads nor (write-back) writes then wait for the device. Otherwise the missing blocks are prefetched
+        and the request goes to the generic workers, which will mostly find them cached.
+*/
+
+int fs_submit(struct io_intf * io, struct io_req * req){
+    struct file_t * curr = (void *)io - offsetof(struct file_t, io_intf);      // find file associated with io_intf
+    long result;
+
+    if (!fs_cached(curr, req->pos, req->len)){
+        return iosubmit_generic(io, req);
+    }
 
+    if (req->op == IO_REQ_READ){
+        result = fs_readat(io, req->pos, req->buf, req->len);
     }
-    lock_release(&kfs_lock);
-    return -1;
+    else{
+        result = fs_writeat(io, req->pos, req->buf, req->len);
+    }
+
+    io_req_complete(req, result);
+    return 0;
 }
 
 /*
@@ -355,32 +430,158 @@ Purpose: Takes in a command and sends off to the correct helper function based o
 */
 
 int fs_ioctl(struct io_intf * io, int cmd, void* arg){
-    int i = 0;
-    struct file_t * curr;
-
-    while (i < 32){
-        if (&files[i].io_intf == io){       // find io_intf for current file based on the paramters
-            curr = &files[i];
-            break;
-    }   
-    i++;
- }
+    struct file_t * curr = (void *)io - offsetof(struct file_t, io_intf);   // find file for io_intf
 
     switch (cmd){                           // send to helper function based on cmd code
         case IOCTL_GETLEN: 
             return fs_getlen(curr, arg);
+        case IOCTL_SETLEN:
+            return fs_setlen(curr, arg);
         case IOCTL_GETPOS: 
             return fs_getpos(curr, arg);
         case IOCTL_SETPOS:
             return fs_setpos(curr, arg);
         case IOCTL_GETBLKSZ:
             return fs_getblksz(curr, arg);
+        case IOCTL_ADVISE:
+            return fs_advise(curr, arg);
+        case IOCTL_FLUSH:
+            return fs_flush(curr);
+        case IOCTL_WRITE_ZEROES:
+            return fs_zero(curr, arg);
     }
 
     return 0;
 
 }
 
+/*
+Inputs: fd, pos, n
+Outputs: none
+Purpose: Called by fs_read (with kfs_lock held) before reading n bytes at pos. If the read continues where the last one ended,
+        or the caller advised sequential access, queues the rest of the blocks of this read and up to ra_window blocks after
+        them for the buffer cache to load in the background. The window starts at FS_RA_MIN blocks and doubles, up to FS_RA_MAX,
+        each time the reader has used up half of it. A read anywhere else resets the window. The read-ahead state is updated
+        under fd->ra_lock, which is dropped before queueing the blocks; concurrent readers of the same file see the blocks
+        as already issued and do not queue them again.
+*/
+
+void fs_readahead(struct file_t * fd, uint64_t pos, uint64_t n){
+    uint64_t first = pos/FS_BLKSZ;                                      // first and last block of this read
+    uint64_t last = (pos + n - 1)/FS_BLKSZ;
+    uint64_t nblks = (fd->file_size + FS_BLKSZ - 1)/FS_BLKSZ;
+    uint64_t loc;
+    uint64_t end;
+    uint64_t i;
+    int s;
+
+    s = spin_lock_irqsave(&fd->ra_lock);
+
+    if (fd->advice == IOADV_RANDOM){
+        spin_unlock_irqrestore(&fd->ra_lock, s);
+        return;
+    }
+
+    if (pos != fd->ra_next && fd->advice != IOADV_SEQUENTIAL){         // not sequential, start over
+        fd->ra_window = 0;
+        fd->ra_end = 0;
+        spin_unlock_irqrestore(&fd->ra_lock, s);
+        return;
+    }
+
+    if (fd->ra_window != 0 && last + fd->ra_window/2 < fd->ra_end){     // still well ahead of the reader
+        spin_unlock_irqrestore(&fd->ra_lock, s);
+        return;
+    }
+
+    if (fd->advice == IOADV_SEQUENTIAL){
+        fd->ra_window = FS_RA_MAX;
+    } else if (fd->ra_window == 0){
+        fd->ra_window = FS_RA_MIN;
+    } else if (fd->ra_window < FS_RA_MAX){
+        fd->ra_window *= 2;
+    }
+
+    end = last + 1 + fd->ra_window;
+    if (end > nblks){
+        end = nblks;
+    }
+
+    i = (fd->ra_end > first + 1) ? fd->ra_end : first + 1;              // the first block is read right away
+    if (fd->ra_end < end){
+        fd->ra_end = end;                                               // claim the blocks before queueing them
+    }
+
+    spin_unlock_irqrestore(&fd->ra_lock, s);
+
+    while (i < end){
+        if (fs_data_loc(fd->inode, i, &loc) != 0){
+            break;
+        }
+        bcache_prefetch(vioblk, loc/BCACHE_BLKSZ);
+        i++;
+    }
+}
+
+/*
+Inputs: fd, pos, n
+Outputs: int cached
+Purpose: Returns 1 if all blocks of the file that n bytes at pos touch are in the buffer cache. Otherwise queues the missing ones for
+        read-ahead and returns 0.
+*/
+
+int fs_cached(struct file_t * fd, uint64_t pos, uint64_t n){
+    uint64_t loc;
+    uint64_t i;
+    int cached = 1;
+
+    if (pos >= fd->file_size || n == 0){            // nothing to transfer
+        return 1;
+    }
+
+    if (fd->file_size - pos < n){
+        n = fd->file_size - pos;
+    }
+
+    rwlock_acquire_read(&kfs_lock);
+
+    for (i = pos/FS_BLKSZ; i <= (pos + n - 1)/FS_BLKSZ; i++){
+        if (fs_data_loc(fd->inode, i, &loc) != 0){
+            break;                                  // let the transfer report the error
+        }
+        if (!bcache_cached(vioblk, loc/BCACHE_BLKSZ)){
+            bcache_prefetch(vioblk, loc/BCACHE_BLKSZ);
+            cached = 0;
+        }
+    }
+
+    rwlock_release_read(&kfs_lock);
+    return cached;
+}
+
+/*
+Inputs: inode, inode_offset, locptr
+Outputs: int status
+Purpose: Finds the device location of the data block at index inode_offset of the file with the given inode. Reads the data block
+        number out of the cached inode block, so we do not need a 4 KB inode buffer on the stack.
+*/
+
+int fs_data_loc(uint64_t inode, uint64_t inode_offset, uint64_t * locptr){
+    uint32_t data_block_num;
+    uint64_t entry_loc = FS_BLKSZ + inode*FS_BLKSZ + offsetof(inode_t, data_block_num) + inode_offset*sizeof(uint32_t);
+
+    if (inode_offset >= sizeof(((inode_t *)0)->data_block_num) / sizeof(uint32_t)){    // past the last block an inode can hold
+        return -EINVAL;
+    }
+
+    if (bcache_readat(vioblk, entry_loc, &data_block_num, sizeof(data_block_num)) != sizeof(data_block_num)){
+        return -EIO;
+    }
+
+    *locptr = FS_BLKSZ + (boot_block.num_inodes*FS_BLKSZ) + (data_block_num*FS_BLKSZ);    // calculate location based on offsets
+    return 0;
+}
+
 /*
 Inputs: fd, arg
 Outputs: int status
@@ -392,6 +593,70 @@ int fs_getlen(struct file_t * fd, void* arg){
     return 0;
 }
 
+/*
+Inputs: fd, arg
+Outputs: int status
+Purpose: Truncates the file to the length in bytes that arg points to. Updates the length in the inode and in every open file of the
+        same inode, then discards the data blocks past the new end, merging blocks that are contiguous on the device into one command.
+        The file system has no free block map, so files cannot grow and the discarded blocks are not reused; discarding lets the
+        device free their storage.
+*/
+
+int fs_setlen(struct file_t * fd, void* arg){
+    uint64_t len = *(uint64_t *)arg;
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+    uint64_t loc;
+    uint64_t i, nblks;
+    uint32_t byte_len;
+    int j;
+
+    if (len > fd->file_size){                       // cannot allocate blocks
+        return -ENOTSUP;
+    }
+
+    if (len == fd->file_size){
+        return 0;
+    }
+
+    rwlock_acquire_write(&kfs_lock);
+
+    byte_len = len;
+    if (bcache_writeat(vioblk, FS_BLKSZ + FS_BLKSZ*fd->inode + offsetof(inode_t, byte_len), &byte_len, sizeof(byte_len)) != sizeof(byte_len)){
+        rwlock_release_write(&kfs_lock);
+        return -EIO;
+    }
+
+    nblks = (fd->file_size + FS_BLKSZ - 1)/FS_BLKSZ;
+
+    for (j = 0; j < 32; j++){                       // other opens of the file see the new length
+        if (files[j].flags == IN_USE && files[j].inode == fd->inode && files[j].file_size > len){
+            files[j].file_size = len;
+        }
+    }
+
+    for (i = (len + FS_BLKSZ - 1)/FS_BLKSZ; i < nblks; i++){
+        if (fs_data_loc(fd->inode, i, &loc) != 0){
+            break;
+        }
+
+        if (loc != run_end){                        // not contiguous with the current run, discard that first
+            if (run_end != run_start){
+                bcache_discard(vioblk, run_start, run_end - run_start);
+            }
+            run_start = loc;
+        }
+        run_end = loc + FS_BLKSZ;
+    }
+
+    if (run_end != run_start){
+        bcache_discard(vioblk, run_start, run_end - run_start);
+    }
+
+    rwlock_release_write(&kfs_lock);
+    return 0;
+}
+
 /*
 Inputs: fd, arg
 Outputs: int status
@@ -425,6 +690,96 @@ int fs_getblksz(struct file_t * fd, void* arg){     // store block size in arg
     return 0;
 }
 
+/*
+Inputs: fd
+Outputs: int status
+Purpose: Writes back every dirty cached block of the file system device and flushes the device's write cache, so that all
+        data written so far is durable. The file system has only one device, so this covers other files too.
+*/
+
+int fs_flush(struct file_t * fd){
+    return bcache_sync(vioblk);
+}
+
+/*
+Inputs: fd, arg
+Outputs: int status
+Purpose: Zeroes the byte range of the file that the struct io_range arg points to, up to the end of the file. Parts of the range
+        that are contiguous on the device are zeroed with one bcache_zeroat, so whole blocks take a single device command.
+*/
+
+int fs_zero(struct file_t * fd, void* arg){
+    const struct io_range * range = arg;
+    uint64_t pos = range->pos;
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+    uint64_t end, loc, n;
+    int result = 0;
+
+    if (pos >= fd->file_size){                      // nothing to zero past end of file
+        return 0;
+    }
+
+    end = (range->len < fd->file_size - pos) ? pos + range->len : fd->file_size;
+
+    rwlock_acquire_write(&kfs_lock);
+
+    while (pos < end){
+        result = fs_data_loc(fd->inode, pos/FS_BLKSZ, &loc);
+        if (result != 0){
+            break;
+        }
+
+        loc += pos % FS_BLKSZ;
+        n = FS_BLKSZ - pos % FS_BLKSZ;              // up to the end of the block
+        if (end - pos < n){
+            n = end - pos;
+        }
+
+        if (loc != run_end){                        // not contiguous with the current run, zero that first
+            if (run_end != run_start){
+                result = bcache_zeroat(vioblk, run_start, run_end - run_start);
+                if (result != 0){
+                    break;
+                }
+            }
+            run_start = loc;
+        }
+        run_end = loc + n;
+        pos += n;
+    }
+
+    if (result == 0 && run_end != run_start){
+        result = bcache_zeroat(vioblk, run_start, run_end - run_start);
+    }
+
+    rwlock_release_write(&kfs_lock);
+    return result;
+}
+
+/*
+Inputs: fd, arg
+Outputs: int status
+Purpose: Sets the access pattern advice (IOADV_NORMAL, IOADV_SEQUENTIAL or IOADV_RANDOM) of the file from the int arg points to.
+        Resets the read-ahead window.
+*/
+
+int fs_advise(struct file_t * fd, void* arg){
+    int advice = *(int *)arg;
+    int s;
+
+    if (advice != IOADV_NORMAL && advice != IOADV_SEQUENTIAL && advice != IOADV_RANDOM){
+        return -EINVAL;
+    }
+
+    s = spin_lock_irqsave(&fd->ra_lock);
+    fd->advice = advice;
+    fd->ra_window = 0;
+    fd->ra_end = 0;
+    spin_unlock_irqrestore(&fd->ra_lock, s);
+    return 0;
+}
+
 
 
 
@@ -16,16 +16,43 @@
 #include "halt.h"
 #include "console.h"
 #include "intr.h"
+#include "csr.h"
+
+// LOCK_SPIN_CYCLES is how long lock_acquire spins on a lock whose holder is
+// running on another hart before going to sleep.
+
+#ifndef LOCK_SPIN_CYCLES
+#define LOCK_SPIN_CYCLES 2000
+#endif
 
 struct lock {
     struct condition cond;
     int tid; // thread holding lock or -1
+    struct lock * next_held; // next lock held by the same thread
+};
+
+// A reader-writer lock may be held by any number of readers or by a single
+// writer. Writers are preferred: once a writer is waiting, new readers wait
+// until it has had its turn, so a steady stream of readers cannot starve it.
+
+struct rwlock {
+    struct condition readers_ok; // signalled when readers may proceed
+    struct condition writer_ok; // signalled when a writer may proceed
+    int readers; // number of readers holding the lock
+    int writer; // thread holding the lock for writing or -1
+    int writers_waiting;
 };
 
 static inline void lock_init(struct lock * lk, const char * name);
 static inline void lock_acquire(struct lock * lk);
 static inline void lock_release(struct lock * lk);
 
+static inline void rwlock_init(struct rwlock * rw, const char * name);
+static inline void rwlock_acquire_read(struct rwlock * rw);
+static inline void rwlock_release_read(struct rwlock * rw);
+static inline void rwlock_acquire_write(struct rwlock * rw);
+static inline void rwlock_release_write(struct rwlock * rw);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
@@ -33,6 +60,7 @@ static inline void lock_init(struct lock * lk, const char * name) {
     trace("%s(<%s:%p>", __func__, name, lk);
     condition_init(&lk->cond, name);
     lk->tid = -1;
+    lk->next_held = NULL;
 }
 
 /*
@@ -42,27 +70,120 @@ Purpose: Check if lock is unlocked, if locked then wait till it is unlocked. Whe
 set owner to running thread. Also disable interrupts as it is a critcal section with shared resources
 */
 static inline void lock_acquire(struct lock * lk) {
-    // TODO: FIXME implement this
+    const int tid = running_thread();
+    uint64_t t0;
     int s = intr_disable(); // disable interrupts
-    while (lk->tid != -1){ // loop to check lk is unlocked
-        condition_wait(&lk->cond); // wait till condition
+
+    // If the holder is running on another hart, it will likely release the
+    // lock soon, so spin for a while before going to sleep.
+
+    if (lk->tid != -1 && thread_oncpu(lk->tid)) {
+        intr_restore(s);
+        t0 = csrr_cycle();
+        while (*(volatile int *)&lk->tid != -1 && thread_oncpu(lk->tid) &&
+            csrr_cycle() - t0 < LOCK_SPIN_CYCLES)
+            continue;
+        s = intr_disable();
+    }
+
+    // If the lock is held, wait until lock_release hands it to us. Since the
+    // lock is handed over directly, no other thread can take it in between.
+    // While we wait, the holder runs with our priority if it is higher.
+
+    if (lk->tid == -1) {
+        lk->tid = tid;
+        thread_lock_acquired(lk);
+    } else {
+        while (lk->tid != tid)
+            thread_lock_wait(lk);
     }
-    lk->tid = running_thread(); // set new owner
+
     intr_restore(s); // restore interrupts
-    return; // ret
 }
 
 static inline void lock_release(struct lock * lk) {
+    int s;
+
     trace("%s(<%s:%p>", __func__, lk->cond.name, lk);
 
     assert (lk->tid == running_thread());
     
-    lk->tid = -1;
-    condition_broadcast(&lk->cond);
+    // Hand the lock to the highest priority waiter, if any. Only that thread
+    // is woken up. If it outranks us (now that we no longer inherit its
+    // priority), let it run right away.
+
+    s = intr_disable();
+    lk->tid = thread_lock_handoff(lk);
+    intr_restore(s);
 
     debug("Thread <%s:%d> released lock <%s:%p>",
         thread_name(running_thread()), running_thread(),
         lk->cond.name, lk);
+    
+    if (lk->tid != -1)
+        thread_yield_if_preempted();
+}
+
+static inline void rwlock_init(struct rwlock * rw, const char * name) {
+    trace("%s(<%s:%p>", __func__, name, rw);
+    condition_init(&rw->readers_ok, name);
+    condition_init(&rw->writer_ok, name);
+    rw->readers = 0;
+    rw->writer = -1;
+    rw->writers_waiting = 0;
+}
+
+static inline void rwlock_acquire_read(struct rwlock * rw) {
+    int s = intr_disable();
+
+    while (rw->writer != -1 || rw->writers_waiting != 0)
+        condition_wait(&rw->readers_ok);
+    
+    rw->readers += 1;
+    intr_restore(s);
+}
+
+static inline void rwlock_release_read(struct rwlock * rw) {
+    int s = intr_disable();
+
+    assert (rw->readers > 0);
+
+    // The last reader out lets in one waiting writer
+
+    if (--rw->readers == 0 && rw->writers_waiting != 0)
+        condition_signal(&rw->writer_ok);
+    
+    intr_restore(s);
+}
+
+static inline void rwlock_acquire_write(struct rwlock * rw) {
+    int s = intr_disable();
+
+    rw->writers_waiting += 1;
+
+    while (rw->writer != -1 || rw->readers != 0)
+        condition_wait_exclusive(&rw->writer_ok);
+    
+    rw->writers_waiting -= 1;
+    rw->writer = running_thread();
+    intr_restore(s);
+}
+
+static inline void rwlock_release_write(struct rwlock * rw) {
+    int s = intr_disable();
+
+    assert (rw->writer == running_thread());
+    rw->writer = -1;
+
+    // Hand over to the next writer if there is one, otherwise let all waiting
+    // readers in together.
+
+    if (rw->writers_waiting != 0)
+        condition_signal(&rw->writer_ok);
+    else
+        condition_broadcast(&rw->readers_ok);
+    
+    intr_restore(s);
 }
 
 #endif // _LOCK_H_
\ No newline at end of file
@@ -26,6 +26,7 @@
 #include "string.h"
 #include "process.h"
 #include "config.h"
+#include "spinlock.h"
 
 
 void main(void) {
@@ -42,6 +43,8 @@ void main(void) {
     thread_init();
     procmgr_init();
     timer_init();
+    lockstat_attach();
+    ps_attach();
 
     // Attach NS16550a serial devices
 
@@ -24,6 +24,7 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "spinlock.h"
 
 #include <stdint.h>
 
@@ -118,6 +119,7 @@ static inline void sfence_vma(void);
 //
 
 static union linked_page * free_list;
+static struct spinlock free_list_lock;
 static struct pte to_clone;
 
 static struct pte main_pt2[PTE_CNT]
@@ -237,6 +239,7 @@ void memory_init(void) {
         heap_start, heap_end, (heap_end - heap_start) / 1024);
 
     free_list = heap_end; // heap_end is page aligned
+    spinlock_init(&free_list_lock, "free_list");
     page_cnt = (RAM_END - heap_end) / PAGE_SIZE;
 
     kprintf("Page allocator: [%p,%p): %lu pages free\n",
@@ -286,6 +289,8 @@ Purpose: Removes a page from the free pages list and returns the page for use. U
 
 void * memory_alloc_page(void){
 
+    int saved_intr_state = spin_lock_irqsave(&free_list_lock);
+
     if (free_list == NULL){
         panic("No Free Pages");             // free list has run out of space
     }
@@ -294,6 +299,8 @@ void * memory_alloc_page(void){
 
     free_list = free_list->next;                    // set head to the next page to remove the used page from the list
 
+    spin_unlock_irqrestore(&free_list_lock, saved_intr_state);
+
     return return_page;         // return the page
 
 }
@@ -308,8 +315,10 @@ Purpose: Takes in a page pointer and adds it back to the free list. This page is
 void memory_free_page(void *pp){
 
     union linked_page * free_page = (union linked_page *)(pp);      // make a page from the pointer that is coming in
-    free_page->next = free_list->next;                  // set up the new page to be at the head of the free list
+    int saved_intr_state = spin_lock_irqsave(&free_list_lock);
+    free_page->next = free_list;                        // set up the new page to be at the head of the free list
     free_list = free_page;
+    spin_unlock_irqrestore(&free_list_lock, saved_intr_state);
     
 }
 
@@ -331,6 +340,8 @@ void * memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
     struct pte * pt1;
     struct pte * pt0;
 
+    preempt_disable();          // other threads of the process may map pages in the same tables
+
     if ((main_pt2[VPN2(vma)].flags & PTE_V) == 0){                  // check level 2 table using VPN2
         struct pte * new_level_1_table = memory_alloc_page();       // make a new table if necessary
         main_pt2[VPN2(vma)] = ptab_pte(new_level_1_table, PTE_V);   // map the new table to the correct index
@@ -351,6 +362,7 @@ void * memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
 
     pt0[VPN0(vma)] = leaf_pte(page, rwxug_flags | PTE_A | PTE_D);       // map the new page with the appropriate flags at the correct index
 
+    preempt_enable();
 
     sfence_vma();       // flush tlb
 
@@ -536,6 +548,40 @@ void memory_handle_page_fault(const void *vptr){
 
 }
 
+/*
+Inputs: vptr, rwxug_flags
+Outputs: physical address or 0
+Purpose: Walks the page tables of the active memory space to translate a virtual address. Returns 0 unless the page containing the
+        address is mapped with at least the given flags.
+*/
+
+uintptr_t memory_translate(const void * vptr, uint_fast8_t rwxug_flags){
+    const uintptr_t vma = (uintptr_t)vptr;
+    struct pte * pt = active_space_root();
+    struct pte pte;
+    int level;
+
+    if (!wellformed_vptr(vptr))
+        return 0;
+
+    for (level = 2; level >= 0; level--){
+        pte = pt[(vma >> (PAGE_ORDER + 9*level)) & 0x1FF];
+
+        if ((pte.flags & PTE_V) == 0)           // not mapped
+            return 0;
+
+        if (pte.flags & (PTE_R | PTE_W | PTE_X))        // leaf, possibly a mega- or gigapage
+            break;
+
+        pt = pagenum_to_pageptr(pte.ppn);       // next level table
+    }
+
+    if (level < 0 || (pte.flags & rwxug_flags) != rwxug_flags)
+        return 0;
+
+    return ((uintptr_t)pte.ppn << PAGE_ORDER) + (vma & ((PAGE_SIZE << (9*level)) - 1));
+}
+
 /*
 Inputs: asid
 Outputs: mtag
@@ -163,6 +163,13 @@ extern void memory_handle_page_fault(const void * vptr);
 
 extern uintptr_t memory_space_clone(uint_fast16_t asid);
 
+// uintptr_t memory_translate(const void * vp, uint_fast8_t rwxug_flags)
+// Returns the physical address that virtual address /vp/ maps to in the
+// active memory space, or 0 if the page containing it is not mapped with at
+// least the specified flags.
+
+extern uintptr_t memory_translate(const void * vp, uint_fast8_t rwxug_flags);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
@@ -2,6 +2,11 @@
 //
 
 #include "process.h"
+#include "idmap.h"
+#include "heap.h"
+#include "string.h"
+#include "intr.h"
+#include "error.h"
 
 #ifdef PROCESS_TRACE
 #define TRACE
@@ -15,29 +20,46 @@
 // COMPILE-TIME PARAMETERS
 //
 
-// NPROC is the maximum number of processes
+// NPROC is the maximum number of processes. Like the thread table, the
+// process table grows in page-sized chunks.
 
 #ifndef NPROC
-#define NPROC 16
+#define NPROC 4096
 #endif
 
 // INTERNAL FUNCTION DECLARATIONS
 //
 
+// Releases the resources of a process whose other threads have all exited,
+// frees it and exits the calling thread.
+
+static void process_teardown(struct process * proc) __attribute__ ((noreturn));
+
 // INTERNAL GLOBAL VARIABLES
 //
 
 #define MAIN_PID 0
 
+#define PROCTAB_CHUNK (PAGE_SIZE / sizeof(struct process *))
+#define PROCTAB_CHUNKCNT ((NPROC + PROCTAB_CHUNK-1) / PROCTAB_CHUNK)
+
 // The main user process struct
 
 static struct process main_proc;
 
-// A table of pointers to all user processes in the system
+// A table of pointers to all user processes in the system, in chunks indexed
+// by process id, and the set of free process ids.
+
+static struct process ** proctab[PROCTAB_CHUNKCNT];
+
+static uint64_t procids_free[IDMAP_WORDS(NPROC)];
+static uint64_t procids_summary[IDMAP_SUMMARY_WORDS(NPROC)];
+static struct idmap procids;
+
+// Recycled process structs (kfree does not free memory), linked through the
+// first entry of their iotab.
 
-struct process * proctab[NPROC] = {
-    [MAIN_PID] = &main_proc
-};
+static struct process * process_free_list;
 
 // EXPORTED GLOBAL VARIABLES
 //
@@ -55,9 +77,16 @@ Purpose: Initializes the proces manager by wrapping the main_thread in a process
 */
 
 void procmgr_init(void){
+    idmap_init(&procids, procids_free, procids_summary, NPROC);
+    idmap_reserve(&procids, MAIN_PID);
+    proctab[0] = memory_alloc_page();
+    memset(proctab[0], 0, PAGE_SIZE);
+    proctab[0][MAIN_PID] = &main_proc;
+
     main_proc.id = MAIN_PID;            // set process ID
     main_proc.tid = running_thread();       // set thread ID
     main_proc.mtag = active_memory_space();     // set mtag
+    main_proc.nthreads = 1;                     // the main thread
     thread_set_process(main_proc.tid, &main_proc);      // set process to this process
 
     procmgr_initialized = 1;
@@ -101,11 +130,190 @@ Purpose: Reclaims the memory space that was used by this process, and resets all
 
 void process_exit(void){
 
-    memory_space_reclaim();             // unmap this process' mappings
-
     struct process * proc = current_process();          // find the current process
+    int saved_intr_state;
+
+    // If another thread is already exiting the process, leave the rest to it
+
+    saved_intr_state = intr_disable();
+
+    if (proc->exiting){
+        intr_restore(saved_intr_state);
+        process_thread_exit();
+    }
+
+    // Stop the other threads of the process. Each one exits the next time it
+    // is about to return to U mode (see process_check_exit). Threads waiting
+    // in a system call that may never complete, like a futex wait or a
+    // console read, are interrupted, so the call returns -EINTR.
+
+    proc->exiting = 1;
+    thread_interrupt_process(proc);
+
+    while (proc->nthreads > 1)
+        condition_wait(&proc->thread_exit);
+
+    intr_restore(saved_intr_state);
+
+    process_teardown(proc);
+}
+
+/*
+Inputs: trap frame of the calling thread, user start address, argument, stack pointer and thread pointer
+Outputs: thread id of the new thread or error code
+Purpose: Starts another thread in the current process, sharing its memory space and io table
+*/
+int process_thread_create(const struct trap_frame * tfr,
+    uintptr_t start, uintptr_t arg, uintptr_t stack, uintptr_t tls)
+{
+    struct process * proc = current_process();
+    struct trap_frame ntfr;
+    int saved_intr_state;
+    int tid;
+
+    memcpy(&ntfr, tfr, sizeof(struct trap_frame));      // keeps gp and sstatus
+    ntfr.sepc = start;
+    ntfr.x[TFR_RA] = 0;
+    ntfr.x[TFR_SP] = stack;
+    ntfr.x[TFR_TP] = tls;
+    ntfr.x[TFR_A0] = arg;
+
+    saved_intr_state = intr_disable();          // process_exit must see the new thread
+
+    if (proc->exiting){
+        intr_restore(saved_intr_state);
+        return -EINVAL;
+    }
+
+    proc->nthreads += 1;
+    intr_restore(saved_intr_state);
 
-    
+    tid = thread_spawn_user(&ntfr);
+
+    if (tid < 0){
+        saved_intr_state = intr_disable();
+        proc->nthreads -= 1;
+        condition_broadcast(&proc->thread_exit);
+        intr_restore(saved_intr_state);
+    }
+
+    return tid;
+}
+
+/*
+Inputs: none
+Outputs: none
+Purpose: Exits the calling user thread. The last thread to exit takes the whole process with it.
+*/
+void process_thread_exit(void){
+    struct process * proc = current_process();
+    int saved_intr_state;
+
+    // Check and update the thread count in one go, or two threads exiting at
+    // the same time could both see the other one and neither tear down.
+
+    saved_intr_state = intr_disable();
+
+    if (proc->nthreads == 1){           // last thread: tear down the process
+        proc->exiting = 1;
+        intr_restore(saved_intr_state);
+        process_teardown(proc);
+    }
+
+    proc->nthreads -= 1;
+    thread_set_process(running_thread(), NULL);
+    condition_broadcast(&proc->thread_exit);
+    intr_restore(saved_intr_state);
+
+    thread_exit();
+}
+
+void process_check_exit(void){
+    struct process * proc = current_process();
+
+    if (proc != NULL && proc->exiting)
+        process_thread_exit();
+}
+
+/*
+Inputs: none
+Outputs: struct process pointer
+Purpose: Allocates a process id and a zeroed process struct and enters it in the process table. Returns NULL if there are no
+        process ids left.
+*/
+
+struct process * process_alloc(void){
+    struct process ** chunk;
+    struct process * proc;
+    int pid;
+
+    preempt_disable();                          // process table is not used by ISRs
+    pid = idmap_alloc(&procids);                // lowest free pid
+    proc = (pid < 0) ? NULL : process_free_list;
+    if (proc != NULL)
+        process_free_list = (struct process *)proc->iotab[0];
+
+    chunk = (pid < 0) ? NULL : proctab[pid / PROCTAB_CHUNK];
+
+    if (pid >= 0 && chunk == NULL){             // allocate table chunk on first use
+        chunk = memory_alloc_page();
+        memset(chunk, 0, PAGE_SIZE);
+        proctab[pid / PROCTAB_CHUNK] = chunk;
+    }
+    preempt_enable();
+
+    if (pid < 0){
+        return NULL;
+    }
+
+    if (proc == NULL){
+        proc = kmalloc(sizeof(struct process));
+    }
+
+    memset(proc, 0, sizeof(struct process));
+    proc->id = pid;
+    chunk[pid % PROCTAB_CHUNK] = proc;
+
+    return proc;
+}
+
+/*
+Inputs: proc
+Outputs: none
+Purpose: Removes a process from the process table and returns its id and struct for reuse. The caller must have closed its
+        io_intfs already.
+*/
+
+void process_free(struct process * proc){
+    preempt_disable();
+
+    proctab[proc->id / PROCTAB_CHUNK][proc->id % PROCTAB_CHUNK] = NULL;
+
+    if (proc != &main_proc){                    // main_proc is static, and keeps pid 0 reserved
+        idmap_free(&procids, proc->id);
+        proc->iotab[0] = (struct io_intf *)process_free_list;
+        process_free_list = proc;
+    }
+
+    preempt_enable();
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/*
+Inputs: proc
+Outputs: none
+Purpose: Releases the resources of a process whose other threads have all exited, frees it and exits the calling thread.
+*/
+
+void process_teardown(struct process * proc){
+
+    ioring_release(proc);               // stop ring worker before its pages go away
+
+    cpu_quota_release(proc);            // leave CPU bandwidth group
+
+    memory_space_reclaim();             // unmap this process' mappings
 
     for (int i = 0; i < PROCESS_IOMAX; i++){            // loop to close and reset all io_table
 
@@ -115,10 +323,13 @@ void process_exit(void){
         }   
     }
 
+    // Detach from the process before its struct can be reused, or a fork
+    // reusing it could switch us into the new process' memory space and
+    // charge our time to its CPU quota while we finish exiting.
 
-    proctab[proc->id] = NULL;               // remove this process from the process table
-
-    thread_exit();          // call thread_exit
+    thread_set_process(running_thread(), NULL);
 
+    process_free(proc);                     // remove this process from the process table
 
+    thread_exit();          // call thread_exit
 }
@@ -23,13 +23,18 @@ struct process {
     int tid; // thread id of associated thread
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX];
+    struct ioring_ctx * ioring; // submission/completion rings (ioring.c)
+    struct cpu_quota * cpuq; // CPU bandwidth group (thread.c), or NULL
+    int nthreads; // number of user threads in the process
+    struct thread * threads; // threads of the process (thread.c)
+    char exiting; // set by process_exit while it stops the other threads
+    struct condition thread_exit; // signalled when a user thread exits
 };
 
 // EXPORTED VARIABLES DECLARATIONS
 //
 
 extern char procmgr_initialized;
-extern struct process * proctab[];
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -41,6 +46,51 @@ extern void __attribute__ ((noreturn)) process_exit(void);
 
 extern void process_terminate(int pid);
 
+// Creates another thread in the current process. The new thread starts in U
+// mode at /start/ with /arg/ in a0, its stack pointer set to /stack/ and its
+// thread pointer set to /tls/. Other registers are copied from /tfr/, the trap
+// frame of the calling thread. Returns the new thread's id or an error code.
+
+extern int process_thread_create(const struct trap_frame * tfr,
+    uintptr_t start, uintptr_t arg, uintptr_t stack, uintptr_t tls);
+
+// Terminates the calling thread of the current process. If it is the last
+// thread, the process exits.
+
+extern void __attribute__ ((noreturn)) process_thread_exit(void);
+
+// Called on every return to U mode. If the process is exiting, terminates
+// the calling thread instead.
+
+extern void process_check_exit(void);
+
+// Allocates a new process with the lowest free process id and an empty iotab.
+// Returns NULL if the process table is full.
+
+extern struct process * process_alloc(void);
+
+// Removes a process from the process table and frees its process id.
+
+extern void process_free(struct process * proc);
+
+// Sets up submission and completion rings for a process and starts a kernel
+// worker thread to execute submitted operations. Returns the user address of
+// the shared ring page (see ../user/ioring.h) or a negative error code.
+
+extern int64_t ioring_setup(struct process * proc);
+
+// Submits up to /to_submit/ entries from a process's submission queue and
+// waits until at least /min_complete/ completions are available (or no more
+// operations are in flight). Returns the number of entries submitted.
+
+extern int ioring_enter(struct process * proc,
+    unsigned int to_submit, unsigned int min_complete);
+
+// Stops the worker thread of a process's rings. Called on process exit, before
+// its memory space is reclaimed.
+
+extern void ioring_release(struct process * proc);
+
 static inline struct process * current_process(void);
 static inline int current_pid(void);
 
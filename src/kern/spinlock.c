@@ -0,0 +1,109 @@
+// spinlock.c - Spinlocks and lock statistics
+//
+
+#ifdef SPINLOCK_TRACE
+#define TRACE
+#endif
+
+#ifdef SPINLOCK_DEBUG
+#define DEBUG
+#endif
+
+#include "spinlock.h"
+
+#include "console.h"
+#include "device.h"
+#include "halt.h"
+#include "intr.h"
+#include "io.h"
+#include "string.h"
+
+#include <stddef.h>
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+#ifdef SPINLOCK_STATS
+static struct spinlock * spinlock_list; // all initialized spinlocks
+#endif
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+#ifdef SPINLOCK_STATS
+
+// An open lockstat device is a snapshot file (see iosnap_alloc) with the
+// statistics of all locks, taken when the device is opened.
+
+static int lockstat_open(struct io_intf ** ioptr, void * aux);
+
+#endif
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void spinlock_init(struct spinlock * lk, const char * name) {
+#ifdef SPINLOCK_STATS
+    int saved_intr_state;
+#endif
+
+    trace("%s(<%s:%p>)", __func__, name, lk);
+
+    lk->locked = 0;
+    lk->name = name;
+
+#ifdef SPINLOCK_STATS
+    memset(&lk->stats, 0, sizeof(lk->stats));
+    lk->t_acquired = 0;
+
+    saved_intr_state = intr_disable();
+    lk->stats_next = spinlock_list;
+    spinlock_list = lk;
+    intr_restore(saved_intr_state);
+#endif
+}
+
+void lockstat_attach(void) {
+#ifdef SPINLOCK_STATS
+    device_register("lockstat", lockstat_open, NULL);
+#endif
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+#ifdef SPINLOCK_STATS
+
+int lockstat_open(struct io_intf ** ioptr, void * aux) {
+    const struct spinlock * lk;
+    int saved_intr_state;
+    size_t bufsz;
+    char * buf;
+    size_t n;
+
+    buf = iosnap_alloc(&bufsz);
+
+    n = snprintf(buf, bufsz,
+        "name acquisitions contended hold_max hold_total\n");
+
+    // Counters are updated without further synchronization, so the snapshot
+    // may be slightly inconsistent for a lock that is in use.
+
+    saved_intr_state = intr_disable();
+
+    for (lk = spinlock_list; lk != NULL; lk = lk->stats_next) {
+        if (bufsz <= n)
+            break;
+        n += snprintf(buf + n, bufsz - n, "%s %lu %lu %lu %lu\n",
+            lk->name ? lk->name : "?",
+            lk->stats.acquisitions, lk->stats.contended,
+            lk->stats.hold_max, lk->stats.hold_total);
+    }
+
+    intr_restore(saved_intr_state);
+
+    *ioptr = iosnap_init(buf, n);
+    return 0;
+}
+
+#endif
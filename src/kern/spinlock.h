@@ -0,0 +1,154 @@
+// spinlock.h - Spinlocks for short critical sections
+//
+
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include <stdint.h>
+
+#include "intr.h"
+#include "csr.h"
+#include "thread.h"
+
+// A spinlock protects a short critical section that must not sleep, such as a
+// free list update. The lock word is taken with an atomic swap (amoswap.w.aq)
+// and released with a store-release.
+//
+// Taking a spinlock disables preemption until it is released, so that the
+// holder is not switched out while another thread spins. There is only one
+// hart, so a spinlock can then only be contended by an ISR that interrupted
+// the holder, which would spin forever. Data that is also touched by an ISR
+// must therefore be locked using spin_lock_irqsave, which disables interrupts
+// for the duration of the critical section.
+//
+// If SPINLOCK_STATS is defined, each lock counts its acquisitions, contended
+// acquisitions and the time (in cycles) it is held. The counts of all locks
+// can be read from the "lockstat" device (see lockstat_attach).
+
+#ifdef SPINLOCK_STATS
+
+struct spinlock_stats {
+    uint64_t acquisitions;
+    uint64_t contended; // acquisitions that had to spin
+    uint64_t hold_max; // longest hold time in cycles
+    uint64_t hold_total; // total hold time in cycles
+};
+
+#endif
+
+struct spinlock {
+    volatile int locked;
+    const char * name;
+#ifdef SPINLOCK_STATS
+    struct spinlock_stats stats;
+    uint64_t t_acquired;
+    struct spinlock * stats_next; // list of all locks for lockstat
+#endif
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Initializes a spinlock in the unlocked state. The /name/ argument is used in
+// debug messages and lock statistics.
+
+extern void spinlock_init(struct spinlock * lk, const char * name);
+
+// Registers the "lockstat" device. Opening it returns a snapshot of the
+// statistics of all spinlocks, one line per lock. Does nothing unless the
+// kernel is built with SPINLOCK_STATS.
+
+extern void lockstat_attach(void);
+
+static inline void spin_lock(struct spinlock * lk);
+static inline int spin_trylock(struct spinlock * lk);
+static inline void spin_unlock(struct spinlock * lk);
+
+// The irqsave variants disable interrupts before taking the lock and restore
+// the previous interrupt state after releasing it. The value returned by
+// spin_lock_irqsave must be passed to spin_unlock_irqrestore.
+
+static inline int spin_lock_irqsave(struct spinlock * lk);
+static inline void spin_unlock_irqrestore(struct spinlock * lk, int saved);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+#ifdef SPINLOCK_STATS
+
+static inline void spinlock_stats_acquired(struct spinlock * lk, int spun) {
+    lk->stats.acquisitions += 1;
+    lk->stats.contended += spun;
+    lk->t_acquired = csrr_cycle();
+}
+
+static inline void spinlock_stats_released(struct spinlock * lk) {
+    const uint64_t held = csrr_cycle() - lk->t_acquired;
+
+    lk->stats.hold_total += held;
+    if (lk->stats.hold_max < held)
+        lk->stats.hold_max = held;
+}
+
+#endif
+
+static inline void spin_lock(struct spinlock * lk) {
+    int spun = 0;
+
+    preempt_disable();
+
+    while (__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+        spun = 1;
+        // Spin on a plain load so we do not hammer the line with AMOs
+        while (lk->locked)
+            continue;
+    }
+
+#ifdef SPINLOCK_STATS
+    spinlock_stats_acquired(lk, spun);
+#else
+    (void)spun;
+#endif
+}
+
+static inline int spin_trylock(struct spinlock * lk) {
+    preempt_disable();
+
+    if (__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+        preempt_enable();
+        return 0;
+    }
+
+#ifdef SPINLOCK_STATS
+    spinlock_stats_acquired(lk, 0);
+#endif
+    return 1;
+}
+
+static inline void spin_unlock(struct spinlock * lk) {
+#ifdef SPINLOCK_STATS
+    spinlock_stats_released(lk);
+#endif
+    __sync_lock_release(&lk->locked);
+    preempt_enable();
+}
+
+static inline int spin_lock_irqsave(struct spinlock * lk) {
+    const int saved = intr_disable();
+    spin_lock(lk);
+    return saved;
+}
+
+static inline void spin_unlock_irqrestore(struct spinlock * lk, int saved) {
+    // Re-enable preemption last, so that a pending reschedule happens now
+    // rather than at the next interrupt.
+
+#ifdef SPINLOCK_STATS
+    spinlock_stats_released(lk);
+#endif
+    __sync_lock_release(&lk->locked);
+    intr_restore(saved);
+    preempt_enable();
+}
+
+#endif // _SPINLOCK_H_
@@ -13,6 +13,7 @@
 #include "timer.h"
 #include "thread.h"
 #include "heap.h"
+#include "futex.h"
 
 int64_t syscall(struct trap_frame * tfr); // declare helper function
 
@@ -245,22 +246,13 @@ iotab of the parent into the child. Finishes by calling the thread fork to user
 */
 static int sysfork(const struct trap_frame * tfr) {
     struct process* proc = current_process();          // find the current process
+    int result;
 
-    int i = 1;
-    int pid = 1;
-    while (i < 16) { // loop through proctab to find next available proccess id
-        if (proctab[i] == NULL) {
-            pid = i;
-            break;
-        }
-        i++;
-    }
-    console_printf("reached kmalloc\n");
-    proctab[pid] = kmalloc(sizeof(struct process));
-    
-    proctab[pid]->id = pid; // set the id
+    struct process* child = process_alloc(); // allocate process and process id
 
-    struct process* child = proctab[pid]; // ptr to process
+    if (child == NULL){ // check if process table full
+        return -ENOMEM; // return error
+    }
 
     for (int i = 0; i < PROCESS_IOMAX; i++){ // loop through and copy iotab
         if (proc->iotab[i]){    
@@ -269,8 +261,22 @@ static int sysfork(const struct trap_frame * tfr) {
         }   
     }
 
-    thread_fork_to_user(proctab[pid], tfr); // call thread fork
-    return proctab[pid]->tid; // return thread id
+    child->nthreads = 1; // only the calling thread is copied
+
+    result = thread_fork_to_user(child, tfr); // call thread fork
+
+    if (result < 0){ // check if out of threads
+        for (int i = 0; i < PROCESS_IOMAX; i++){ // drop references taken above
+            if (child->iotab[i]){
+                ioclose(child->iotab[i]);
+                child->iotab[i] = NULL;
+            }
+        }
+        process_free(child);
+        return result; // return error
+    }
+
+    return child->tid; // return thread id
 }
 
 /*
@@ -301,6 +307,104 @@ static int sysusleep(unsigned long us) {
     return 0;
 }
 
+/*
+Inputs: runtime, relative deadline and period in microseconds
+Outputs: 0 or error code
+Purpose: Puts the calling thread in the deadline scheduling class, or takes it out if runtime is 0
+*/
+static int syssched_deadline(unsigned long runtime, unsigned long deadline, unsigned long period) {
+    const uint64_t tpus = TIMER_FREQ / 1000 / 1000; // ticks per microsecond
+
+    return thread_set_deadline(runtime * tpus, deadline * tpus, period * tpus);
+}
+
+/*
+Inputs: none
+Outputs: 0
+Purpose: Ends the current job of a deadline thread until its next period, or yields the CPU
+*/
+static int syssched_yield(void) {
+    thread_deadline_yield();
+    return 0;
+}
+
+/*
+Inputs: CPU quota and period in microseconds
+Outputs: 0 or error code
+Purpose: Limits the CPU time of the calling process and the processes it forks afterwards (no limit if quota is 0)
+*/
+static int syscpu_quota(unsigned long quota, unsigned long period) {
+    const uint64_t tpus = TIMER_FREQ / 1000 / 1000; // ticks per microsecond
+
+    return cpu_quota_set(current_process(), quota * tpus, period * tpus);
+}
+
+/*
+Inputs: struct trap frame pointer, start address, argument, user stack pointer and thread pointer
+Outputs: thread id of the new thread or error code
+Purpose: Creates another thread in the current process
+*/
+static int systhread_create(const struct trap_frame * tfr,
+    uintptr_t start, uintptr_t arg, uintptr_t stack, uintptr_t tls)
+{
+    return process_thread_create(tfr, start, arg, stack, tls);
+}
+
+/*
+Inputs: tid (32 bit)
+Outputs: thread id of the exited thread or error code
+Purpose: Waits for a thread created by the calling thread to exit
+*/
+static int systhread_join(int tid) {
+    return thread_join(tid);
+}
+
+/*
+Inputs: none
+Outputs: none
+Purpose: Terminates the calling thread; the process exits with its last thread
+*/
+static int systhread_exit(void) {
+    process_thread_exit();
+    return 0;
+}
+
+/*
+Inputs: user address of futex word, expected value, timeout in microseconds (0 for none)
+Outputs: 0 when woken or error code
+Purpose: Sleeps until the futex is woken, if the futex word still holds the expected value
+*/
+static int sysfutex_wait(volatile int * uaddr, int val, unsigned long us) {
+    return futex_wait(uaddr, val, us * (TIMER_FREQ / 1000 / 1000));
+}
+
+/*
+Inputs: user address of futex word, maximum number of threads to wake
+Outputs: number of threads woken or error code
+Purpose: Wakes threads sleeping on a futex
+*/
+static int sysfutex_wake(volatile int * uaddr, int cnt) {
+    return futex_wake(uaddr, cnt);
+}
+
+/*
+Inputs: none
+Outputs: user address of the ring page or error code
+Purpose: Sets up the submission and completion rings of the current process
+*/
+static int64_t sysioring_setup(void) {
+    return ioring_setup(current_process());
+}
+
+/*
+Inputs: number of entries to submit, number of completions to wait for
+Outputs: number of entries submitted or error code
+Purpose: Submits queued ring entries and waits for completions in a single trap
+*/
+static int sysioring_enter(unsigned int to_submit, unsigned int min_complete) {
+    return ioring_enter(current_process(), to_submit, min_complete);
+}
+
 /*
 Inputs: struct trap frame
 Outputs: none
@@ -360,8 +464,39 @@ int64_t syscall(struct trap_frame * tfr){
         
         case SYSCALL_WAIT:
             return syswait((int)tfr->x[TFR_A0]);
+
+        case SYSCALL_SCHED_DEADLINE:
+            return syssched_deadline((unsigned long)tfr->x[TFR_A0], (unsigned long)tfr->x[TFR_A1], (unsigned long)tfr->x[TFR_A2]);
+
+        case SYSCALL_SCHED_YIELD:
+            return syssched_yield();
+
+        case SYSCALL_CPU_QUOTA:
+            return syscpu_quota((unsigned long)tfr->x[TFR_A0], (unsigned long)tfr->x[TFR_A1]);
+
         case SYSCALL_FORK:
             return sysfork(tfr);
+
+        case SYSCALL_THREAD_CREATE:
+            return systhread_create(tfr, tfr->x[TFR_A0], tfr->x[TFR_A1], tfr->x[TFR_A2], tfr->x[TFR_A3]);
+
+        case SYSCALL_THREAD_JOIN:
+            return systhread_join((int)tfr->x[TFR_A0]);
+
+        case SYSCALL_THREAD_EXIT:
+            return systhread_exit();
+
+        case SYSCALL_FUTEX_WAIT:
+            return sysfutex_wait((volatile int *)tfr->x[TFR_A0], (int)tfr->x[TFR_A1], (unsigned long)tfr->x[TFR_A2]);
+
+        case SYSCALL_FUTEX_WAKE:
+            return sysfutex_wake((volatile int *)tfr->x[TFR_A0], (int)tfr->x[TFR_A1]);
+
+        case SYSCALL_IORING_SETUP:
+            return sysioring_setup();
+
+        case SYSCALL_IORING_ENTER:
+            return sysioring_enter((unsigned int)tfr->x[TFR_A0], (unsigned int)tfr->x[TFR_A1]);
         default:
             return EINVAL;
 
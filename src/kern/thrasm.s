@@ -139,38 +139,93 @@ _thread_finish_jump:
 
         sret # return
 
-        .global _thread_finish_fork
-        .type   _thread_finish_fork, @function
-
-# Inputs: *child (struct thread), *parent_tfr (struct trap_frame)
-# Outputs: none
-# Purpose: begins by saving the currently running thread, switches to the new child process thread and back to the u mode 
-# interrupt handler. it then restores the saved trap frame which is actually the duplicated parent trap frame. 
-_thread_finish_fork:
-        # save currently running thread 
-        sd      s0, 0*8(tp)
-        sd      s1, 1*8(tp)
-        sd      s2, 2*8(tp)
-        sd      s3, 3*8(tp)
-        sd      s4, 4*8(tp)
-        sd      s5, 5*8(tp)
-        sd      s6, 6*8(tp)
-        sd      s7, 7*8(tp)
-        sd      s8, 8*8(tp)
-        sd      s9, 9*8(tp)
-        sd      s10, 10*8(tp)
-        sd      s11, 11*8(tp)
-        sd      ra, 12*8(tp)
-        sd      sp, 13*8(tp)
-
-        # acquire the user's sp
-        mv tp, a0
-
-        sret
-
-   
-        
+        .global _fpu_save
+        .type   _fpu_save, @function
+
+# void _fpu_save(struct fpu_state * fps)
+# Saves f0 - f31 and fcsr to /fps/. FP access must be enabled (sstatus.FS not
+# Off).
+
+_fpu_save:
+        fsd     f0, 0*8(a0)
+        fsd     f1, 1*8(a0)
+        fsd     f2, 2*8(a0)
+        fsd     f3, 3*8(a0)
+        fsd     f4, 4*8(a0)
+        fsd     f5, 5*8(a0)
+        fsd     f6, 6*8(a0)
+        fsd     f7, 7*8(a0)
+        fsd     f8, 8*8(a0)
+        fsd     f9, 9*8(a0)
+        fsd     f10, 10*8(a0)
+        fsd     f11, 11*8(a0)
+        fsd     f12, 12*8(a0)
+        fsd     f13, 13*8(a0)
+        fsd     f14, 14*8(a0)
+        fsd     f15, 15*8(a0)
+        fsd     f16, 16*8(a0)
+        fsd     f17, 17*8(a0)
+        fsd     f18, 18*8(a0)
+        fsd     f19, 19*8(a0)
+        fsd     f20, 20*8(a0)
+        fsd     f21, 21*8(a0)
+        fsd     f22, 22*8(a0)
+        fsd     f23, 23*8(a0)
+        fsd     f24, 24*8(a0)
+        fsd     f25, 25*8(a0)
+        fsd     f26, 26*8(a0)
+        fsd     f27, 27*8(a0)
+        fsd     f28, 28*8(a0)
+        fsd     f29, 29*8(a0)
+        fsd     f30, 30*8(a0)
+        fsd     f31, 31*8(a0)
+        frcsr   t0
+        sd      t0, 32*8(a0)
+        ret
 
+        .global _fpu_restore
+        .type   _fpu_restore, @function
+
+# void _fpu_restore(const struct fpu_state * fps)
+# Loads f0 - f31 and fcsr from /fps/. FP access must be enabled (sstatus.FS not
+# Off).
+
+_fpu_restore:
+        ld      t0, 32*8(a0)
+        fscsr   t0
+        fld     f0, 0*8(a0)
+        fld     f1, 1*8(a0)
+        fld     f2, 2*8(a0)
+        fld     f3, 3*8(a0)
+        fld     f4, 4*8(a0)
+        fld     f5, 5*8(a0)
+        fld     f6, 6*8(a0)
+        fld     f7, 7*8(a0)
+        fld     f8, 8*8(a0)
+        fld     f9, 9*8(a0)
+        fld     f10, 10*8(a0)
+        fld     f11, 11*8(a0)
+        fld     f12, 12*8(a0)
+        fld     f13, 13*8(a0)
+        fld     f14, 14*8(a0)
+        fld     f15, 15*8(a0)
+        fld     f16, 16*8(a0)
+        fld     f17, 17*8(a0)
+        fld     f18, 18*8(a0)
+        fld     f19, 19*8(a0)
+        fld     f20, 20*8(a0)
+        fld     f21, 21*8(a0)
+        fld     f22, 22*8(a0)
+        fld     f23, 23*8(a0)
+        fld     f24, 24*8(a0)
+        fld     f25, 25*8(a0)
+        fld     f26, 26*8(a0)
+        fld     f27, 27*8(a0)
+        fld     f28, 28*8(a0)
+        fld     f29, 29*8(a0)
+        fld     f30, 30*8(a0)
+        fld     f31, 31*8(a0)
+        ret
 
 # Statically allocated stack for the idle thread.
 
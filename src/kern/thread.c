@@ -14,14 +14,45 @@
 #include "intr.h"
 #include "process.h"
 #include "memory.h"
+#include "timer.h"
+#include "error.h"
+#include "idmap.h"
+#include "lock.h"
+#include "device.h"
+#include "io.h"
 
 // COMPILE-TIME PARAMETERS
 //
 
-// NTHR is the maximum number of threads
+// NTHR is the maximum number of threads. The thread table is allocated in
+// page-sized chunks as it grows, so a large NTHR costs little memory until the
+// threads are actually created.
 
 #ifndef NTHR
-#define NTHR 16
+#define NTHR 4096
+#endif
+
+// RQDELAY_BUCKETS is the number of buckets of the run-queue delay histogram.
+// Bucket 0 counts delays of less than one timer tick and bucket /i/ delays of
+// 2^(i-1) to 2^i-1 ticks. The last bucket also counts all longer delays.
+
+#ifndef RQDELAY_BUCKETS
+#define RQDELAY_BUCKETS 24
+#endif
+
+// THREAD_DL_BW_MAX is the share of the CPU, in percent, that deadline threads
+// may reserve in total (see thread_set_deadline). The rest is left to the
+// priority classes, so that they are not starved.
+
+#ifndef THREAD_DL_BW_MAX
+#define THREAD_DL_BW_MAX 95
+#endif
+
+// CPU_QUOTA_PERIOD_MIN is the shortest period of a CPU quota, in timer ticks.
+// Each group with a quota takes a timer interrupt every period.
+
+#ifndef CPU_QUOTA_PERIOD_MIN
+#define CPU_QUOTA_PERIOD_MIN (TIMER_FREQ / 1000)
 #endif
 
 // EXPORTED GLOBAL VARIABLES
@@ -47,6 +78,15 @@ struct thread_context {
     void * sp;
 };
 
+// Saved floating-point registers (layout used by _fpu_save and _fpu_restore
+// in thrasm.s). A thread that has not used the FPU yet has all zeroes here,
+// which is also the FPU's initial state.
+
+struct fpu_state {
+    uint64_t f[32];
+    uint64_t fcsr;
+};
+
 struct thread {
     struct thread_context context; // must be first member (thrasm.s)
     const char * name;
@@ -55,22 +95,100 @@ struct thread {
     enum thread_state state;
     int id;
     struct process * proc;
+    struct thread * proc_next; // next thread of proc
+    struct thread * proc_prev; // previous thread of proc
     struct thread * parent;
+    struct thread * child_head; // first child
+    struct thread * sibling_next; // next child of parent
+    struct thread * sibling_prev; // previous child of parent
+    struct thread_list zombies; // exited children not yet joined
+    int base_prio; // priority set by thread_set_priority
+    int prio; // effective priority, including inherited priority
+    struct lock * held_locks; // locks held, linked through next_held
+    struct lock * blocked_on; // lock we are waiting for, if any
+    int preempt_count; // preemption is disabled while non-zero
+    uint64_t t_state; // time of last state change (rdtime)
+    struct thread_stats stats;
+    uint64_t dl_runtime; // deadline class budget per period, 0 if not in class
+    uint64_t dl_deadline; // deadline of each job relative to its release
+    uint64_t dl_period;
+    uint64_t dl_abs; // absolute deadline of the current job
+    uint64_t dl_budget; // runtime left in the current job
+    char dl_throttled; // out of budget until the next period
+    struct alarm dl_timer; // budget enforcement and replenishment
+    struct fpu_state fpstate; // valid unless we are fpu_owner and FS is Dirty
     struct thread * list_next;
     struct condition * wait_cond;
+    char wait_exclusive; // see condition_wait_exclusive
+    char wait_intr; // see condition_wait_intr
+    char interrupted; // set by thread_interrupt, never cleared
     struct condition child_exit;
 };
 
+// Flags of condition_wait_flags
+
+#define WAIT_EXCLUSIVE  1 // see condition_wait_exclusive
+#define WAIT_INTR       2 // see condition_wait_intr
+
+// A thread waiting in condition_wait_timeout arms an alarm whose expiry
+// callback takes the thread off the condition's wait list.
+
+struct wait_timeout {
+    struct alarm alarm;
+    struct thread * thr;
+    struct condition * cond;
+    int timed_out;
+};
+
+// A CPU bandwidth group is a set of processes that share a CPU quota: the
+// threads of the group together run for at most /quota/ ticks in every
+// /period/. A group starts with the process that sets the quota, and the
+// processes it forks join it. Once the group has used up its quota, it is
+// throttled: its threads are parked on /parked/ instead of the ready lists
+// until the period timer refills the quota. Deadline threads are charged but
+// never parked, since their own bandwidth is already limited.
+
+struct cpu_quota {
+    uint64_t quota;
+    uint64_t period;
+    uint64_t used; // running time charged in the current period
+    int refcnt; // number of processes in the group
+    char throttled;
+    struct thread_list parked; // READY threads held back while throttled
+    struct alarm period_timer;
+};
+
+// ps_open copies the state of up to PS_BATCH threads at a time into ps_entry
+// structures with interrupts disabled, then formats them with interrupts
+// enabled. The name is copied too, since it may live in a buffer of the
+// thread that spawned the thread.
+
+#define PS_BATCH 8
+#define PS_NAMELEN 16
+
+struct ps_entry {
+    int tid;
+    char name[PS_NAMELEN];
+    enum thread_state state;
+    int prio;
+    struct thread_stats stats;
+};
+
 // INTERNAL GLOBAL VARIABLES
 //
 
 #define MAIN_TID 0
-#define IDLE_TID (NTHR-1)
+#define IDLE_TID 1
+
+#define THRTAB_CHUNK (PAGE_SIZE / sizeof(struct thread *))
+#define THRTAB_CHUNKCNT ((NTHR + THRTAB_CHUNK-1) / THRTAB_CHUNK)
 
 struct thread main_thread = {
     .name = "main",
     .id = MAIN_TID,
     .state = THREAD_RUNNING,
+    .base_prio = THREAD_PRIO_DEFAULT,
+    .prio = THREAD_PRIO_DEFAULT,
     .child_exit = {
         .name = "main.child_exit"
     }
@@ -80,29 +198,121 @@ struct thread idle_thread = {
     .name = "idle",
     .id = IDLE_TID,
     .state = THREAD_READY,
+    .base_prio = THREAD_PRIO_IDLE,
+    .prio = THREAD_PRIO_IDLE,
     .parent = &main_thread
 };
 
-static struct thread * thrtab[NTHR] = {
-    [MAIN_TID] = &main_thread,
-    [IDLE_TID] = &idle_thread
-};
+// The thread table is an array of pointers to page-sized chunks of thread
+// pointers, indexed by thread id. Chunks are allocated when the first thread
+// id in them is handed out. Free thread ids are tracked by thrids.
+
+static struct thread ** thrtab[THRTAB_CHUNKCNT];
+
+static uint64_t thrids_free[IDMAP_WORDS(NTHR)];
+static uint64_t thrids_summary[IDMAP_SUMMARY_WORDS(NTHR)];
+static struct idmap thrids;
+
+// Recycled thread structures, linked through list_next. Since kfree does not
+// return memory to the heap, we reuse them ourselves.
+
+static struct thread * thread_free_list;
 
-static struct thread_list ready_list;
+// There is one ready-to-run list per priority level, plus one for threads in
+// the deadline class, which rank above all priorities. The deadline list is
+// kept sorted by absolute deadline, so its head is the thread with the
+// earliest deadline. Bit /r/ of ready_mask is set when ready_list[r] is not
+// empty, so the highest ranked runnable thread is found in constant time.
+
+#define NPRIO (THREAD_PRIO_MAX+1)
+#define DL_RANK NPRIO
+
+static struct thread_list ready_list[NPRIO+1];
+static uint64_t ready_mask;
+
+// Total CPU bandwidth reserved by deadline threads, as the sum of their
+// runtime/period in DL_BW_SHIFT-bit fixed point. Periods are limited to
+// DL_PERIOD_MAX ticks so that the products in dl_account cannot overflow.
+
+#define DL_BW_SHIFT 20
+#define DL_BW_ONE (UINT64_C(1) << DL_BW_SHIFT)
+#define DL_PERIOD_MAX (UINT64_C(1) << 31)
+
+static uint64_t dl_total_bw;
+
+// Expires when the running thread's CPU bandwidth group runs out of quota, so
+// that the interrupt return path preempts the thread.
+
+static struct alarm quota_timer;
+
+// Set when a thread that should run instead of the current one becomes ready,
+// or when the current thread runs out of budget or quota. Cleared when
+// suspend_self picks the next thread. An interrupt taken in S mode preempts
+// the current thread if need_resched is set and preemption is enabled; one
+// taken in U mode always does.
+
+static char need_resched;
+
+// Histogram of the time threads spend on a ready list before they run, over
+// all threads (see RQDELAY_BUCKETS).
+
+static uint64_t rqdelay_hist[RQDELAY_BUCKETS];
+
+// The FPU registers are switched lazily. fpu_owner is the thread whose state
+// is in the FP registers, or NULL. When switching threads, the registers are
+// saved only if sstatus.FS is Dirty, and FP access is turned off unless the
+// next thread is fpu_owner. The first FP instruction of any other thread then
+// traps (see thread_fpu_trap), and its state is loaded. Hence a thread that
+// never uses the FPU never pays for it. The kernel itself does not use FP.
+
+static struct thread * fpu_owner;
 
 // INTERNAL MACRO DEFINITIONS
 // 
 
 // Macro for changing thread state. If compiled for debugging (DEBUG is
-// defined), prints function that changed thread state.
+// defined), prints function that changed thread state. Charges the time since
+// the last state change to the old state (see account_state).
 
 #define set_thread_state(t,s) do { \
     debug("Thread \"%s\" state changed from %s to %s in %s", \
         (t)->name, thread_state_name((t)->state), thread_state_name(s), \
         __func__); \
+    account_state((t), (s)); \
     (t)->state = (s); \
 } while (0)
 
+// Rank of a thread for the ready lists: its effective priority, or DL_RANK if
+// it is in the deadline class.
+
+#define thread_rank(t) ((t)->dl_runtime != 0 ? DL_RANK : (t)->prio)
+
+// Priority a thread lends to the holder of a lock it is waiting for. Deadline
+// threads lend the highest priority.
+
+#define lend_prio(t) ((t)->dl_runtime != 0 ? THREAD_PRIO_MAX : (t)->prio)
+
+// CPU bandwidth group of a thread, or NULL
+
+#define thread_cpuq(t) ((t)->proc != NULL ? (t)->proc->cpuq : NULL)
+
+// A thread that must not be put on a ready list because its group is
+// throttled
+
+#define thread_parked(t) ((t)->dl_runtime == 0 && \
+    thread_cpuq(t) != NULL && thread_cpuq(t)->throttled)
+
+// Nonzero if thread /a/ should run ahead of thread /b/: it ranks higher or,
+// if both are deadline threads, its deadline is earlier.
+
+#define thread_outranks(a,b) (thread_rank(a) > thread_rank(b) || \
+    (thread_rank(a) == DL_RANK && thread_rank(b) == DL_RANK && \
+    (a)->dl_abs < (b)->dl_abs))
+
+// Bandwidth of a deadline thread in DL_BW_SHIFT-bit fixed point
+
+#define dl_bw(t) (((t)->dl_runtime << DL_BW_SHIFT) / (t)->dl_period)
+
 // Pointer to current thread, which is kept in the tp (x4) register.
 
 #define CURTHR ((struct thread*)__builtin_thread_pointer())
@@ -128,12 +338,40 @@ static void set_running_thread(struct thread * thr);
 static const char * thread_state_name(enum thread_state state)
     __attribute__ ((unused));
 
+// Returns the thread with the given id, or NULL if there is none.
+
+static struct thread * thread_lookup(int tid);
+
+// struct thread * thread_alloc(const char * name)
+// Allocates a thread id, a struct thread and a stack for a new child of the
+// current thread. The caller must finish setting up the thread and make it
+// runnable. Returns NULL if we are out of thread ids.
+
+static struct thread * thread_alloc(const char * name);
+
+// Common part of thread_spawn and thread_spawn_detached. The new thread
+// belongs to process /proc/, which may be NULL.
+
+static int thread_spawn_proc (const char * name,
+    void (*start)(void), void * arg, struct process * proc);
+
 // void recycle_thread(int tid)
 // Reclaims a thread's slot in thrtab and makes its parent the parent of its
 // children. Frees the struct thread of the thread.
 
 static void recycle_thread(int tid);
 
+// The following functions add and remove a thread from its parent's list of
+// children. Must be called with interrupts disabled.
+
+static void add_child(struct thread * parent, struct thread * child);
+static void remove_child(struct thread * child);
+
+// Moves a thread from the thread list of its process to that of /proc/.
+// Either process may be NULL.
+
+static void set_thread_process(struct thread * thr, struct process * proc);
+
 // void suspend_self(void)
 // Suspends the currently running thread and resumes the next thread on the
 // ready-to-run list using _thread_swtch (in threasm.s). Must be called with
@@ -142,11 +380,110 @@ static void recycle_thread(int tid);
 // on the ready-to-run list. Note that suspend_self will only return if the
 // current thread becomes READY.
 
-static void suspend_self(void);
+static int suspend_self(void);
+
+// void thread_start_user(struct thread * thr, const struct trap_frame * tfr)
+// Makes a newly allocated thread ready to run. When it is first scheduled,
+// it returns to U mode with the register state in /tfr/.
+
+static void thread_start_user(struct thread * thr, const struct trap_frame * tfr);
+
+// Common part of the condition_wait functions. Argument /flags/ is a
+// combination of WAIT_EXCLUSIVE and WAIT_INTR. Returns -EINTR if an
+// interruptible wait was interrupted and 0 otherwise.
+
+static int condition_wait_flags(struct condition * cond, int flags);
+
+// Common part of condition_wait_timeout and condition_wait_timeout_intr
+
+static int condition_wait_timeout_flags (
+    struct condition * cond, uint64_t tcnt, int flags);
+
+// The following functions manage the ready-to-run lists. ready_insert adds a
+// thread to the back of the list for its priority, or in deadline order to the
+// deadline list, ready_remove takes the first thread of the highest ranked
+// non-empty list (or returns NULL), and ready_unlink takes a specific thread
+// off its list. A throttled deadline thread is not put on any list; it is
+// inserted when its budget is replenished. Threads of a throttled CPU
+// bandwidth group are parked on the group's list, and ready_remove parks any
+// it finds on the ready lists. Must be called with interrupts disabled.
+
+static void ready_insert(struct thread * thr);
+static struct thread * ready_remove(void);
+static void ready_unlink(struct thread * thr);
+
+// Returns the highest rank of any ready thread (DL_RANK if a deadline thread
+// is ready), or -1 if none is ready. Must be called with interrupts disabled.
+
+static int ready_max_prio(void);
+
+// Changes the effective priority of a thread, moving it to the right ready
+// list if it is READY. Must be called with interrupts disabled.
+
+static void set_effective_prio(struct thread * thr, int prio);
+
+// Recomputes the effective priority of a thread from its base priority and
+// the priorities of the threads waiting for locks it holds. Must be called
+// with interrupts disabled.
+
+static void update_prio(struct thread * thr);
+
+// Adds the time /thr/ spent in its current state to its statistics, in
+// preparation for a change to state /next/. A READY to RUNNING change is also
+// recorded in the run-queue delay histogram.
+
+static void account_state(struct thread * thr, enum thread_state next);
+
+// Deadline class bookkeeping, called by account_state with interrupts disabled
+// when a deadline thread changes from state /thr->state/ to /next/. Charges
+// /dt/ ticks of running time to the budget, arms dl_timer to enforce the
+// budget while the thread runs, throttles the thread if it leaves the CPU with
+// no budget left, and starts a new job if it wakes up too late to finish the
+// current one by its deadline.
+
+static void dl_account(struct thread * thr, enum thread_state next,
+    uint64_t now, uint64_t dt);
+
+// Starts the next job of a deadline thread, with a full budget and a deadline
+// one period after that of the current job (or relative to /now/ if the
+// thread has fallen behind), and clears dl_throttled.
+
+static void dl_replenish(struct thread * thr, uint64_t now);
+
+// Arms dl_timer to expire at time /t/ (rdtime).
+
+static void dl_arm(struct thread * thr, uint64_t t);
+
+// CPU quota bookkeeping, called by account_state with interrupts disabled
+// when a thread of a CPU bandwidth group changes from state /thr->state/ to
+// /next/. Charges /dt/ ticks of running time to the group, arms quota_timer
+// when the thread starts running and throttles the group when the thread
+// leaves the CPU with the quota used up.
+
+static void cpu_quota_account(struct thread * thr, enum thread_state next,
+    uint64_t now, uint64_t dt);
+
+// Drops a process's reference to a CPU bandwidth group, freeing the group
+// with the last one. Must be called with interrupts disabled.
+
+static void cpu_quota_put(struct cpu_quota * q);
+
+// Saves the FPU state of the suspending thread if it is dirty and sets FP
+// access for the resuming thread. Called by suspend_self with interrupts
+// disabled.
+
+static void fpu_switch(struct thread * susp_thread, struct thread * next_thread);
+
+// An open ps device is a snapshot file (see iosnap_alloc) with the state and
+// scheduling statistics of all threads, taken when the device is opened. The
+// table is copied in batches (see struct ps_entry), so threads may come and go
+// between batches.
+
+static int ps_open(struct io_intf ** ioptr, void * aux);
 
 // The following functions manipulate a thread list (struct thread_list). Note
 // that threads form a linked list via the list_next member of each thread
-// structure. Thread lists are used for the ready-to-run list (ready_list) and
+// structure. Thread lists are used for the ready-to-run lists (ready_list) and
 // for the list of waiting threads of each condition variable. These functions
 // are not interrupt-safe! The caller must disable interrupts before calling any
 // thread list function that may modify a list that is used in an ISR.
@@ -155,7 +492,25 @@ static void tlclear(struct thread_list * list);
 static int tlempty(const struct thread_list * list);
 static void tlinsert(struct thread_list * list, struct thread * thr);
 static struct thread * tlremove(struct thread_list * list);
-static void tlappend(struct thread_list * l0, struct thread_list * l1);
+static int tlunlink(struct thread_list * list, struct thread * thr);
+
+// Alarm callback for condition_wait_timeout. Called from the timer ISR.
+
+static void wait_timeout_expired(struct alarm * al);
+
+// Callback of dl_timer. Called from the timer ISR. Replenishes a throttled
+// deadline thread and makes it ready to run again if it was runnable.
+
+static void dl_timer_expired(struct alarm * al);
+
+// Callback of a CPU bandwidth group's period timer. Called from the timer ISR.
+// Refills the group's quota and unparks its threads.
+
+static void cpu_quota_refill(struct alarm * al);
+
+// Callback of quota_timer. Called from the timer ISR.
+
+static void quota_timer_expired(struct alarm * al);
 
 static void idle_thread_func(void * arg);
 
@@ -172,7 +527,12 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
     const struct thread_stack_anchor * stack_anchor,
     uintptr_t usp, uintptr_t upc, ...);
 
-extern void _thread_finish_fork (struct thread * child, const struct trap_frame * parent_tfr);
+// defined in trapasm.s
+
+extern void _trap_return_to_umode(void);
+
+extern void _fpu_save(struct fpu_state * fps);
+extern void _fpu_restore(const struct fpu_state * fps);
 
 
 // EXPORTED FUNCTION DEFINITIONS
@@ -183,70 +543,65 @@ int running_thread(void) {
 }
 
 void thread_init(void) {
+    idmap_init(&thrids, thrids_free, thrids_summary, NTHR);
+    idmap_reserve(&thrids, MAIN_TID);
+    idmap_reserve(&thrids, IDLE_TID);
+
+    thrtab[0] = memory_alloc_page();
+    memset(thrtab[0], 0, PAGE_SIZE);
+    thrtab[0][MAIN_TID] = &main_thread;
+    thrtab[0][IDLE_TID] = &idle_thread;
+
     init_main_thread();
     init_idle_thread();
+    main_thread.t_state = idle_thread.t_state = csrr_time();
+    alarm_init(&quota_timer, "cpu_quota");
+    quota_timer.func = quota_timer_expired;
+    csrc_sstatus(RISCV_SSTATUS_FS); // no thread owns the FPU yet
     set_running_thread(&main_thread);
     thrmgr_initialized = 1;
 }
 
 int thread_spawn(const char * name, void (*start)(void), void * arg) {
-    struct thread_stack_anchor * stack_anchor;
-    void * stack_page;
-    struct thread * child;
-    int saved_intr_state;
-    int tid;
-
     trace("%s(name=\"%s\") in %s", __func__, name, CURTHR->name);
+    return thread_spawn_proc(name, start, arg, CURTHR->proc);
+}
 
-    // Find a free thread slot.
-
-    tid = 0;
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
-    
-    if (tid == NTHR)
-        panic("Too many threads");
-    
-    // Allocate a struct thread and a stack
-
-    child = kmalloc(sizeof(struct thread));
-
-    stack_page = memory_alloc_page();
-    stack_anchor = stack_page + PAGE_SIZE;
-    stack_anchor -= 1;
-    stack_anchor->thread = child;
-    stack_anchor->reserved = 0;
-
-
-    thrtab[tid] = child;
-
-    child->id = tid;
-    child->name = name;
-    child->parent = CURTHR;
-    child->proc = CURTHR->proc;
-    child->stack_base = stack_anchor;
-    child->stack_size = child->stack_base - stack_page;
-    set_thread_state(child, THREAD_READY);
-
-    saved_intr_state = intr_disable();
-    tlinsert(&ready_list, child);
-    intr_restore(saved_intr_state);
-
-    _thread_setup(child, child->stack_base, start, arg);
-    
-    return tid;
+int thread_spawn_detached (
+    const char * name, void (*start)(void), void * arg)
+{
+    trace("%s(name=\"%s\") in %s", __func__, name, CURTHR->name);
+    return thread_spawn_proc(name, start, arg, NULL);
 }
 
 void thread_exit(void) {
     if (CURTHR == &main_thread)
         halt_success();
     
+    // Interrupts stay disabled until we have switched away from this thread
+    // for the last time.
+
+    intr_disable();
+
     set_thread_state(CURTHR, THREAD_EXITED);
+    set_thread_process(CURTHR, NULL);
+
+    // Our FP state dies with us. Turn FP access off too, so that switching
+    // away does not find FS Dirty and try to save it.
+
+    if (fpu_owner == CURTHR) {
+        fpu_owner = NULL;
+        csrc_sstatus(RISCV_SSTATUS_FS);
+    }
+
+    if (CURTHR->dl_runtime != 0)
+        dl_total_bw -= dl_bw(CURTHR);
 
-    // Signal parent in case it is waiting for us to exit
+    // Queue ourselves for our parent to join and signal it in case it is
+    // waiting for us to exit
 
     assert(CURTHR->parent != NULL);
+    tlinsert(&CURTHR->parent->zombies, CURTHR);
     condition_broadcast(&CURTHR->parent->child_exit);
 
     suspend_self(); // should not return
@@ -263,95 +618,134 @@ void thread_yield(void) {
     // assert (intr_enabled());
     assert (CURTHR->state == THREAD_RUNNING);
 
-    suspend_self();
+    if (suspend_self())
+        CURTHR->stats.nvcsw += 1;
+}
+
+void thread_preempt(void) {
+    trace("%s() in %s", __func__, CURTHR->name);
+
+    assert (CURTHR->state == THREAD_RUNNING);
+
+    if (suspend_self())
+        CURTHR->stats.nivcsw += 1;
 }
 
 int thread_join_any(void) {
-    int childcnt = 0;
+    struct thread * child;
+    int saved_intr_state;
     int tid;
 
     trace("%s() in %s", __func__, CURTHR->name);
 
-    // See if there are any children of the current thread, and if they have
-    // already exited. If so, call thread_wait_one() to finish up.
-
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL && thrtab[tid]->parent == CURTHR) {
-            if (thrtab[tid]->state == THREAD_EXITED)
-                return thread_join(tid);
-            childcnt++;
-        }
-    }
+    // If the current thread has no children, there is nothing to wait for
 
-    // If the current thread has no children, this is a bug. We could also
-    // return -EINVAL if we want to allow the calling thread to recover.
-
-    if (childcnt == 0)
-        panic("thread_wait called by childless thread");
+    if (CURTHR->child_head == NULL)
+        return -EINVAL;
     
+    // Wait for some child to exit. An exiting thread adds itself to its
+    // parent's zombie list and signals its parent's child_exit condition.
 
-    // Wait for some child to exit. An exiting thread signals its parent's
-    // child_exit condition.
-
-    condition_wait(&CURTHR->child_exit);
+    saved_intr_state = intr_disable();
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL &&
-            thrtab[tid]->parent == CURTHR &&
-            thrtab[tid]->state == THREAD_EXITED)
-        {
-            recycle_thread(tid);
-            return tid;
-        }
-    }
+    while (tlempty(&CURTHR->zombies))
+        condition_wait(&CURTHR->child_exit);
+    
+    child = tlremove(&CURTHR->zombies);
+    intr_restore(saved_intr_state);
 
-    panic("spurious child_exit signal");
+    tid = child->id;
+    recycle_thread(tid);
+    return tid;
 }
 
 // Wait for specific child thread to exit. Returns the thread id of the child.
 
 int thread_join(int tid) {
-    struct thread * const child = thrtab[tid];
-
-    trace("%s(tid=%d)", __func__, tid);
-
-    if (tid <= 0 || NTHR <= tid)
-        return -1;
+    struct thread * const child = thread_lookup(tid);
+    int saved_intr_state;
 
     trace("%s(tid=%d) in %s", __func__, tid, CURTHR->name);
 
     // Can only wait for child if we're the parent
 
     if (child == NULL || child->parent != CURTHR)
-        return -1;
+        return -EINVAL;
     
     // Wait for child to exit. Whenever a child exits, it signals its parent's
     // child_exit condition.
 
+    saved_intr_state = intr_disable();
+
     while (child->state != THREAD_EXITED)
         condition_wait(&CURTHR->child_exit);
     
+    tlunlink(&CURTHR->zombies, child);
+    intr_restore(saved_intr_state);
+    
     recycle_thread(tid);
 
     return tid;
 }
 
 struct process * thread_process(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->proc;
+    struct thread * const thr = thread_lookup(tid);
+    assert (thr != NULL);
+    return thr->proc;
 }
 
 void thread_set_process(int tid, struct process * proc) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    thrtab[tid]->proc = proc;
+    struct thread * const thr = thread_lookup(tid);
+    assert (thr != NULL);
+    set_thread_process(thr, proc);
+}
+
+void thread_interrupt(int tid) {
+    struct thread * const thr = thread_lookup(tid);
+    int saved_intr_state;
+
+    trace("%s(tid=%d) in %s", __func__, tid, CURTHR->name);
+
+    assert (thr != NULL);
+
+    saved_intr_state = intr_disable();
+
+    thr->interrupted = 1;
+
+    // Take the thread off the wait list if it is in an interruptible wait. It
+    // sees the flag when it resumes and returns -EINTR.
+
+    if (thr->state == THREAD_WAITING && thr->wait_intr &&
+        tlunlink(&thr->wait_cond->wait_list, thr))
+    {
+        thr->wait_cond = NULL;
+        set_thread_state(thr, THREAD_READY);
+        ready_insert(thr);
+    }
+
+    intr_restore(saved_intr_state);
+}
+
+void thread_interrupt_process(struct process * proc) {
+    struct thread * thr;
+    int saved_intr_state;
+
+    trace("%s() in %s", __func__, CURTHR->name);
+
+    saved_intr_state = intr_disable();
+
+    for (thr = proc->threads; thr != NULL; thr = thr->proc_next) {
+        if (thr != CURTHR)
+            thread_interrupt(thr->id);
+    }
+
+    intr_restore(saved_intr_state);
 }
 
 const char * thread_name(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->name;
+    struct thread * const thr = thread_lookup(tid);
+    assert (thr != NULL);
+    return thr->name;
 }
 
 void condition_init(struct condition * cond, const char * name) {
@@ -360,27 +754,33 @@ void condition_init(struct condition * cond, const char * name) {
 }
 
 void condition_wait(struct condition * cond) {
-    int saved_intr_state;
+    condition_wait_flags(cond, 0);
+}
 
-    trace("%s(cond=<%s>) in %s", __func__, cond->name, CURTHR->name);
+void condition_wait_exclusive(struct condition * cond) {
+    condition_wait_flags(cond, WAIT_EXCLUSIVE);
+}
 
-    assert(CURTHR->state == THREAD_RUNNING);
+int condition_wait_intr(struct condition * cond) {
+    return condition_wait_flags(cond, WAIT_INTR);
+}
 
-    // Insert current thread into condition wait list
-    
-    set_thread_state(CURTHR, THREAD_WAITING);
-    CURTHR->wait_cond = cond;
-    CURTHR->list_next = NULL;
+int condition_wait_exclusive_intr(struct condition * cond) {
+    return condition_wait_flags(cond, WAIT_EXCLUSIVE | WAIT_INTR);
+}
 
-    saved_intr_state = intr_disable();
-    tlinsert(&cond->wait_list, CURTHR);
-    intr_restore(saved_intr_state);
+int condition_wait_timeout(struct condition * cond, uint64_t tcnt) {
+    return condition_wait_timeout_flags(cond, tcnt, 0);
+}
 
-    suspend_self();
+int condition_wait_timeout_intr(struct condition * cond, uint64_t tcnt) {
+    return condition_wait_timeout_flags(cond, tcnt, WAIT_INTR);
 }
 
 void condition_broadcast(struct condition * cond) {
+    struct thread_list waiters;
     int saved_intr_state;
+    int woke_exclusive;
     struct thread * thr;
 
     // Fast path: if there are no threads waiting, return.
@@ -388,49 +788,453 @@ void condition_broadcast(struct condition * cond) {
     if (tlempty(&cond->wait_list))
         return;
 
-    // Mark all waiting threads runnable. This is *not* a constant-time
-    // operation, however, keeping having an enum thread_state member of struct
-    // thread for keeping track of thread state is useful for debugging.
+    // Mark waiting threads runnable and move them to the ready list, in the
+    // order they started waiting. Exclusive waiters after the first one stay
+    // on the wait list.
 
     saved_intr_state = intr_disable();
 
-    for (thr = cond->wait_list.head; thr != NULL; thr = thr->list_next) {
+    waiters = cond->wait_list;
+    tlclear(&cond->wait_list);
+    woke_exclusive = 0;
+
+    while ((thr = tlremove(&waiters)) != NULL) {
         assert (thr->state == THREAD_WAITING);
         assert (thr->wait_cond == cond);
+
+        if (thr->wait_exclusive && woke_exclusive) {
+            tlinsert(&cond->wait_list, thr);
+            continue;
+        }
+
+        woke_exclusive |= thr->wait_exclusive;
         set_thread_state(thr, THREAD_READY);
         thr->wait_cond = NULL;
+        ready_insert(thr);
     }
 
-    // Append condition variable wait list to run list
-
-    tlappend(&ready_list, &cond->wait_list);
-    tlclear(&cond->wait_list);
-
     intr_restore(saved_intr_state);
 }
 
-// INTERNAL FUNCTION DEFINITIONS
-//
+int condition_signal(struct condition * cond) {
+    int saved_intr_state;
+    struct thread * thr;
 
-void init_main_thread(void) {
-    extern char _main_stack_anchor[]; // from thrasm.s
-    extern char _main_stack_lowest[]; // from thrasm.s
+    // Fast path: if there are no threads waiting, return.
 
-    main_thread.stack_base = _main_stack_anchor;
-    main_thread.stack_size = _main_stack_anchor - _main_stack_lowest;
-}
+    if (tlempty(&cond->wait_list))
+        return -1;
+    
+    saved_intr_state = intr_disable();
 
-void init_idle_thread(void) {
-    extern char _idle_stack_anchor[]; // from thrasm.s
-    extern char _idle_stack_lowest[]; // from thrasm.s
+    thr = tlremove(&cond->wait_list);
 
-    extern void _thread_setup (
-        struct thread * thr, void * sp, void (*start)(void), ...);
+    if (thr != NULL) {
+        assert (thr->state == THREAD_WAITING);
+        assert (thr->wait_cond == cond);
+        set_thread_state(thr, THREAD_READY);
+        thr->wait_cond = NULL;
+        ready_insert(thr);
+    }
+
+    intr_restore(saved_intr_state);
+
+    return (thr != NULL) ? thr->id : -1;
+}
+
+int thread_get_priority(int tid) {
+    struct thread * const thr = thread_lookup(tid);
+    return (thr != NULL) ? thr->prio : -EINVAL;
+}
+
+int thread_set_priority(int tid, int prio) {
+    struct thread * const thr = thread_lookup(tid);
+    int saved_intr_state;
+
+    trace("%s(tid=%d,prio=%d) in %s", __func__, tid, prio, CURTHR->name);
+
+    if (thr == NULL || thr == &idle_thread || thr->state == THREAD_EXITED)
+        return -EINVAL;
+    
+    if (prio < THREAD_PRIO_MIN || THREAD_PRIO_MAX < prio)
+        return -EINVAL;
+    
+    saved_intr_state = intr_disable();
+    thr->base_prio = prio;
+    update_prio(thr);
+    intr_restore(saved_intr_state);
+
+    thread_yield_if_preempted();
+    return 0;
+}
+
+void thread_yield_if_preempted(void) {
+    int saved_intr_state;
+    int preempted;
+    int rank;
+
+    saved_intr_state = intr_disable();
+    rank = ready_max_prio();
+
+    if (rank == DL_RANK)
+        preempted = thread_outranks(ready_list[DL_RANK].head, CURTHR);
+    else
+        preempted = (rank > thread_rank(CURTHR));
+    
+    intr_restore(saved_intr_state);
+
+    if (preempted)
+        thread_preempt();
+}
+
+void preempt_disable(void) {
+    // Spinlocks are taken before the thread manager is initialized
+
+    if (!thrmgr_initialized)
+        return;
+    
+    CURTHR->preempt_count += 1;
+    asm volatile ("" ::: "memory");
+}
+
+void preempt_enable(void) {
+    if (!thrmgr_initialized)
+        return;
+    
+    assert (0 < CURTHR->preempt_count);
+    asm volatile ("" ::: "memory");
+    CURTHR->preempt_count -= 1;
+
+    // With interrupts disabled, we may be in an ISR or in a section that must
+    // not switch threads. The next interrupt handles the reschedule then.
+
+    if (CURTHR->preempt_count == 0 && need_resched && intr_enabled())
+        thread_preempt();
+}
+
+void preempt_intr_return(void) {
+    // The current thread may be in the middle of switching away in
+    // suspend_self, which enables interrupts before the switch. It is not
+    // RUNNING then.
+
+    if (need_resched && CURTHR->preempt_count == 0 &&
+        CURTHR->state == THREAD_RUNNING)
+        thread_preempt();
+}
+
+int thread_set_deadline(uint64_t runtime, uint64_t deadline, uint64_t period) {
+    struct thread * const thr = CURTHR;
+    int saved_intr_state;
+    uint64_t old_bw;
+    uint64_t new_bw;
+    uint64_t now;
+
+    trace("%s(runtime=%lu,deadline=%lu,period=%lu) in %s",
+        __func__, runtime, deadline, period, thr->name);
+
+    if (thr == &idle_thread)
+        return -EINVAL;
+    
+    if (runtime != 0 && (deadline < runtime || period < deadline ||
+        DL_PERIOD_MAX < period))
+        return -EINVAL;
+    
+    new_bw = (runtime != 0) ? (runtime << DL_BW_SHIFT) / period : 0;
+
+    saved_intr_state = intr_disable();
+
+    // Admission control: the bandwidth of all deadline threads must fit in
+    // THREAD_DL_BW_MAX percent of the CPU. Under that condition, EDF meets all
+    // deadlines of periodic tasks whose deadline equals their period.
+
+    old_bw = (thr->dl_runtime != 0) ? dl_bw(thr) : 0;
+
+    if (DL_BW_ONE * THREAD_DL_BW_MAX / 100 < dl_total_bw - old_bw + new_bw) {
+        intr_restore(saved_intr_state);
+        return -EBUSY;
+    }
+
+    dl_total_bw = dl_total_bw - old_bw + new_bw;
+
+    // Charge the time we ran so far to the old budget, if any
+
+    account_state(thr, thr->state);
+
+    if (thr->dl_runtime == 0) {
+        alarm_init(&thr->dl_timer, "deadline");
+        thr->dl_timer.func = dl_timer_expired;
+    } else
+        alarm_cancel(&thr->dl_timer);
+    
+    thr->dl_runtime = runtime;
+    thr->dl_deadline = deadline;
+    thr->dl_period = period;
+    thr->dl_throttled = 0;
+
+    // The first job is released now
+
+    if (runtime != 0) {
+        now = csrr_time();
+        thr->dl_abs = now + deadline;
+        thr->dl_budget = runtime;
+        dl_arm(thr, now + runtime);
+    }
+
+    intr_restore(saved_intr_state);
+
+    // Leaving the deadline class may let another thread preempt us
+
+    thread_yield_if_preempted();
+    return 0;
+}
+
+void thread_deadline_yield(void) {
+    int saved_intr_state;
+
+    trace("%s() in %s", __func__, CURTHR->name);
+
+    // With no budget left, we are throttled when we leave the CPU and come
+    // back at our next period. Other threads just yield.
+
+    saved_intr_state = intr_disable();
+    CURTHR->dl_budget = 0;
+    intr_restore(saved_intr_state);
+
+    thread_yield();
+}
+
+int cpu_quota_set(struct process * proc, uint64_t quota, uint64_t period) {
+    struct cpu_quota * const old = proc->cpuq;
+    struct thread_list parked;
+    struct cpu_quota * q;
+    struct thread * thr;
+    int saved_intr_state;
+
+    trace("%s(pid=%d,quota=%lu,period=%lu)", __func__, proc->id, quota, period);
+
+    if (quota != 0 && (period < CPU_QUOTA_PERIOD_MIN || period < quota))
+        return -EINVAL;
+    
+    // If the process is alone in its group, change the group in place. The
+    // new quota applies from the next period on.
+
+    if (old != NULL && old->refcnt == 1 && quota != 0) {
+        saved_intr_state = intr_disable();
+        old->quota = quota;
+        old->period = period;
+        intr_restore(saved_intr_state);
+        return 0;
+    }
+
+    // Otherwise the process leaves its group and, unless the quota is 0,
+    // starts a new one.
+
+    q = NULL;
+
+    if (quota != 0) {
+        q = kmalloc(sizeof(struct cpu_quota));
+        memset(q, 0, sizeof(struct cpu_quota));
+        q->quota = quota;
+        q->period = period;
+        q->refcnt = 1;
+        alarm_init(&q->period_timer, "cpu_quota");
+        q->period_timer.func = cpu_quota_refill;
+    }
+
+    saved_intr_state = intr_disable();
+
+    proc->cpuq = q;
+
+    if (q != NULL)
+        alarm_arm(&q->period_timer, period);
+
+    // Threads of the process parked in the old group move with it
+
+    if (old != NULL) {
+        parked = old->parked;
+        tlclear(&old->parked);
+
+        while ((thr = tlremove(&parked)) != NULL) {
+            if (thr->proc == proc)
+                ready_insert(thr);
+            else
+                tlinsert(&old->parked, thr);
+        }
+
+        cpu_quota_put(old);
+    }
+
+    intr_restore(saved_intr_state);
+    return 0;
+}
+
+void cpu_quota_release(struct process * proc) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    if (proc->cpuq != NULL) {
+        cpu_quota_put(proc->cpuq);
+        proc->cpuq = NULL;
+    }
+
+    intr_restore(saved_intr_state);
+}
+
+int thread_oncpu(int tid) {
+    struct thread * const thr = thread_lookup(tid);
+
+    // Only one thread runs on each hart, and this kernel runs on a single
+    // hart, so the only RUNNING thread is the caller. Checking the state
+    // rather than returning 0 keeps callers correct if that ever changes.
+
+    return (thr != NULL && thr != CURTHR && thr->state == THREAD_RUNNING);
+}
+
+void thread_lock_acquired(struct lock * lk) {
+    lk->next_held = CURTHR->held_locks;
+    CURTHR->held_locks = lk;
+}
+
+void thread_lock_wait(struct lock * lk) {
+    struct thread * owner;
+    struct lock * blk;
+
+    // Lend our priority to the lock holder. If the holder is itself waiting
+    // for a lock, pass it on down the chain. The loop stops at a thread that
+    // already has at least our priority, which also ends it on a deadlock
+    // cycle.
+
+    CURTHR->blocked_on = lk;
+
+    for (blk = lk; blk != NULL; blk = owner->blocked_on) {
+        owner = thread_lookup(blk->tid);
+
+        if (owner == NULL || owner->prio >= lend_prio(CURTHR))
+            break;
+        
+        debug("Thread <%s> lends priority %d to <%s> for lock <%s>",
+            CURTHR->name, lend_prio(CURTHR), owner->name, blk->cond.name);
+        set_effective_prio(owner, lend_prio(CURTHR));
+    }
+
+    condition_wait(&lk->cond);
+    CURTHR->blocked_on = NULL;
+}
+
+int thread_lock_handoff(struct lock * lk) {
+    struct lock ** pp;
+    struct thread * next;
+    struct thread * thr;
+
+    // Take the lock off our list of held locks
+
+    for (pp = &CURTHR->held_locks; *pp != lk; pp = &(*pp)->next_held)
+        assert (*pp != NULL);
+    *pp = lk->next_held;
+    lk->next_held = NULL;
+
+    // Hand the lock to the highest priority waiter. Among waiters of equal
+    // priority, the one that has been waiting longest wins.
+
+    next = NULL;
+
+    for (thr = lk->cond.wait_list.head; thr != NULL; thr = thr->list_next) {
+        if (next == NULL || lend_prio(thr) > lend_prio(next))
+            next = thr;
+    }
+
+    if (next != NULL) {
+        tlunlink(&lk->cond.wait_list, next);
+        assert (next->state == THREAD_WAITING);
+        set_thread_state(next, THREAD_READY);
+        next->wait_cond = NULL;
+
+        lk->next_held = next->held_locks;
+        next->held_locks = lk;
+        update_prio(next);
+        ready_insert(next);
+    }
+
+    // Give up any priority we inherited through this lock
+
+    update_prio(CURTHR);
+
+    return (next != NULL) ? next->id : -1;
+}
+
+int thread_fpu_trap(void) {
+    // If FP access was enabled, the instruction is illegal for another reason
+
+    if ((csrr_sstatus() & RISCV_SSTATUS_FS) != RISCV_SSTATUS_FS_OFF)
+        return 0;
+    
+    // The previous owner's state was saved when it was switched out, if it
+    // had changed, so we can simply load ours. FP access must be on for the
+    // restore.
+
+    csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+
+    if (fpu_owner != CURTHR) {
+        debug("Thread <%s> takes FPU from <%s>", CURTHR->name,
+            (fpu_owner != NULL) ? fpu_owner->name : "none");
+        _fpu_restore(&CURTHR->fpstate);
+        fpu_owner = CURTHR;
+    }
+
+    // The restore left FS Dirty, but the registers match fpstate, so mark
+    // them Clean. Otherwise the next switch would save them for nothing.
+
+    csrc_sstatus(RISCV_SSTATUS_FS);
+    csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+
+    return 1;
+}
+
+int thread_get_stats(int tid, struct thread_stats * st) {
+    struct thread * const thr = thread_lookup(tid);
+    int saved_intr_state;
+
+    if (thr == NULL)
+        return -EINVAL;
+    
+    // Bring the counters up to date by charging the time spent in the
+    // current state so far.
+
+    saved_intr_state = intr_disable();
+    account_state(thr, thr->state);
+    *st = thr->stats;
+    intr_restore(saved_intr_state);
+
+    return 0;
+}
+
+void ps_attach(void) {
+    device_register("ps", ps_open, NULL);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void init_main_thread(void) {
+    extern char _main_stack_anchor[]; // from thrasm.s
+    extern char _main_stack_lowest[]; // from thrasm.s
+
+    main_thread.stack_base = _main_stack_anchor;
+    main_thread.stack_size = _main_stack_anchor - _main_stack_lowest;
+}
+
+void init_idle_thread(void) {
+    extern char _idle_stack_anchor[]; // from thrasm.s
+    extern char _idle_stack_lowest[]; // from thrasm.s
+
+    extern void _thread_setup (
+        struct thread * thr, void * sp, void (*start)(void), ...);
 
     idle_thread.stack_base = _idle_stack_anchor;
     idle_thread.stack_size = _idle_stack_anchor - _idle_stack_lowest;
     _thread_setup(&idle_thread, _idle_stack_anchor, (void (*)(void))idle_thread_func);
-    tlinsert(&ready_list, &idle_thread); // interrupts still disabled
+    ready_insert(&idle_thread); // interrupts still disabled
 
 }
 
@@ -454,25 +1258,273 @@ const char * thread_state_name(enum thread_state state) {
         return "UNDEFINED";
 };
 
+struct thread * thread_lookup(int tid) {
+    if (tid < 0 || NTHR <= tid || thrtab[tid / THRTAB_CHUNK] == NULL)
+        return NULL;
+    else
+        return thrtab[tid / THRTAB_CHUNK][tid % THRTAB_CHUNK];
+}
+
+int thread_spawn_proc (const char * name,
+    void (*start)(void), void * arg, struct process * proc)
+{
+    struct thread * child;
+    int saved_intr_state;
+
+    child = thread_alloc(name);
+
+    if (child == NULL)
+        return -ENOMEM;
+    
+    // The thread must not run as part of the wrong process even briefly, so
+    // this happens before it is runnable.
+
+    set_thread_process(child, proc);
+    _thread_setup(child, child->stack_base, start, arg);
+    set_thread_state(child, THREAD_READY);
+
+    saved_intr_state = intr_disable();
+    ready_insert(child);
+    intr_restore(saved_intr_state);
+    
+    return child->id;
+}
+
+struct thread * thread_alloc(const char * name) {
+    struct thread_stack_anchor * stack_anchor;
+    struct thread ** chunk;
+    void * stack_page;
+    struct thread * thr;
+    int tid;
+
+    // The thread id map, free list and table are not touched by ISRs, so
+    // keeping other threads out is enough.
+
+    preempt_disable();
+
+    tid = idmap_alloc(&thrids);
+    thr = (tid < 0) ? NULL : thread_free_list;
+    if (thr != NULL)
+        thread_free_list = thr->list_next;
+    
+    // Allocate the thrtab chunk for this id if this is its first use
+
+    chunk = (tid < 0) ? NULL : thrtab[tid / THRTAB_CHUNK];
+
+    if (0 <= tid && chunk == NULL) {
+        chunk = memory_alloc_page();
+        memset(chunk, 0, PAGE_SIZE);
+        thrtab[tid / THRTAB_CHUNK] = chunk;
+    }
+
+    preempt_enable();
+
+    if (tid < 0)
+        return NULL;
+
+    // Allocate a struct thread and a stack
+
+    if (thr == NULL)
+        thr = kmalloc(sizeof(struct thread));
+    
+    memset(thr, 0, sizeof(struct thread));
+
+    stack_page = memory_alloc_page();
+    stack_anchor = stack_page + PAGE_SIZE;
+    stack_anchor -= 1;
+    stack_anchor->thread = thr;
+    stack_anchor->reserved = 0;
+
+    thr->id = tid;
+    thr->name = name;
+    set_thread_process(thr, CURTHR->proc);
+    thr->base_prio = CURTHR->base_prio;
+    thr->prio = thr->base_prio;
+    thr->t_state = csrr_time();
+    thr->stack_base = stack_anchor;
+    thr->stack_size = thr->stack_base - stack_page;
+    condition_init(&thr->child_exit, "child_exit");
+
+    preempt_disable();
+    chunk[tid % THRTAB_CHUNK] = thr;
+    add_child(CURTHR, thr);
+    preempt_enable();
+
+    return thr;
+}
+
 void recycle_thread(int tid) {
-    struct thread * const thr = thrtab[tid];
-    int ctid;
+    struct thread * const thr = thread_lookup(tid);
+    struct thread * parent;
+    struct thread * child;
 
-    assert (0 < tid && tid < NTHR && thr != NULL);
+    assert (0 < tid && thr != NULL);
     assert (thr->state == THREAD_EXITED);
 
-    // Make our parent the parent of our children
+    parent = thr->parent;
+
+    preempt_disable();
+
+    remove_child(thr);
+
+    // Make our parent the parent of our children. Children that have exited
+    // but were not joined move to our parent's zombie list.
 
-    for (ctid = 1; ctid < NTHR; ctid++) {
-        if (thrtab[ctid] != NULL && thrtab[ctid]->parent == thr)
-            thrtab[ctid]->parent = thr->parent;
+    while (thr->child_head != NULL) {
+        child = thr->child_head;
+        remove_child(child);
+        add_child(parent, child);
     }
 
-    thrtab[tid] = NULL;
-    kfree(thr);
+    if (!tlempty(&thr->zombies)) {
+        while ((child = tlremove(&thr->zombies)) != NULL)
+            tlinsert(&parent->zombies, child);
+        condition_broadcast(&parent->child_exit);
+    }
+
+    thrtab[tid / THRTAB_CHUNK][tid % THRTAB_CHUNK] = NULL;
+    idmap_free(&thrids, tid);
+
+    thr->list_next = thread_free_list;
+    thread_free_list = thr;
+
+    preempt_enable();
+}
+
+void add_child(struct thread * parent, struct thread * child) {
+    child->parent = parent;
+    child->sibling_prev = NULL;
+    child->sibling_next = parent->child_head;
+
+    if (parent->child_head != NULL)
+        parent->child_head->sibling_prev = child;
+    
+    parent->child_head = child;
 }
 
-void suspend_self(void) {
+void remove_child(struct thread * child) {
+    if (child->sibling_prev != NULL)
+        child->sibling_prev->sibling_next = child->sibling_next;
+    else
+        child->parent->child_head = child->sibling_next;
+    
+    if (child->sibling_next != NULL)
+        child->sibling_next->sibling_prev = child->sibling_prev;
+    
+    child->sibling_next = NULL;
+    child->sibling_prev = NULL;
+}
+
+void set_thread_process(struct thread * thr, struct process * proc) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    if (thr->proc != NULL) {
+        if (thr->proc_prev != NULL)
+            thr->proc_prev->proc_next = thr->proc_next;
+        else
+            thr->proc->threads = thr->proc_next;
+        
+        if (thr->proc_next != NULL)
+            thr->proc_next->proc_prev = thr->proc_prev;
+    }
+
+    thr->proc = proc;
+    thr->proc_prev = NULL;
+    thr->proc_next = NULL;
+
+    if (proc != NULL) {
+        thr->proc_next = proc->threads;
+        if (proc->threads != NULL)
+            proc->threads->proc_prev = thr;
+        proc->threads = thr;
+    }
+
+    intr_restore(saved_intr_state);
+}
+
+int condition_wait_flags(struct condition * cond, int flags) {
+    int saved_intr_state;
+    int result;
+
+    trace("%s(cond=<%s>) in %s", __func__, cond->name, CURTHR->name);
+
+    assert(CURTHR->state == THREAD_RUNNING);
+
+    saved_intr_state = intr_disable();
+
+    // An interrupted thread does not start another interruptible wait
+
+    if ((flags & WAIT_INTR) && CURTHR->interrupted) {
+        intr_restore(saved_intr_state);
+        return -EINTR;
+    }
+
+    // Insert current thread into condition wait list. Interrupts stay
+    // disabled until suspend_self has picked the next thread, then it enables
+    // them just before the switch. An interrupt in that window does not
+    // preempt us, since preempt_intr_return leaves threads that are not
+    // RUNNING alone, and a wake-up only makes us READY again.
+
+    CURTHR->stats.nvcsw += 1;
+    set_thread_state(CURTHR, THREAD_WAITING);
+    CURTHR->wait_cond = cond;
+    CURTHR->wait_exclusive = ((flags & WAIT_EXCLUSIVE) != 0);
+    CURTHR->wait_intr = ((flags & WAIT_INTR) != 0);
+    CURTHR->list_next = NULL;
+    tlinsert(&cond->wait_list, CURTHR);
+
+    suspend_self();
+
+    // If we were interrupted and signalled at the same time, report the
+    // interrupt; the caller is about to give up anyway.
+
+    if ((flags & WAIT_INTR) && CURTHR->interrupted)
+        result = -EINTR;
+    else
+        result = 0;
+
+    CURTHR->wait_intr = 0;
+    intr_restore(saved_intr_state);
+    return result;
+}
+
+int condition_wait_timeout_flags (
+    struct condition * cond, uint64_t tcnt, int flags)
+{
+    struct wait_timeout wto;
+    int saved_intr_state;
+    int result;
+
+    trace("%s(cond=<%s>,tcnt=%lu) in %s",
+        __func__, cond->name, tcnt, CURTHR->name);
+
+    wto.thr = CURTHR;
+    wto.cond = cond;
+    wto.timed_out = 0;
+
+    alarm_init(&wto.alarm, cond->name);
+    wto.alarm.func = wait_timeout_expired;
+
+    // The alarm must not expire before we are on the wait list, so both happen
+    // with interrupts disabled. When we return, the alarm may still be armed
+    // (if the condition was signalled), so we cancel it before it goes out of
+    // scope.
+
+    saved_intr_state = intr_disable();
+    alarm_arm(&wto.alarm, tcnt);
+    result = condition_wait_flags(cond, flags);
+    alarm_cancel(&wto.alarm);
+    intr_restore(saved_intr_state);
+
+    if (result == 0 && wto.timed_out)
+        result = -ETIMEDOUT;
+    
+    return result;
+}
+
+int suspend_self(void) {
     struct thread * susp_thread; // suspending thread
     struct thread * next_thread; // resuming thread
     struct thread * prev_thread; // previously thread
@@ -480,29 +1532,37 @@ void suspend_self(void) {
 
     trace("%s() in %s", __func__, CURTHR->name);
 
-    // The idle thread is always runnable, and the idle thread only calls
-    // suspend_self() if the ready_list is not empty.
-
-    assert (!tlempty(&ready_list));
-
     susp_thread = CURTHR;
 
-    // Get a READY thread from the ready list and mark it running
-
     saved_intr_state = intr_disable();
 
-    next_thread = tlremove(&ready_list);
-    assert(next_thread->state == THREAD_READY);
-    set_thread_state(next_thread, THREAD_RUNNING);
-    
     // If the current thread is still running, mark it ready-to-run and put it
-    // in the back of the ready-to-run list.
+    // in the back of the ready-to-run list for its priority. This comes first
+    // so that it keeps the CPU if no thread of the same or higher rank is
+    // ready.
 
     if (susp_thread->state == THREAD_RUNNING) {
         set_thread_state(susp_thread, THREAD_READY);
-        tlinsert(&ready_list, susp_thread);
+        ready_insert(susp_thread);
     }
 
+    // Get the highest ranked READY thread and mark it running. The idle
+    // thread is always runnable, and the idle thread only calls suspend_self()
+    // if some other thread is ready.
+
+    next_thread = ready_remove();
+    assert(next_thread != NULL);
+    assert(next_thread->state == THREAD_READY);
+    set_thread_state(next_thread, THREAD_RUNNING);
+    need_resched = 0;
+
+    if (next_thread == susp_thread) {
+        intr_restore(saved_intr_state);
+        return 0;
+    }
+
+    fpu_switch(susp_thread, next_thread);
+
     intr_enable();
 
     if (next_thread->proc != NULL)
@@ -522,6 +1582,368 @@ void suspend_self(void) {
     }
 
     intr_restore(saved_intr_state);
+    return 1;
+}
+
+void ready_insert(struct thread * thr) {
+    struct thread_list * const list = &ready_list[DL_RANK];
+    struct thread * prev;
+    struct thread * next;
+
+    if (thread_parked(thr)) {
+        tlinsert(&thread_cpuq(thr)->parked, thr);
+        return;
+    }
+
+    if (thr->dl_runtime == 0) {
+        tlinsert(&ready_list[thr->prio], thr);
+        ready_mask |= UINT64_C(1) << thr->prio;
+        if (thrmgr_initialized && thread_outranks(thr, CURTHR))
+            need_resched = 1;
+        return;
+    }
+
+    if (thr->dl_throttled)
+        return;
+    
+    if (thrmgr_initialized && thread_outranks(thr, CURTHR))
+        need_resched = 1;
+    
+    // Keep the deadline list sorted by deadline. Threads with equal deadlines
+    // run in the order they became ready.
+
+    prev = NULL;
+    next = list->head;
+
+    while (next != NULL && next->dl_abs <= thr->dl_abs) {
+        prev = next;
+        next = next->list_next;
+    }
+
+    thr->list_next = next;
+
+    if (prev != NULL)
+        prev->list_next = thr;
+    else
+        list->head = thr;
+    
+    if (next == NULL)
+        list->tail = thr;
+    
+    ready_mask |= UINT64_C(1) << DL_RANK;
+}
+
+struct thread * ready_remove(void) {
+    struct thread * thr;
+    int prio;
+
+    // Threads that were already on a ready list when their group was
+    // throttled are parked as we come across them.
+
+    for (;;) {
+        prio = ready_max_prio();
+
+        if (prio < 0)
+            return NULL;
+        
+        thr = tlremove(&ready_list[prio]);
+
+        if (tlempty(&ready_list[prio]))
+            ready_mask &= ~(UINT64_C(1) << prio);
+        
+        if (!thread_parked(thr))
+            return thr;
+        
+        tlinsert(&thread_cpuq(thr)->parked, thr);
+    }
+}
+
+void ready_unlink(struct thread * thr) {
+    const int rank = thread_rank(thr);
+
+    if (tlunlink(&ready_list[rank], thr)) {
+        if (tlempty(&ready_list[rank]))
+            ready_mask &= ~(UINT64_C(1) << rank);
+    } else if (thread_cpuq(thr) != NULL)
+        tlunlink(&thread_cpuq(thr)->parked, thr);
+}
+
+int ready_max_prio(void) {
+    if (ready_mask == 0)
+        return -1;
+    else
+        return 63 - __builtin_clzl(ready_mask);
+}
+
+void set_effective_prio(struct thread * thr, int prio) {
+    if (thr->prio == prio)
+        return;
+    
+    if (thr->state == THREAD_READY) {
+        ready_unlink(thr);
+        thr->prio = prio;
+        ready_insert(thr);
+    } else
+        thr->prio = prio;
+}
+
+void update_prio(struct thread * thr) {
+    const struct thread * waiter;
+    const struct lock * lk;
+    int prio;
+
+    prio = thr->base_prio;
+
+    for (lk = thr->held_locks; lk != NULL; lk = lk->next_held) {
+        waiter = lk->cond.wait_list.head;
+        while (waiter != NULL) {
+            if (lend_prio(waiter) > prio)
+                prio = lend_prio(waiter);
+            waiter = waiter->list_next;
+        }
+    }
+
+    set_effective_prio(thr, prio);
+}
+
+void fpu_switch(struct thread * susp_thread, struct thread * next_thread) {
+    const uint64_t fs = csrr_sstatus() & RISCV_SSTATUS_FS;
+
+    if (fs == RISCV_SSTATUS_FS_DIRTY) {
+        assert (fpu_owner == susp_thread);
+        _fpu_save(&susp_thread->fpstate);
+    }
+
+    csrc_sstatus(RISCV_SSTATUS_FS);
+
+    if (fpu_owner == next_thread)
+        csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+}
+
+void account_state(struct thread * thr, enum thread_state next) {
+    const uint64_t now = csrr_time();
+    const uint64_t dt = now - thr->t_state;
+    int saved_intr_state;
+    int i;
+
+    thr->t_state = now;
+
+    switch (thr->state) {
+    case THREAD_RUNNING:
+        thr->stats.run_time += dt;
+        break;
+    case THREAD_READY:
+        thr->stats.ready_time += dt;
+        break;
+    case THREAD_WAITING:
+        thr->stats.blocked_time += dt;
+        break;
+    default:
+        break;
+    }
+
+    if (thr->state == THREAD_READY && next == THREAD_RUNNING) {
+        if (thr->stats.rqdelay_max < dt)
+            thr->stats.rqdelay_max = dt;
+        
+        i = (dt == 0) ? 0 : 64 - __builtin_clzl(dt);
+        if (RQDELAY_BUCKETS <= i)
+            i = RQDELAY_BUCKETS-1;
+        
+        saved_intr_state = intr_disable();
+        rqdelay_hist[i] += 1;
+        intr_restore(saved_intr_state);
+    }
+
+    if (thr->dl_runtime != 0) {
+        saved_intr_state = intr_disable();
+        dl_account(thr, next, now, dt);
+        intr_restore(saved_intr_state);
+    }
+
+    if (thread_cpuq(thr) != NULL) {
+        saved_intr_state = intr_disable();
+        cpu_quota_account(thr, next, now, dt);
+        intr_restore(saved_intr_state);
+    }
+}
+
+void dl_account(struct thread * thr, enum thread_state next,
+    uint64_t now, uint64_t dt)
+{
+    uint64_t release;
+
+    if (thr->state == THREAD_RUNNING) {
+        thr->dl_budget -= (dt < thr->dl_budget) ? dt : thr->dl_budget;
+
+        if (next == THREAD_RUNNING)
+            return;
+        
+        // Leaving the CPU. With budget left, stop enforcing it. Without, wait
+        // for the next period, unless it has already begun.
+
+        release = thr->dl_abs - thr->dl_deadline + thr->dl_period;
+
+        if (thr->dl_budget != 0 || next == THREAD_EXITED)
+            alarm_cancel(&thr->dl_timer);
+        else if (release <= now)
+            dl_replenish(thr, now);
+        else {
+            debug("Deadline thread <%s> throttled until %lu",
+                thr->name, release);
+            thr->dl_throttled = 1;
+            dl_arm(thr, release);
+        }
+    } else if (next == THREAD_RUNNING)
+        dl_arm(thr, now + thr->dl_budget);
+    else if (thr->state == THREAD_WAITING && next == THREAD_READY &&
+        !thr->dl_throttled)
+    {
+        // If the rest of the budget cannot be used up by the deadline without
+        // exceeding the thread's bandwidth, start a new job now. Otherwise a
+        // thread that sleeps could save up budget and overrun its share.
+
+        if (thr->dl_abs <= now || thr->dl_runtime * (thr->dl_abs - now) <
+            thr->dl_budget * thr->dl_period)
+        {
+            thr->dl_abs = now + thr->dl_deadline;
+            thr->dl_budget = thr->dl_runtime;
+        }
+    }
+}
+
+void dl_replenish(struct thread * thr, uint64_t now) {
+    uint64_t release;
+
+    release = thr->dl_abs - thr->dl_deadline + thr->dl_period;
+
+    if (release < now)
+        release = now;
+    
+    thr->dl_abs = release + thr->dl_deadline;
+    thr->dl_budget = thr->dl_runtime;
+    thr->dl_throttled = 0;
+}
+
+void cpu_quota_account(struct thread * thr, enum thread_state next,
+    uint64_t now, uint64_t dt)
+{
+    struct cpu_quota * const q = thread_cpuq(thr);
+
+    if (thr->state == THREAD_RUNNING) {
+        q->used += dt;
+
+        if (next == THREAD_RUNNING)
+            return;
+        
+        alarm_cancel(&quota_timer);
+
+        if (q->quota <= q->used && !q->throttled) {
+            debug("CPU quota of process %d used up", thr->proc->id);
+            q->throttled = 1;
+        }
+    } else if (next == THREAD_RUNNING && q->used < q->quota) {
+        alarm_reset(&quota_timer);
+        alarm_arm(&quota_timer, q->quota - q->used);
+    }
+}
+
+void cpu_quota_put(struct cpu_quota * q) {
+    q->refcnt -= 1;
+
+    if (q->refcnt == 0) {
+        assert (tlempty(&q->parked));
+        alarm_cancel(&q->period_timer);
+        kfree(q);
+    }
+}
+
+void dl_arm(struct thread * thr, uint64_t t) {
+    alarm_reset(&thr->dl_timer);
+
+    if (thr->dl_timer.twake < t)
+        alarm_arm(&thr->dl_timer, t - thr->dl_timer.twake);
+    else
+        alarm_arm(&thr->dl_timer, 0);
+}
+
+int ps_open(struct io_intf ** ioptr, void * aux) {
+    struct ps_entry batch[PS_BATCH];
+    uint64_t hist[RQDELAY_BUCKETS];
+    struct ps_entry * ent;
+    struct thread * thr;
+    int saved_intr_state;
+    size_t bufsz;
+    char * buf;
+    size_t n;
+    int cnt;
+    int tid;
+    int i;
+
+    buf = iosnap_alloc(&bufsz);
+
+    // Times are in microseconds
+
+    n = snprintf(buf, bufsz,
+        "tid name state prio run ready blocked rqdelay_max vcsw ivcsw\n");
+
+    tid = 0;
+
+    while (tid < NTHR && n < bufsz) {
+        cnt = 0;
+        saved_intr_state = intr_disable();
+
+        for (; tid < NTHR && cnt < PS_BATCH; tid++) {
+            if (thrtab[tid / THRTAB_CHUNK] == NULL) {
+                tid += THRTAB_CHUNK - 1 - tid % THRTAB_CHUNK;
+                continue;
+            }
+
+            thr = thrtab[tid / THRTAB_CHUNK][tid % THRTAB_CHUNK];
+
+            if (thr == NULL)
+                continue;
+            
+            account_state(thr, thr->state);
+
+            ent = &batch[cnt++];
+            ent->tid = tid;
+            strncpy(ent->name, thr->name ? thr->name : "?", PS_NAMELEN-1);
+            ent->name[PS_NAMELEN-1] = '\0';
+            ent->state = thr->state;
+            ent->prio = thr->prio;
+            ent->stats = thr->stats;
+        }
+
+        intr_restore(saved_intr_state);
+
+        for (i = 0; i < cnt && n < bufsz; i++) {
+            ent = &batch[i];
+            n += snprintf(buf + n, bufsz - n,
+                "%d %s %s %d %lu %lu %lu %lu %lu %lu\n",
+                ent->tid, ent->name, thread_state_name(ent->state), ent->prio,
+                ent->stats.run_time / (TIMER_FREQ / 1000000),
+                ent->stats.ready_time / (TIMER_FREQ / 1000000),
+                ent->stats.blocked_time / (TIMER_FREQ / 1000000),
+                ent->stats.rqdelay_max / (TIMER_FREQ / 1000000),
+                ent->stats.nvcsw, ent->stats.nivcsw);
+        }
+    }
+
+    // Run-queue delay histogram, one line per bucket: upper bound of the
+    // bucket in timer ticks and count
+
+    saved_intr_state = intr_disable();
+    memcpy(hist, rqdelay_hist, sizeof(hist));
+    intr_restore(saved_intr_state);
+
+    for (i = 0; i < RQDELAY_BUCKETS && n < bufsz; i++) {
+        n += snprintf(buf + n, bufsz - n, "rqdelay <%lu %lu\n",
+            1UL << i, hist[i]);
+    }
+
+    *ioptr = iosnap_init(buf, n);
+    return 0;
 }
 
 void tlclear(struct thread_list * list) {
@@ -569,37 +1991,113 @@ struct thread * tlremove(struct thread_list * list) {
     return thr;
 }
 
-// Appends elements of l1 to the end of l0 and clears l1.
-
-void tlappend(struct thread_list * l0, struct thread_list * l1) {
-    if (l0->head != NULL) {
-        assert(l0->tail != NULL);
-        
-        if (l1->head != NULL) {
-            assert(l1->tail != NULL);
-            l0->tail->list_next = l1->head;
-            l0->tail = l1->tail;
+// Removes /thr/ from /list/. Returns 1 if it was found and 0 otherwise. This
+// walks the list, so it is only used on the timeout, lock hand-off and
+// priority change paths, where lists are short.
+
+int tlunlink(struct thread_list * list, struct thread * thr) {
+    struct thread * prev;
+    struct thread * cur;
+
+    prev = NULL;
+
+    for (cur = list->head; cur != NULL; cur = cur->list_next) {
+        if (cur == thr) {
+            if (prev != NULL)
+                prev->list_next = thr->list_next;
+            else
+                list->head = thr->list_next;
+            
+            if (list->tail == thr)
+                list->tail = prev;
+            
+            thr->list_next = NULL;
+            return 1;
         }
-    } else {
-        assert(l0->tail == NULL);
-        l0->head = l1->head;
-        l0->tail = l1->tail;
+
+        prev = cur;
+    }
+
+    return 0;
+}
+
+void wait_timeout_expired(struct alarm * al) {
+    struct wait_timeout * const wto =
+        (void*)al - offsetof(struct wait_timeout, alarm);
+    struct thread * const thr = wto->thr;
+
+    // If the condition was signalled in the meantime, there is nothing to do
+
+    if (thr->state != THREAD_WAITING || thr->wait_cond != wto->cond)
+        return;
+    
+    debug("Wait on <%s> timed out in %s", wto->cond->name, thr->name);
+
+    if (tlunlink(&wto->cond->wait_list, thr)) {
+        thr->wait_cond = NULL;
+        wto->timed_out = 1;
+        set_thread_state(thr, THREAD_READY);
+        ready_insert(thr);
     }
+}
+
+void dl_timer_expired(struct alarm * al) {
+    struct thread * const thr =
+        (void*)al - offsetof(struct thread, dl_timer);
+    
+    // If the thread is running, its budget has run out. Returning from the
+    // timer interrupt preempts it, and it is throttled as it leaves the CPU.
+
+    if (!thr->dl_throttled) {
+        if (thr->state == THREAD_RUNNING)
+            need_resched = 1;
+        return;
+    }
+    
+    debug("Deadline thread <%s> replenished", thr->name);
+    dl_replenish(thr, csrr_time());
+
+    if (thr->state == THREAD_READY)
+        ready_insert(thr);
+}
+
+void cpu_quota_refill(struct alarm * al) {
+    struct cpu_quota * const q =
+        (void*)al - offsetof(struct cpu_quota, period_timer);
+    struct thread * thr;
+
+    // Time the group ran over its quota, e.g. in a system call, which is not
+    // preempted, counts against the next period.
+
+    q->used = (q->quota < q->used) ? q->used - q->quota : 0;
+
+    if (q->throttled && q->used < q->quota) {
+        q->throttled = 0;
+        while ((thr = tlremove(&q->parked)) != NULL)
+            ready_insert(thr);
+    }
+
+    alarm_arm(al, q->period);
+}
+
+void quota_timer_expired(struct alarm * al __attribute__ ((unused))) {
+    // The running thread's group has used up its quota. Returning from the
+    // timer interrupt preempts the thread, and the group is throttled as it
+    // leaves the CPU.
 
-    l1->head = NULL;
-    l1->tail = NULL;
+    need_resched = 1;
 }
 
 void idle_thread_func(void * arg __attribute__ ((unused))) {
     // The idle thread sleeps using wfi if the ready list is empty. Note that we
     // need to disable interrupts before checking if the thread list is empty to
     // avoid a race condition where an ISR marks a thread ready to run between
-    // the call to tlempty() and the wfi instruction.
+    // the check of ready_mask and the wfi instruction.
 
     for (;;) {
         // If there are runnable threads, yield to them.
 
-        while (!tlempty(&ready_list))
+        while (ready_mask != 0)
             thread_yield();
         
         // No runnable threads. Sleep using the wfi instruction. Note that we
@@ -608,7 +2106,7 @@ void idle_thread_func(void * arg __attribute__ ((unused))) {
         // ISR marks a thread ready before we call the wfi instruction.
 
         intr_disable();
-        if (tlempty(&ready_list))
+        if (ready_mask == 0)
             asm ("wfi");
         intr_enable();
     }
@@ -617,73 +2115,83 @@ void idle_thread_func(void * arg __attribute__ ((unused))) {
 /*
 Inputs: child_proc (struct process), *parent_tfr (64-bit)
 Outputs: return code
-Purpose: allocate new memory for the child process and sets up another thread struct, also initialize a stack anchor to reclaim the thread pointer when comding back from u mode interrupt
+Purpose: allocates a new thread for the child process with a copy of the parent's memory space. The child starts in U mode with a
+copy of the parent trap frame, returning 0 from the fork system call.
 */
 int thread_fork_to_user (struct process * child_proc, const struct trap_frame * parent_tfr) {
     
-    // CREATE A THREAD - copied from thread spawn
+    // CREATE A THREAD - allocated like in thread_spawn
+    struct trap_frame child_tfr;
     int saved_intr_state;
-    struct thread_stack_anchor * stack_anchor;
-    void * stack_page;
     struct thread * child;
-    // int saved_intr_state;
-    int tid;
 
-    // Find a free thread slot.
-    tid = 0;                                    // loop to find a free tid in the thrtab
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
+    child = thread_alloc("forkie");
+    if (child == NULL)
+        return -ENOMEM;
     
-    if (tid == NTHR)
-        panic("Too many threads");
-    
-    // Allocate a struct thread and a stack
+    child_proc->mtag = memory_space_clone((uint_fast16_t)0);    // copy of our memory space for the child
+    child_proc->tid = child->id;
+    set_thread_process(child, child_proc);                      // link the child thread to the respective process
 
-    child = kmalloc(sizeof(struct thread));     // allocate memory for child thread
+    // The child starts with a copy of our FP state. We stay the owner of the
+    // FP registers, since we return to U mode with FP access on; the child
+    // loads its copy on its first FP instruction.
 
-    stack_page = memory_alloc_page();
-    stack_anchor = stack_page + PAGE_SIZE;
-    stack_anchor -= 1;
-    stack_anchor->thread = child;
-    stack_anchor->reserved = 0;
+    saved_intr_state = intr_disable();
 
+    if (fpu_owner == CURTHR &&
+        (csrr_sstatus() & RISCV_SSTATUS_FS) == RISCV_SSTATUS_FS_DIRTY)
+    {
+        _fpu_save(&CURTHR->fpstate);
+        csrc_sstatus(RISCV_SSTATUS_FS);
+        csrs_sstatus(RISCV_SSTATUS_FS_CLEAN);
+    }
 
-    thrtab[tid] = child;
+    child->fpstate = CURTHR->fpstate;
 
-    child->id = tid;
-    child->name = "forkie";
-    child->parent = CURTHR;                             // set child thread parent to cur thread
-    child->proc = CURTHR->proc;
-    child->stack_base = stack_anchor;
-    child->stack_size = child->stack_base - stack_page;
-    
-    // rest of the setup
-    saved_intr_state = intr_disable();                  // disable interrupts when changing thread states for parent and child
-    set_thread_state(CURTHR, THREAD_READY);
-    tlinsert(&ready_list, CURTHR);
-    set_thread_state(child, THREAD_RUNNING);
+    // The child joins our CPU bandwidth group
+
+    child_proc->cpuq = CURTHR->proc->cpuq;
+    if (child_proc->cpuq != NULL)
+        child_proc->cpuq->refcnt += 1;
 
-    uintptr_t mtag = memory_space_clone((uint_fast16_t)0);      // get the new mtag after allocating memory for child thread
     intr_restore(saved_intr_state);
 
-    child_proc->mtag = mtag;
-    child_proc->tid = child->id;
+    memcpy(&child_tfr, parent_tfr, sizeof(struct trap_frame));  // copy over parent trap frame
+    child_tfr.x[TFR_A0] = 0;                                    // fork returns 0 in the child
 
-    thread_set_process(child->id, child_proc);                  // link the child thread id to the respective process
-    
-    memory_space_switch(mtag);                                  // switch the memory to begin context switching
-    struct trap_frame* child_tfr = (void *) ((uintptr_t) child->stack_base - sizeof(struct trap_frame));
+    thread_start_user(child, &child_tfr);
+    return 0;
+}
 
-    memcpy(child_tfr, parent_tfr, sizeof(struct trap_frame));   // copy over parent trap frame
+int thread_spawn_user(const struct trap_frame * tfr) {
+    struct thread * child;
 
-    child->context.sp = (void *) child_tfr;                     // link the created child tfr to thread struct
-    child_tfr->x[TFR_TP] = (uintptr_t) child;
-    child_tfr->x[TFR_A0] = 0;
+    trace("%s(pc=%p,sp=%p) in %s", __func__,
+        (void*)tfr->sepc, (void*)tfr->x[TFR_SP], CURTHR->name);
 
-    _thread_finish_fork(child, parent_tfr);                 // call assembly function to finish context switch
+    child = thread_alloc(CURTHR->name);
 
-    console_printf("reached before tff\n");
+    if (child == NULL)
+        return -ENOMEM;
+    
+    thread_start_user(child, tfr);
+    return child->id;
+}
 
-    return 0;
-}
\ No newline at end of file
+void thread_start_user(struct thread * thr, const struct trap_frame * tfr) {
+    struct trap_frame * const ktfr =
+        (void*)thr->stack_base - sizeof(struct trap_frame);
+    int saved_intr_state;
+
+    // The trap frame goes right below the stack anchor, where a trap from U
+    // mode would have put it, and the thread starts in the trap return path.
+
+    memcpy(ktfr, tfr, sizeof(struct trap_frame));
+    _thread_setup(thr, ktfr, _trap_return_to_umode);
+    set_thread_state(thr, THREAD_READY);
+
+    saved_intr_state = intr_disable();
+    ready_insert(thr);
+    intr_restore(saved_intr_state);
+}
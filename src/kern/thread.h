@@ -8,6 +8,16 @@
 #include <stddef.h>
 
 struct thread; // forward decl.
+struct lock; // forward decl. (lock.h)
+
+// Thread priorities. Higher values are scheduled first; threads of equal
+// priority share the CPU round-robin. The idle thread alone runs at
+// THREAD_PRIO_IDLE. New threads start with their parent's priority.
+
+#define THREAD_PRIO_IDLE 0
+#define THREAD_PRIO_MIN 1
+#define THREAD_PRIO_DEFAULT 16
+#define THREAD_PRIO_MAX 31
 
 struct thread_stack_anchor {
     struct thread * thread;
@@ -25,6 +35,17 @@ struct condition {
 	struct thread_list wait_list;
 };
 
+// Scheduling statistics of a thread. Times are in timer ticks (TIMER_FREQ).
+
+struct thread_stats {
+    uint64_t run_time; // time spent running
+    uint64_t ready_time; // time spent waiting on a ready list
+    uint64_t blocked_time; // time spent waiting on a condition
+    uint64_t rqdelay_max; // longest wait on a ready list
+    unsigned long nvcsw; // voluntary context switches
+    unsigned long nivcsw; // involuntary context switches (preemptions)
+};
+
 // EXPORTED GLOBAL VARIABLES
 // 
 
@@ -50,12 +71,27 @@ int running_thread(void);
 
 extern int thread_spawn(const char * name, void (*start)(void), void * arg);
 
+// int thread_spawn_detached(const char * name, void (*start)(void), void * arg)
+// Like thread_spawn, but the new thread does not belong to the process of the
+// current thread (or any other). Use it for kernel worker threads that serve
+// all processes and may be started from a system call.
+
+extern int thread_spawn_detached (
+    const char * name, void (*start)(void), void * arg);
+
 // void thread_yield(void)
 // Yields the CPU to another thread and returns when the current thread is next
-// scheduled to run.
+// scheduled to run. Returns right away if no thread of the same or higher
+// priority is ready.
 
 extern void thread_yield(void);
 
+// void thread_preempt(void)
+// Like thread_yield, but counts as an involuntary context switch. Used when the
+// kernel takes the CPU away from a thread, e.g. on a timer interrupt.
+
+extern void thread_preempt(void);
+
 // int thread_join_any(void) int thread_join(int tid) Waits for a child thread
 // of the current thread to exit. The thread_join_any function waits for any of
 // the current thread's children to exit, while thread_join waits for a specific
@@ -83,10 +119,128 @@ extern struct process * thread_process(int tid);
 
 extern void thread_set_process(int tid, struct process * proc);
 
+// Interrupts a thread. If it is waiting in one of the interruptible
+// condition_wait functions, the wait returns -EINTR, and so do all later
+// interruptible waits of the thread. Interrupts are meant for threads that are
+// about to exit, so they cannot be undone. May be called from an ISR.
+
+extern void thread_interrupt(int tid);
+
+// Interrupts every thread of process /proc/ other than the calling thread.
+
+extern void thread_interrupt_process(struct process * proc);
+
 // Returns the name of a thread.
 
 extern const char * thread_name(int tid);
 
+// int thread_get_priority(int tid)
+// Returns the effective priority of a thread, which may be higher than the
+// priority it was given if it holds a lock a higher priority thread is waiting
+// for. Returns -EINVAL if there is no such thread.
+
+extern int thread_get_priority(int tid);
+
+// int thread_set_priority(int tid, int prio)
+// Sets the priority of a thread to /prio/, which must be between
+// THREAD_PRIO_MIN and THREAD_PRIO_MAX. Yields if this makes a higher priority
+// thread runnable ahead of the current one. Returns 0 or -EINVAL.
+
+extern int thread_set_priority(int tid, int prio);
+
+// void thread_yield_if_preempted(void)
+// Yields the CPU if a thread of higher priority than the current thread is
+// ready to run.
+
+extern void thread_yield_if_preempted(void);
+
+// void preempt_disable(void)
+// void preempt_enable(void)
+// Disable and re-enable preemption of the current thread. Calls nest. While
+// preemption is disabled, the current thread keeps the CPU until it blocks or
+// yields, but interrupts are still taken. This protects data that is shared
+// with other threads but not with ISRs, without adding to interrupt latency.
+// The last preempt_enable yields if a more urgent thread became ready in the
+// meantime.
+
+extern void preempt_disable(void);
+extern void preempt_enable(void);
+
+// void preempt_intr_return(void)
+// Called by intr_handler before returning from an interrupt taken in S mode.
+// Preempts the interrupted thread if a more urgent thread became ready and
+// preemption is enabled.
+
+extern void preempt_intr_return(void);
+
+// int thread_set_deadline(uint64_t runtime, uint64_t deadline, uint64_t period)
+// Puts the current thread in the deadline scheduling class, which ranks above
+// all priorities. Ready deadline threads run earliest deadline first. Every
+// /period/ timer ticks, the thread is given /runtime/ ticks of CPU time to be
+// used within /deadline/ ticks; once it has used them up, it does not run
+// again until its next period. A /runtime/ of 0 returns the thread to its
+// priority. Returns 0, -EINVAL if not runtime <= deadline <= period, or -EBUSY
+// if the CPU cannot accommodate the thread's runtime/period share.
+
+extern int thread_set_deadline(uint64_t runtime, uint64_t deadline,
+    uint64_t period);
+
+// int cpu_quota_set(struct process * proc, uint64_t quota, uint64_t period)
+// Limits the threads of process /proc/, and of the processes it forks from
+// now on, to /quota/ timer ticks of CPU time every /period/ ticks, together.
+// If /proc/ shares a quota with other processes, it leaves their group. A
+// /quota/ of 0 removes the limit. Returns 0 or -EINVAL.
+
+extern int cpu_quota_set(struct process * proc, uint64_t quota,
+    uint64_t period);
+
+// void cpu_quota_release(struct process * proc)
+// Takes an exiting process out of its CPU bandwidth group, if any.
+
+extern void cpu_quota_release(struct process * proc);
+
+// void thread_deadline_yield(void)
+// Ends the current job of a deadline thread, which then sleeps until its next
+// period. Other threads just yield.
+
+extern void thread_deadline_yield(void);
+
+// int thread_get_stats(int tid, struct thread_stats * st)
+// Copies the scheduling statistics of thread /tid/ to /st/. Returns 0 or
+// -EINVAL if there is no such thread.
+
+extern int thread_get_stats(int tid, struct thread_stats * st);
+
+// int thread_fpu_trap(void)
+// Called on an illegal instruction exception from U mode. If FP access was
+// off, gives the current thread the FPU, loading its saved FP state, and
+// returns 1 so the instruction can be retried. Otherwise returns 0.
+
+extern int thread_fpu_trap(void);
+
+// Registers the "ps" device. Opening it returns a snapshot of the state and
+// scheduling statistics of all threads, one line per thread, followed by a
+// histogram of run-queue delays.
+
+extern void ps_attach(void);
+
+// int thread_oncpu(int tid)
+// Returns 1 if thread /tid/ is currently executing on some other hart.
+
+extern int thread_oncpu(int tid);
+
+// Priority inheritance support for struct lock (lock.h). Must be called with
+// interrupts disabled. thread_lock_acquired records that the current thread
+// took a free lock. thread_lock_wait lends the current thread's priority to
+// the lock holder (and any thread it is waiting for in turn) and waits until
+// the lock is handed over. thread_lock_handoff gives the lock to its highest
+// priority waiter, drops any priority the current thread inherited through it
+// and returns the new holder's thread id or -1.
+
+extern void thread_lock_acquired(struct lock * lk);
+extern void thread_lock_wait(struct lock * lk);
+extern int thread_lock_handoff(struct lock * lk);
+
 // void condition_init(struct condition * cond, const char * name)
 // Initializes a condition variable. Argument /cond/ is a pointer to a struct
 // condition to initialize. Argument /name/ is the name of the thread, which may
@@ -105,17 +259,59 @@ extern void condition_init(struct condition * cond, const char * name);
 
 extern void condition_wait(struct condition * cond);
 
+// int condition_wait_timeout(struct condition * cond, uint64_t tcnt)
+// Like condition_wait, but gives up waiting after /tcnt/ timer ticks. Returns
+// 0 if the condition was signalled and -ETIMEDOUT if the wait timed out. The
+// same rules about disabling interrupts as for condition_wait apply.
+
+extern int condition_wait_timeout(struct condition * cond, uint64_t tcnt);
+
+// void condition_wait_exclusive(struct condition * cond)
+// Like condition_wait, but the thread is an exclusive waiter: a broadcast wakes
+// up at most one exclusive waiter (the one that has been waiting longest). Use
+// this when a wake-up can only be consumed by one thread, e.g. when waiting for
+// a free slot in a buffer.
+
+extern void condition_wait_exclusive(struct condition * cond);
+
+// int condition_wait_intr(struct condition * cond)
+// int condition_wait_exclusive_intr(struct condition * cond)
+// int condition_wait_timeout_intr(struct condition * cond, uint64_t tcnt)
+// Interruptible versions of the above. They return -EINTR if the thread was
+// interrupted by thread_interrupt, before or during the wait. Use them in
+// system calls that may wait indefinitely (e.g. for console input), so that
+// the thread can be stopped when its process exits.
+
+extern int condition_wait_intr(struct condition * cond);
+extern int condition_wait_exclusive_intr(struct condition * cond);
+extern int condition_wait_timeout_intr(struct condition * cond, uint64_t tcnt);
+
 // void condition_broadcast(struct condition * cond)
 
-// Wakes up all threads waiting on a condition. This function may be called from
-// an ISR. Calling condition_broadcast() does not cause a context switch from
-// the currently running thread.
+// Wakes up all non-exclusive threads waiting on a condition and the first
+// exclusive waiter, if any. This function may be called from an ISR. Calling
+// condition_broadcast() does not cause a context switch from the currently
+// running thread.
 // Waiting threads are added to the ready-to-run list in the order they were
 // added to the wait queue.
 
 extern void condition_broadcast(struct condition * cond);
 
+// int condition_signal(struct condition * cond)
+// Wakes up the thread that has been waiting on a condition the longest,
+// whether it is an exclusive waiter or not. Returns the thread id of the woken
+// thread, or -1 if no thread was waiting. May be called from an ISR.
+
+extern int condition_signal(struct condition * cond);
+
 
 extern int thread_fork_to_user (struct process * child_proc, const struct trap_frame * parent_tfr);
 
+// int thread_spawn_user(const struct trap_frame * tfr)
+// Creates a new thread in the current process that starts in U mode with the
+// register state in /tfr/ (including its pc, sp and tp). Returns the thread id
+// of the new thread or a negative value on error.
+
+extern int thread_spawn_user(const struct trap_frame * tfr);
+
 #endif // _THREAD_H_
@@ -19,7 +19,25 @@
 
 #define TICK_PERIOD (TIMER_FREQ/TICK_FREQ)
 
+// Armed alarms are kept in a hierarchical timing wheel. The wheel counts time
+// in wheel ticks of 2^TW_RES_ORDER timer ticks. Level 0 has one slot per wheel
+// tick for the next TW_SLOTCNT wheel ticks, and each slot of level k covers
+// TW_SLOTCNT^k wheel ticks. Whenever level 0 wraps around, the next slot of
+// level 1 is cascaded (re-inserted) into the lower levels, and so on up the
+// hierarchy. Alarms further out than TW_SPAN wheel ticks are parked in the
+// last slot of the top level and re-inserted when they are cascaded.
+//
+// Arming and disarming an alarm takes constant time. A per-level bitmap of
+// non-empty slots lets timer_intr_handler skip over empty slots.
+
+#ifndef TW_RES_ORDER
+#define TW_RES_ORDER 10 // 1024 timer ticks, about 100 us
+#endif
 
+#define TW_LVL_ORDER 6
+#define TW_SLOTCNT (1 << TW_LVL_ORDER) // one bit per slot in a uint64_t
+#define TW_LVLCNT 4
+#define TW_SPAN (UINT64_C(1) << (TW_LVL_ORDER*TW_LVLCNT))
 
 // EXPORTED GLOBAL VARIABLE DEFINITIONS
 // 
@@ -29,7 +47,9 @@ char timer_initialized = 0;
 // INTERNVAL GLOBAL VARIABLE DEFINITIONS
 //
 
-static struct alarm * sleep_list;
+static struct alarm * wheel[TW_LVLCNT][TW_SLOTCNT];
+static uint64_t wheel_bitmap[TW_LVLCNT]; // non-empty slots of each level
+static uint64_t wheel_now; // next wheel tick to be processed
 static uint64_t next_tick;
 
 // INTERNAL FUNCTION DECLARATIONS
@@ -37,6 +57,19 @@ static uint64_t next_tick;
 
 static void enable_mmode_timer_intr(void);
 
+// The following functions manipulate the timer wheel. They must be called with
+// interrupts disabled.
+
+static void wheel_insert(struct alarm * al);
+static void wheel_remove(struct alarm * al);
+static void wheel_cascade(void);
+static void wheel_expire(unsigned int idx);
+static void wheel_advance(uint64_t wtick);
+static uint64_t wheel_next_twake(void);
+
+static inline uint64_t twake_to_wtick(uint64_t twake);
+static inline uint64_t wtick_to_twake(uint64_t wtick);
+
 static inline uint64_t get_mtime(void);
 static inline void set_mtime(uint64_t val);
 static inline uint64_t get_mtcmp(void);
@@ -47,6 +80,8 @@ static inline void set_mtcmp(uint64_t val);
 
 void timer_init(void) {
     set_mtime(0);
+    wheel_now = 0;
+    next_tick = TICK_PERIOD;
     set_mtcmp(TICK_PERIOD);
     csrs_sie(RISCV_SIE_STIE);
     enable_mmode_timer_intr();
@@ -57,15 +92,40 @@ void timer_init(void) {
 void alarm_init(struct alarm * al, const char * name) {
     condition_init(&al->cond, name ? name : "alarm");
     al->twake = get_mtime();
+    al->func = NULL;
     al->next = NULL;
+    al->pprev = NULL;
 }
 
 void alarm_sleep(struct alarm * al, uint64_t tcnt) {
-    struct alarm * prev;
     int saved_intr_state;
     uint64_t now;
 
     now = get_mtime();
+    saved_intr_state = intr_disable();
+
+    alarm_arm(al, tcnt);
+
+    // If the wake-up time has already passed, return
+
+    if (al->twake < now) {
+        wheel_remove(al);
+        intr_restore(saved_intr_state);
+        return;
+    }
+
+    // Note: condition_wait must be *inside* intr_disable/intr_restore block to
+    // prevent a race condition where an alarm is signalled before we call
+    // condition_wait.
+
+    condition_wait(&al->cond);
+
+    intr_restore(saved_intr_state);
+}
+
+void alarm_arm(struct alarm * al, uint64_t tcnt) {
+    int saved_intr_state;
+    uint64_t texp;
 
     // If the tcnt is so large it wraps around, set it to UINT64_MAX
 
@@ -74,61 +134,46 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
     else
         al->twake += tcnt;
     
-    // If the wake-up time has already passed, return
-
-    if (al->twake < now)
-        return;
-    
     saved_intr_state = intr_disable();
 
-    if (sleep_list == NULL || al->twake <= sleep_list->twake) {
-        debug("[%lu] Inserting alarm %s at head of list", now, al->cond.name);
-        // Insert alarm at head of sleep list
-        al->next = sleep_list;
-        sleep_list = al;
-        // If current alarm occurs before next tick, update mtcmp
-
-        if (al->twake < next_tick) {
-            set_mtcmp(al->twake);
-            csrs_sie(RISCV_SIE_STIE);
-            enable_mmode_timer_intr();
-        }
+    if (al->pprev != NULL)
+        wheel_remove(al);
 
+    wheel_insert(al);
 
-    } else {
-        // Insert current alarm in list in order of wake-up time. Ideally, we
-        // should not keep interrupts disabled while we iterate through the
-        // list. The right way would be to restore interrupt state, find the
-        // place on the list where we want to insert, the disable interrupts and
-        // re-check the insert point.
-
-        for (prev = sleep_list; prev->next != NULL; prev = prev->next) {
-            if (al->twake <= prev->next->twake) {
-                debug("[%lu] Inserting alarm %s after %s",
-                    now, al->cond.name, prev->cond.name);
-                al->next = prev->next;
-                prev->next = al;
-                break;
-            }
-        }
+    // If the alarm expires before the next scheduled timer interrupt, move the
+    // timer interrupt up.
 
-        // End of list, insert at tail
-        if (prev->next == NULL) {
-            debug("%[lu] Inserting alarm %s at tail", al->cond.name);
-            al->next = NULL;
-            prev->next = al;
-        }
+    texp = wtick_to_twake(twake_to_wtick(al->twake));
+
+    if (texp < get_mtcmp()) {
+        debug("Alarm %s moves timer interrupt to %lu", al->cond.name, texp);
+        set_mtcmp(texp);
+        csrs_sie(RISCV_SIE_STIE);
+        enable_mmode_timer_intr();
     }
 
-    debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
+    intr_restore(saved_intr_state);
+}
 
-    // Note: condition_wait must be *inside* intr_disable/intr_restore block to
-    // prevent a race condition where an alarm is signalled before we call
-    // condition_wait.
+int alarm_cancel(struct alarm * al) {
+    int saved_intr_state;
+    int armed;
 
-    condition_wait(&al->cond);
+    saved_intr_state = intr_disable();
 
+    armed = (al->pprev != NULL);
+
+    if (armed)
+        wheel_remove(al);
+    
+    // We leave the timer interrupt alone: if it was set for this alarm, the
+    // handler finds nothing to expire and reprograms it.
+
+    condition_broadcast(&al->cond);
     intr_restore(saved_intr_state);
+
+    return armed;
 }
 
 // Resets the alarm so that the next sleep increment is relative to the time
@@ -141,8 +186,7 @@ void alarm_reset(struct alarm * al) {
 // timer_handle_interrupt() is dispatched from intr_handler in intr.c
 
 void timer_intr_handler(struct trap_frame * tfr) {
-    struct alarm * head = sleep_list;
-    struct alarm * next;
+    uint64_t twake;
     uint64_t now;
 
     now = get_mtime();
@@ -150,30 +194,220 @@ void timer_intr_handler(struct trap_frame * tfr) {
     trace("[%lu] %s()", now, __func__);
     debug("[%lu] mtcmp = %lu", now, get_mtcmp());
 
-    while (head != NULL && head->twake <= now) {
-        debug("[%lu] Broadcasting alarm for %s", now, head->cond.name);
-        condition_broadcast(&head->cond);
-        next = head->next;
-        head->next = NULL;
-        head = next;
-    }
+    // Expire all alarms due at or before the current wheel tick
+
+    wheel_advance(now >> TW_RES_ORDER);
 
-    if (next_tick < now)
+    while (next_tick <= now)
         next_tick += TICK_PERIOD;
 
-    sleep_list = head;
+    twake = wheel_next_twake();
 
-    if (head != NULL && head->twake < next_tick)
-        set_mtcmp(head->twake);
+    if (twake < next_tick)
+        set_mtcmp(twake);
     else
         set_mtcmp(next_tick);
 
-
     debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
     enable_mmode_timer_intr();
 
 }
 
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void wheel_insert(struct alarm * al) {
+    uint64_t wtick, delta;
+    unsigned int lvl, idx;
+
+    wtick = twake_to_wtick(al->twake);
+
+    // Alarms that are already due go into the slot processed next. Alarms too
+    // far out for the wheel are parked at its far end.
+
+    if (wtick < wheel_now)
+        wtick = wheel_now;
+
+    delta = wtick - wheel_now;
+
+    if (TW_SPAN <= delta) {
+        delta = TW_SPAN - 1;
+        wtick = wheel_now + delta;
+    }
+
+    for (lvl = 0; lvl < TW_LVLCNT-1; lvl++) {
+        if (delta < (UINT64_C(1) << ((lvl+1) * TW_LVL_ORDER)))
+            break;
+    }
+
+    idx = (wtick >> (lvl * TW_LVL_ORDER)) % TW_SLOTCNT;
+
+    al->next = wheel[lvl][idx];
+    if (al->next != NULL)
+        al->next->pprev = &al->next;
+    al->pprev = &wheel[lvl][idx];
+    wheel[lvl][idx] = al;
+
+    al->slot = lvl * TW_SLOTCNT + idx;
+    wheel_bitmap[lvl] |= UINT64_C(1) << idx;
+}
+
+void wheel_remove(struct alarm * al) {
+    const unsigned int lvl = al->slot / TW_SLOTCNT;
+    const unsigned int idx = al->slot % TW_SLOTCNT;
+
+    assert (al->pprev != NULL);
+
+    *al->pprev = al->next;
+    if (al->next != NULL)
+        al->next->pprev = al->pprev;
+    
+    al->next = NULL;
+    al->pprev = NULL;
+
+    if (wheel[lvl][idx] == NULL)
+        wheel_bitmap[lvl] &= ~(UINT64_C(1) << idx);
+}
+
+// Called when wheel_now reaches a multiple of TW_SLOTCNT, i.e. when level 0
+// wraps around. Re-inserts the alarms in the current slot of each higher level
+// until we reach a level that did not wrap around.
+
+void wheel_cascade(void) {
+    struct alarm * al;
+    struct alarm * next;
+    unsigned int lvl, idx;
+
+    for (lvl = 1; lvl < TW_LVLCNT; lvl++) {
+        idx = (wheel_now >> (lvl * TW_LVL_ORDER)) % TW_SLOTCNT;
+
+        al = wheel[lvl][idx];
+        wheel[lvl][idx] = NULL;
+        wheel_bitmap[lvl] &= ~(UINT64_C(1) << idx);
+
+        while (al != NULL) {
+            next = al->next;
+            wheel_insert(al);
+            al = next;
+        }
+
+        if (idx != 0)
+            break;
+    }
+}
+
+// Wakes up the threads sleeping on all alarms in level 0 slot /idx/.
+
+void wheel_expire(unsigned int idx) {
+    struct alarm * al;
+    struct alarm * next;
+
+    al = wheel[0][idx];
+    wheel[0][idx] = NULL;
+    wheel_bitmap[0] &= ~(UINT64_C(1) << idx);
+
+    while (al != NULL) {
+        next = al->next;
+        al->next = NULL;
+        al->pprev = NULL;
+
+        if (al->func != NULL)
+            al->func(al);
+        else {
+            debug("Broadcasting alarm for %s", al->cond.name);
+            condition_broadcast(&al->cond);
+        }
+
+        al = next;
+    }
+}
+
+// Processes all wheel ticks up to and including /wtick/. We only stop at
+// non-empty level 0 slots and at the cascade points in between, so the cost
+// does not depend on how long it has been since the last timer interrupt.
+
+void wheel_advance(uint64_t wtick) {
+    uint64_t pending;
+    uint64_t next;
+    unsigned int idx;
+
+    while (wheel_now <= wtick) {
+        idx = wheel_now % TW_SLOTCNT;
+
+        if (idx == 0)
+            wheel_cascade();
+        
+        wheel_expire(idx);
+
+        // Non-empty level 0 slots after the current one in this rotation
+
+        pending = wheel_bitmap[0] & ~((UINT64_C(2) << idx) - 1);
+
+        if (pending != 0)
+            next = wheel_now - idx + __builtin_ctzl(pending);
+        else
+            next = wheel_now - idx + TW_SLOTCNT;
+        
+        // Do not skip past wtick+1: alarms armed after we return must still
+        // land in a slot that has not been processed yet.
+
+        wheel_now = (next <= wtick) ? next : wtick + 1;
+    }
+}
+
+// Returns the time at which the timer interrupt should fire next to process
+// the timer wheel, or UINT64_MAX if no alarms are armed. This is either the
+// next non-empty level 0 slot, or, if there are alarms on a higher level, the
+// next cascade point, whichever comes first.
+
+uint64_t wheel_next_twake(void) {
+    const unsigned int idx = wheel_now % TW_SLOTCNT;
+    uint64_t pending;
+    uint64_t cascade;
+    uint64_t next;
+    unsigned int lvl;
+
+    pending = wheel_bitmap[0] & ~((UINT64_C(1) << idx) - 1);
+
+    if (pending != 0)
+        next = wheel_now - idx + __builtin_ctzl(pending);
+    else if (wheel_bitmap[0] != 0) // next rotation
+        next = wheel_now - idx + TW_SLOTCNT + __builtin_ctzl(wheel_bitmap[0]);
+    else
+        next = UINT64_MAX;
+    
+    // A cascade is due at wheel_now itself if it is a multiple of TW_SLOTCNT
+
+    cascade = (wheel_now + TW_SLOTCNT-1) / TW_SLOTCNT * TW_SLOTCNT;
+
+    for (lvl = 1; lvl < TW_LVLCNT; lvl++) {
+        if (wheel_bitmap[lvl] != 0) {
+            if (cascade < next)
+                next = cascade;
+            break;
+        }
+    }
+
+    return wtick_to_twake(next);
+}
+
+// Returns the first wheel tick at or after /twake/.
+
+static inline uint64_t twake_to_wtick(uint64_t twake) {
+    return (twake >> TW_RES_ORDER) +
+        ((twake & ((UINT64_C(1) << TW_RES_ORDER) - 1)) != 0);
+}
+
+// Returns the time at which wheel tick /wtick/ starts, or UINT64_MAX if that
+// is out of range. (twake_to_wtick(UINT64_MAX) is one such wheel tick.)
+
+static inline uint64_t wtick_to_twake(uint64_t wtick) {
+    if (UINT64_MAX >> TW_RES_ORDER < wtick)
+        return UINT64_MAX;
+    else
+        return wtick << TW_RES_ORDER;
+}
+
 void enable_mmode_timer_intr(void) {
     // see _mmode_trap_handler in trapasm.s
     asm ("ecall" ::: "memory");
@@ -10,10 +10,22 @@
 
 #define TIMER_FREQ 10000000UL // from QEMU include/hw/intc/riscv_aclint.h
 
+// An alarm is kept in one slot of the timer wheel while it is armed. The slot
+// list is doubly linked through /next/ and /pprev/, so that an alarm can be
+// removed from its slot in constant time. An alarm that is not armed has a
+// NULL /pprev/.
+//
+// When an alarm expires, the timer interrupt handler calls /func/ if it is not
+// NULL, and otherwise wakes up all threads sleeping on the alarm. The /func/
+// callback runs in the timer ISR with interrupts disabled.
+
 struct alarm {
     struct condition cond;
+    void (*func)(struct alarm * al);
     struct alarm * next;
+    struct alarm ** pprev;
     uint64_t twake;
+    uint16_t slot; // timer wheel slot (level * TW_SLOTCNT + index)
 };
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -32,6 +44,19 @@ extern void alarm_init(struct alarm * al, const char * name);
 
 extern void alarm_sleep(struct alarm * al, uint64_t tcnt);
 
+// Arms the alarm to expire /tcnt/ timer ticks after the most recent alarm
+// event, without waiting for it. If the alarm is already armed, it is re-armed
+// with the new wake-up time. Use alarm_sleep to wait for an armed alarm or set
+// /func/ to be notified when it expires.
+
+extern void alarm_arm(struct alarm * al, uint64_t tcnt);
+
+// Disarms the alarm. Any threads sleeping on the alarm are woken up early.
+// Returns 1 if the alarm was armed and 0 if it had already expired or was never
+// armed. May be called from an ISR.
+
+extern int alarm_cancel(struct alarm * al);
+
 // Resets the alarm so that the next sleep increment is relative to the time
 // of this function call.
 
@@ -45,7 +45,7 @@
 #define TFR_T6      31
 
 struct trap_frame {
-    uint64_t x[32]; // x[0] used to save tp when in U mode
+    uint64_t x[32]; // x[0] unused
     uint64_t sstatus;
     uint64_t sepc;
 };
@@ -2,7 +2,7 @@
 #
 
         # struct trap_frame {
-        #     uint64_t x[32]; // x[0] used to save tp when in U mode
+        #     uint64_t x[32]; // x[0] unused
         #     uint64_t sstatus;
         #     uint64_t sepc;
         # };
@@ -53,11 +53,20 @@
 
         .macro  restore_sstatus_and_sepc
         # Restores sstatus and sepc from trap frame to which sp points. We use
-        # t6 as a temporary, so must be used after this macro, not before.
+        # t6 as a temporary, so must be used after this macro, not before. The
+        # FS field is left as is: it belongs to whichever thread is running
+        # now, which may not be the one that took the trap (see thread.c).
+        # Uses t4 and t5, which are restored after this macro.
 
         ld      t6, 33*8(sp)
         csrw    sepc, t6
         ld      t6, 32*8(sp)
+        li      t5, 0x6000      # RISCV_SSTATUS_FS
+        csrr    t4, sstatus
+        and     t4, t4, t5
+        not     t5, t5
+        and     t6, t6, t5
+        or      t6, t6, t4
         csrw    sstatus, t6
         .endm
 
@@ -149,53 +158,64 @@ trap_smode_cont:
 # handler
 _trap_entry_from_umode:
 
-        # When we're in S mode, sscratch points to the kernel thread's
+        # When we're in U mode, sscratch points to the kernel thread's
         # thread_stack_anchor struct, which contains the thread pointer. The
         # address of the thread_stack_anchor also serves as our initial kernel
         # stack pointer. We start by allocating a trap frame and saving t6
-        # there, so we can use it as a temporary register.
+        # there, so we can use it as a temporary register. The user sp and tp
+        # are saved in the trap frame like the other registers, so that each
+        # thread returns to U mode with its own.
 
+        csrrw   sp, sscratch, sp        # sp = stack anchor, sscratch = user sp
+        addi    sp, sp, -34*8           # allocate space for trap frame
+        sd      t6, 31*8(sp)            # save t6 (x31) in trap frame
+        csrr    t6, sscratch            # save user sp
+        sd      t6, 2*8(sp)             #
 
-        # TODO: FIXME your code here
-        csrrw sp, sscratch, sp # swap sp and sscratch
-        ld tp, 0(sp)
-        addi sp, sp, -34*8   # allocate space for trap frame
-        sd t6, 31*8(sp)    # save t6 (x31) in trap frame
-        addi t6, sp, 34*8    # save original sp
-        sd t6, 2*8(sp)     # 
-
-        save_gprs_except_t6_and_sp 
+        save_gprs_except_t6_and_sp
         save_sstatus_and_sepc
 
+        ld      tp, 34*8(sp)            # thread pointer from stack anchor
+
         # We're now in S mode, so update our trap handler address to
         # _trap_entry_from_smode.
 
-        # TODO: FIXME your code here
-        la t6, _trap_entry_from_smode
-        csrw stvec, t6
+        la      t6, _trap_entry_from_smode
+        csrw    stvec, t6
 
-        call trap_umode_cont
+        call    trap_umode_cont
 
         # U mode handlers return here because the call instruction above places
-        # this address in /ra/ before we jump to exception or trap handler.
-        # We're returning to U mode, so restore _smode_trap_entry_from_umode as
-        # trap handler.
+        # this address in /ra/ before we jump to exception or trap handler. A
+        # new user thread also starts here, with sp pointing to its initial
+        # trap frame at the top of its kernel stack (see thread.c).
+
+        .global _trap_return_to_umode
+        .type   _trap_return_to_umode, @function
+
+_trap_return_to_umode:
+
+        call    process_check_exit      # in process.c
+
+        # We're returning to U mode, so restore _trap_entry_from_umode as trap
+        # handler and point sscratch at our stack anchor for the next trap.
+        # Interrupts stay disabled until sret.
+
+        csrci   sstatus, 0x2
+        la      t6, _trap_entry_from_umode
+        csrw    stvec, t6
+        addi    t6, sp, 34*8
+        csrw    sscratch, t6
 
-        # TODO: FIXME your code here
-        la t6, _trap_entry_from_umode
-        csrw stvec, t6
-        
         restore_sstatus_and_sepc
         restore_gprs_except_t6_and_sp
-        
-        ld      t6, 31*8(sp)
-        ld      sp, 2*8(sp)
 
-        csrrw sp, sscratch, sp # swap sp and sscratch
+        ld      t6, 31*8(sp)
+        ld      sp, 2*8(sp)             # user sp
 
         sret
+
         # Execution of trap entry continues here. Jump to handlers.
-        
 
 trap_umode_cont:
         
@@ -210,14 +210,28 @@ long uart_read(struct io_intf * io, void * buf, unsigned long bufsz) {
 
 	intr_disable();
 
-	while (rbuf_empty(&dev->rxbuf))
-		condition_wait(&dev->rxbnotempty);
+	// Readers wait exclusively, so the ISR only wakes up one of them. If we
+	// leave data in the buffer, we pass the wake-up on to the next reader.
+	// The wait is interruptible, as input may never arrive. If the wake-up
+	// came with the interrupt, we pass it on as well.
+
+	while (rbuf_empty(&dev->rxbuf)) {
+		if (condition_wait_exclusive_intr(&dev->rxbnotempty) < 0) {
+			if (!rbuf_empty(&dev->rxbuf))
+				condition_signal(&dev->rxbnotempty);
+			intr_enable();
+			return -EINTR;
+		}
+	}
 
 	intr_enable();
 
 	while (!rbuf_empty(&dev->rxbuf) && p - (char*)buf < bufsz)
 		*p++ = rbuf_get(&dev->rxbuf);
 	
+	if (!rbuf_empty(&dev->rxbuf))
+		condition_signal(&dev->rxbnotempty);
+
 	dev->regs->ier |= IER_DREIE; // enable receive interrupts
 	
 	return p - (char*)buf;
@@ -236,12 +250,13 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	if (LONG_MAX < n)
 		n = LONG_MAX;
 
-	// Wait until there is room in the transmit ring buffer.
+	// Wait until there is room in the transmit ring buffer. Writers wait
+	// exclusively, like readers in uart_read.
 
 	while (p - (char*)buf < n) {
 		intr_disable();
 		while (rbuf_full(&dev->txbuf))
-			condition_wait(&dev->txbnotfull);
+			condition_wait_exclusive(&dev->txbnotfull);
 		intr_enable();
 
 		while (!rbuf_full(&dev->txbuf) && p - (char*)buf < n)
@@ -250,6 +265,11 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 		dev->regs->ier |= IER_THREIE;
 	}
 
+	// If we are done and there is still room, let the next writer in
+
+	if (!rbuf_full(&dev->txbuf))
+		condition_signal(&dev->txbnotfull);
+
 	return p - (char*)buf;
 }
 
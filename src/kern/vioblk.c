@@ -11,12 +11,84 @@
 #include "string.h"
 #include "thread.h"
 #include "lock.h"
+#include "timer.h"
+#include "memory.h"
+#include "csr.h"
 
 //           COMPILE-TIME PARAMETERS
 //          
 
 #define VIOBLK_IRQ_PRIO 1
-#define VIRTQ_ID 0
+
+//           Time to wait for the device to complete a request before giving up
+
+#ifndef VIOBLK_TIMEOUT
+#define VIOBLK_TIMEOUT (2 * TIMER_FREQ)
+#endif
+
+// Time to wait for the device to complete a queue reset, with interrupts
+// disabled, before giving up on the device
+
+#ifndef VIOBLK_RESET_TIMEOUT
+#define VIOBLK_RESET_TIMEOUT (TIMER_FREQ / 100) // 10 ms
+#endif
+
+// Maximum number of virtqueues used. The device may offer fewer with
+// VIRTIO_BLK_F_MQ (or just one without it).
+
+#ifndef VIOBLK_MAXQ
+#define VIOBLK_MAXQ 4
+#endif
+
+// Maximum number of descriptors in a virtqueue, which is also the maximum
+// number of requests in flight. Must be a power of two no greater than 128, so
+// that the descriptor table and both rings of a split virtqueue fit in one
+// page.
+
+#ifndef VIOBLK_QLEN
+#define VIOBLK_QLEN 128
+#endif
+
+// Maximum number of requests a single vioblk_readat or vioblk_writeat call
+// keeps in flight
+
+#ifndef VIOBLK_BATCH
+#define VIOBLK_BATCH 16
+#endif
+
+// Maximum number of data segments in one request. The device may lower it
+// with VIRTIO_BLK_F_SEG_MAX.
+
+#ifndef VIOBLK_SEG_MAX
+#define VIOBLK_SEG_MAX 32
+#endif
+
+// Maximum number of bytes transferred by one request. The device may lower
+// it through its topology.
+
+#ifndef VIOBLK_REQ_MAX
+#define VIOBLK_REQ_MAX (64 * 1024)
+#endif
+
+// How long a thread waiting for a request polls the used ring before going to
+// sleep, in timer ticks. The poll time adapts between VIOBLK_POLL_MIN and
+// VIOBLK_POLL_MAX to how fast the device completes requests. Setting
+// VIOBLK_POLL_MAX to 0 disables polling.
+
+#ifndef VIOBLK_POLL_MAX
+#define VIOBLK_POLL_MAX (TIMER_FREQ / 20000) // 50 us
+#endif
+
+#ifndef VIOBLK_POLL_MIN
+#define VIOBLK_POLL_MIN (TIMER_FREQ / 1000000) // 1 us
+#endif
+
+// With VIRTIO_F_EVENT_IDX, the number of completions of requests no thread is
+// waiting for (asynchronous requests) the device may batch into one interrupt
+
+#ifndef VIOBLK_INTR_BATCH
+#define VIOBLK_INTR_BATCH 8
+#endif
 
 //           INTERNAL CONSTANT DEFINITIONS
 //          
@@ -49,12 +121,28 @@ struct vioblk_request_header {
     uint64_t sector;
 };
 
-struct lock vioblk_lock;
-
 //           Request type (for vioblk_request_header)
 
 #define VIRTIO_BLK_T_IN             0
 #define VIRTIO_BLK_T_OUT            1
+#define VIRTIO_BLK_T_FLUSH          4
+#define VIRTIO_BLK_T_DISCARD        11
+#define VIRTIO_BLK_T_WRITE_ZEROES   13
+
+// The sector in a request header is always in units of 512 bytes
+
+#define VIRTIO_BLK_SECTOR_SIZE      512
+
+// The data of VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES requests is a
+// range of sectors. The sector in the request header is unused.
+
+struct vioblk_discard_write_zeroes {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+#define VIRTIO_BLK_WZ_F_UNMAP       1 // device may deallocate the zeroed sectors
 
 //           Status byte values
 
@@ -62,6 +150,86 @@ struct lock vioblk_lock;
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+// Each slot of the virtqueue has its own request. Ring descriptor /i/ is an
+// indirect descriptor that always points to the table of request /i/, so the
+// slot number is also the request id reported in the used ring. The data of a
+// request is either up to VIOBLK_SEG_MAX segments of the caller's buffer or
+// the request's own one-block buffer. A request that is part of an
+// asynchronous io_req has no waiting thread; the ISR frees it and completes
+// the io_req when its last part is done.
+
+struct vioblk_req {
+    struct vioblk_request_header hdr;
+    struct virtq_desc itab[VIOBLK_SEG_MAX+2]; // header, data..., status
+    uint16_t nseg; // number of data segments
+    volatile uint8_t status;
+    volatile char done; // set by ISR
+    char submitted; // on the ring and not yet completed
+    int16_t next_free;
+    struct condition done_cond; // signalled by ISR when done
+    char * buf; // one block
+    struct io_req * ioreq; // asynchronous request this is part of, or NULL
+    uint32_t iolen; // bytes of ioreq this part transfers
+};
+
+// A queue is either a split virtqueue, with a descriptor table whose entry /i/
+// always points to request /i/ and separate avail and used rings, or, with
+// VIRTIO_F_RING_PACKED, a packed virtqueue. A packed virtqueue is one ring of
+// descriptors that we fill in at submission and the device overwrites with
+// used descriptors in completion order, so a request touches one ring entry
+// instead of three. Each side has a wrap counter that flips whenever it wraps
+// around the ring; it tells new descriptors from those of the last lap.
+
+struct vioblk_queue {
+    int qid;
+    uint16_t len;
+    char packed; // packed virtqueue
+    uint16_t avail_idx; // number of requests submitted, modulo 2^16
+    uint16_t last_used; // used ring index (split) or ring position (packed) up to which we have looked
+
+    // Split virtqueue
+    struct virtq_desc * desc;
+    struct virtq_avail * avail;
+    volatile struct virtq_used * used;
+
+    // Packed virtqueue
+    volatile struct virtq_packed_desc * ring;
+    volatile struct virtq_event_suppress * driver_event; // written by us
+    volatile struct virtq_event_suppress * device_event; // written by device
+    uint16_t next_avail; // ring position of the next request we submit
+    char avail_wrap; // wrap counter for next_avail
+    char used_wrap; // wrap counter for last_used
+
+    int free_head; // first free slot or -1
+    struct condition slot_free; // signalled when a slot is freed
+
+    // Notification and interrupt suppression. With VIRTIO_F_EVENT_IDX, we
+    // write the used ring index at which we want the next interrupt to
+    // used_event, and the device writes the avail ring index at which it
+    // wants the next notification to avail_event. Packed virtqueues use
+    // driver_event and device_event instead.
+    volatile uint16_t * used_event; // after the avail ring
+    volatile uint16_t * avail_event; // after the used ring
+    uint16_t notified; // avail_idx at the last notification
+    uint16_t inflight; // requests submitted and not yet in the used ring
+    uint16_t nwaiting; // threads sleeping on a request
+    uint16_t npolling; // threads polling the used ring
+    uint64_t poll_time; // how long to poll before sleeping
+    struct vioblk_req * reqs[VIOBLK_QLEN];
+};
+
+// A request that vioblk_readat or vioblk_writeat has in flight and the part
+// of the caller's buffer it covers. If /bounce/ is set, the data goes through
+// the request's block buffer, starting at /blkoff/.
+
+struct vioblk_inflight {
+    int id;
+    char bounce;
+    uint32_t blkoff;
+    uint32_t len;
+    unsigned long bufoff;
+};
+
 //           Main device structure.
 //          
 //           FIXME You may modify this structure in any way you want. It is given as a
@@ -74,6 +242,10 @@ struct vioblk_device {
     uint16_t irqno;
     int8_t opened;
     int8_t readonly;
+    int8_t flush; // device has a write cache we must flush (VIRTIO_BLK_F_FLUSH)
+    int8_t event_idx; // VIRTIO_F_EVENT_IDX negotiated
+    int8_t packed; // VIRTIO_F_RING_PACKED negotiated
+    int8_t broken; // a queue reset did not complete, so all requests fail
 
     //           optimal block size
     uint32_t blksz;
@@ -84,35 +256,23 @@ struct vioblk_device {
     //           size of device in blksz blocks
     uint64_t blkcnt;
 
-    struct {
-        //           signaled from ISR
-        struct condition used_updated;
-
-        //           We use a simple scheme of one transaction at a time.
-
-        union {
-            struct virtq_avail avail;
-            char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
-        };
+    // Request limits
+    uint32_t seg_max; // data segments per request
+    uint32_t size_max; // bytes per segment
+    uint32_t req_max; // bytes per request (multiple of blksz)
 
-        union {
-            volatile struct virtq_used used;
-            char _used_filler[VIRTQ_USED_SIZE(1)];
-        };
+    // Range command limits in bytes per request (multiples of blksz), 0 if
+    // the device does not support the command
+    uint64_t discard_max;
+    uint64_t wz_max;
+    int8_t wz_unmap; // device may deallocate zeroed blocks
 
-        //           The first descriptor is an indirect descriptor and is the one used in
-        //           the avail and used rings. The second descriptor points to the header,
-        //           the third points to the data, and the fourth to the status byte.
+    // Each thread submits to one of the queues, see vioblk_select_queue
+    uint16_t nvq;
+    struct vioblk_queue * vqs[VIOBLK_MAXQ];
 
-        struct virtq_desc desc[4];
-        struct vioblk_request_header req_header;
-        uint8_t req_status;
-    } vq;
-
-    //           Block currently in block buffer
-    uint64_t bufblkno;
-    //           Block buffer
-    char * blkbuf;
+    // Serializes read-modify-write of partially written blocks
+    struct lock rmw_lock;
 };
 
 //           INTERNAL FUNCTION DECLARATIONS
@@ -132,11 +292,64 @@ static long vioblk_write (
     const void * restrict buf,
     unsigned long n);
 
+static long vioblk_readat (
+    struct io_intf * restrict io,
+    unsigned long long pos,
+    void * restrict buf,
+    unsigned long bufsz);
+
+static long vioblk_writeat (
+    struct io_intf * restrict io,
+    unsigned long long pos,
+    const void * restrict buf,
+    unsigned long n);
+
 static int vioblk_ioctl (
     struct io_intf * restrict io, int cmd, void * restrict arg);
 
+static int vioblk_iosubmit(struct io_intf * io, struct io_req * req);
+static void vioblk_ioreq_done(struct io_req * req);
+
 static void vioblk_isr(int irqno, void * aux);
 
+static int vioblk_init_queue (
+    struct vioblk_device * dev, struct vioblk_queue * q, int qid);
+
+static struct vioblk_queue * vioblk_select_queue(const struct vioblk_device * dev);
+
+static int vioblk_get_req(struct vioblk_queue * q, int wait);
+static void vioblk_put_req(struct vioblk_queue * q, int id);
+
+static uint32_t vioblk_map (
+    const struct vioblk_device * dev, struct vioblk_req * req,
+    const void * buf, uint32_t len, uint32_t type);
+
+static void vioblk_map_bounce (
+    const struct vioblk_device * dev, struct vioblk_req * req);
+
+static void vioblk_submit (
+    struct vioblk_device * dev, struct vioblk_queue * q,
+    int id, uint32_t type, uint64_t pos);
+
+static void vioblk_notify(struct vioblk_device * dev, struct vioblk_queue * q);
+
+static int vioblk_wait_req (
+    struct vioblk_device * dev, struct vioblk_queue * q, int id);
+
+static void vioblk_poll_used(struct vioblk_device * dev, struct vioblk_queue * q);
+static int vioblk_used_ready(const struct vioblk_queue * q);
+static int vioblk_next_used(struct vioblk_queue * q);
+static void vioblk_process_used(struct vioblk_device * dev, struct vioblk_queue * q);
+static void vioblk_update_intr(struct vioblk_device * dev, struct vioblk_queue * q);
+
+static void vioblk_complete_req(struct vioblk_queue * q, int id);
+static void vioblk_reset_queue(struct vioblk_device * dev, struct vioblk_queue * q);
+static void vioblk_release_req(struct vioblk_queue * q, int id);
+
+static int vioblk_rmw (
+    struct vioblk_device * dev, uint64_t blkpos,
+    uint32_t blkoff, const void * src, uint32_t len);
+
 //           IOCTLs
 
 static int vioblk_getlen(const struct vioblk_device * dev, uint64_t * lenptr);
@@ -144,6 +357,9 @@ static int vioblk_getpos(const struct vioblk_device * dev, uint64_t * posptr);
 static int vioblk_setpos(struct vioblk_device * dev, const uint64_t * posptr);
 static int vioblk_getblksz (
     const struct vioblk_device * dev, uint32_t * blkszptr);
+static int vioblk_flush(struct vioblk_device * dev);
+static int vioblk_range (
+    struct vioblk_device * dev, const struct io_range * range, uint32_t type);
 
 //           EXPORTED FUNCTION DEFINITIONS
 //          
@@ -159,7 +375,10 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     virtio_featset_t enabled_features, wanted_features, needed_features;
     struct vioblk_device * dev;
+    struct vioblk_queue * q;
     uint_fast32_t blksz;
+    uint_fast16_t nvq;
+    uint64_t sectors;
     int result;
 
     assert (regs->device_id == VIRTIO_ID_BLOCK);
@@ -181,8 +400,24 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
     virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
     virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_F_RING_RESET);
+    virtio_featset_add(wanted_features, VIRTIO_F_INDIRECT_DESC);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    // Also the device's request limits
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SIZE_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SEG_MAX);
+    // And a flush command, so that IOCTL_FLUSH can make writes durable
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_FLUSH);
+    // And event indexes, to suppress notifications and interrupts precisely
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
+    // And several queues, so that threads do not share one ring
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_MQ);
+    // And packed virtqueues, which we fall back from to split ones
+    virtio_featset_add(wanted_features, VIRTIO_F_RING_PACKED);
+    // And range commands for IOCTL_DISCARD and IOCTL_WRITE_ZEROES
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_DISCARD);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_WRITE_ZEROES);
     result = virtio_negotiate_features(regs,
         enabled_features, wanted_features, needed_features);
 
@@ -202,7 +437,7 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     //           Allocate initialize device struct
 
-    dev = kmalloc(sizeof(struct vioblk_device) + blksz);
+    dev = kmalloc(sizeof(struct vioblk_device));
     memset(dev, 0, sizeof(struct vioblk_device));
 
     //           FIXME Finish initialization of vioblk device here
@@ -210,14 +445,85 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     dev->regs = regs;
     dev->irqno = irqno;
     dev->opened = 0;
-    dev->blkbuf = (char *) (dev + 1);
-    dev->bufblkno = 0;
     dev->blkcnt = regs->config.blk.capacity;
     __sync_synchronize();
     dev->size = dev->blkcnt * blksz;
 
+    // Request limits. A device that does not report a segment size limit
+    // has none. The optimal I/O size from the topology caps request size.
+
+    dev->seg_max = VIOBLK_SEG_MAX;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SEG_MAX) &&
+        0 < regs->config.blk.seg_max && regs->config.blk.seg_max < dev->seg_max)
+        dev->seg_max = regs->config.blk.seg_max;
+
+    dev->size_max = UINT32_MAX;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SIZE_MAX) &&
+        0 < regs->config.blk.size_max)
+        dev->size_max = regs->config.blk.size_max;
+
+    dev->req_max = VIOBLK_REQ_MAX;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_TOPOLOGY) &&
+        0 < regs->config.blk.topology.opt_io_size &&
+        regs->config.blk.topology.opt_io_size < dev->req_max / blksz)
+        dev->req_max = regs->config.blk.topology.opt_io_size * blksz;
+    dev->req_max = dev->req_max / blksz * blksz;
+    if (dev->req_max == 0)
+        dev->req_max = blksz;
+
+    debug("%p: virtio block device request limits: %u segments of %u bytes, %u bytes",
+        regs, dev->seg_max, dev->size_max, dev->req_max);
+
+    dev->flush = virtio_featset_test(enabled_features, VIRTIO_BLK_F_FLUSH);
+    dev->event_idx = virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
+    dev->packed = virtio_featset_test(enabled_features, VIRTIO_F_RING_PACKED);
+
+    // Range commands. A device limit of 0 sectors means no limit.
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_DISCARD)) {
+        sectors = regs->config.blk.max_discard_sectors;
+        if (sectors == 0)
+            sectors = UINT32_MAX;
+        dev->discard_max = sectors * VIRTIO_BLK_SECTOR_SIZE / blksz * blksz;
+    }
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_WRITE_ZEROES)) {
+        sectors = regs->config.blk.max_write_zeroes_sectors;
+        if (sectors == 0)
+            sectors = UINT32_MAX;
+        dev->wz_max = sectors * VIRTIO_BLK_SECTOR_SIZE / blksz * blksz;
+        dev->wz_unmap = (regs->config.blk.write_zeroes_may_unmap != 0);
+    }
+
+    lock_init(&dev->rmw_lock, "vioblk.rmw");
+
+    // Set up as many queues as the device offers, up to VIOBLK_MAXQ. We
+    // only need the first one.
+
+    nvq = 1;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_MQ) &&
+        1 < regs->config.blk.num_queues)
+        nvq = regs->config.blk.num_queues;
+    if (VIOBLK_MAXQ < nvq)
+        nvq = VIOBLK_MAXQ;
+
+    for (dev->nvq = 0; dev->nvq < nvq; dev->nvq++) {
+        q = kmalloc(sizeof(struct vioblk_queue));
+        if (vioblk_init_queue(dev, q, dev->nvq) != 0) {
+            kfree(q);
+            break;
+        }
+        dev->vqs[dev->nvq] = q;
+    }
+
+    if (dev->nvq == 0) {
+        kprintf("%p: virtio block device has no usable queue\n", regs);
+        return;
+    }
+
+    debug("%p: virtio block device uses %d queues", regs, (int)dev->nvq);
+
     dev->instno = device_register("blk", vioblk_open, dev);
-    virtio_attach_virtq(regs, VIRTQ_ID, 1, (uint64_t)&dev->vq.desc, (uint64_t)&dev->vq.used, (uint64_t)&dev->vq.avail);
     intr_register_isr(irqno, VIOBLK_IRQ_PRIO, vioblk_isr, dev);
 
     regs->status |= VIRTIO_STAT_DRIVER_OK;    
@@ -230,26 +536,29 @@ Purpose: Sets the virtq avail and virtq used queues such that they are available
 virtio.h) Enables the interupt line for the virtio device and sets necessary flags in vioblk device.
 Returns the IO operations to ioptr.
 Arguments: ioptr (64-bit), aux (64-bit)
-Side Effects: Opens the device, enables virtq queues, initializes condition for isr
+Side Effects: Opens the device, enables virtq queues
 */
 int vioblk_open(struct io_intf ** ioptr, void * aux) {
     struct vioblk_device * dev = (struct vioblk_device *)aux;
+    int i;
 
     if (dev->opened) { // Check if device is already open
         return -EBUSY;
     }
-    lock_init(&vioblk_lock, "vioblk_lock");
     static const struct io_ops vioblk_ops = {
         .close = vioblk_close,
         .read = vioblk_read,
         .write = vioblk_write,
         .ctl = vioblk_ioctl,
+        .readat = vioblk_readat,
+        .writeat = vioblk_writeat,
+        .submit = vioblk_iosubmit
     };
     dev->io_intf.ops = &vioblk_ops;
 
     intr_enable_irq(dev->irqno); // Enable interrupts for the device
-    virtio_enable_virtq(dev->regs, VIRTQ_ID); // Enable the virtual queue
-    condition_init(&(dev->vq.used_updated), "used_updated"); // Initialize condition variable
+    for (i = 0; i < dev->nvq; i++)
+        virtio_enable_virtq(dev->regs, dev->vqs[i]->qid); // Enable the virtual queues
     // ioref(&dev->io_intf);
     dev->io_intf.refcnt = 1;
     *ioptr = &dev->io_intf; // Return IO operations to caller
@@ -269,8 +578,10 @@ Side Effects: Closes the device, disables isr for source and resets virtq queues
 void vioblk_close(struct io_intf * io) {
     if (--io->refcnt == 0) {
         struct vioblk_device * dev = (void *)io - offsetof(struct vioblk_device, io_intf);
+        int i;
 
-        virtio_reset_virtq(dev->regs, VIRTQ_ID); // Reset the virtual queue
+        for (i = 0; i < dev->nvq; i++)
+            virtio_reset_virtq(dev->regs, dev->vqs[i]->qid); // Reset the virtual queues
         intr_disable_irq(dev->irqno); // Disable interrupts for the device
         dev->opened = 0; // Mark device as closed
     }
@@ -278,159 +589,698 @@ void vioblk_close(struct io_intf * io) {
 
 
 /*
-Purpose: Reads bufsz number of bytes from the disk and writes them to buf. Achieves this by repeatedly
-setting the appropriate registers to request a block from the disk, waiting until the data has been
-populated in block buffer cache, and then writes that data out to buf. Thread sleeps while waiting for
-the disk to service the request. Returns the number of bytes successfully read from the disk.
+Purpose: Reads bufsz number of bytes from the disk at the current position and writes them to buf. See
+vioblk_readat. Advances the current position by the number of bytes read.
 Arguments: io (64-bit), buf (64-bit), bufsz (64-bit)
 Side Effects: The buf is populated with data coming from block device for bufsz num of bytes
 */
 long vioblk_read(struct io_intf * restrict io, void * restrict buf, unsigned long bufsz) {
-    lock_acquire(&vioblk_lock);
     struct vioblk_device * const dev = (struct vioblk_device *)((void *)io - offsetof(struct vioblk_device, io_intf));
+    long result;
 
-    if (bufsz == 0) { return -EINVAL; } // Invalid buffer size
-    if (dev->opened == 0){ return -ENODEV; } // Device not open
-    if (dev->pos > dev->size) { return 0; } // Position exceeds device size
+    result = vioblk_readat(io, dev->pos, buf, bufsz);
+    if (result > 0) { dev->pos += result; } // Update position
 
-    int total_read = 0;
-    
-    while (total_read < bufsz && dev->pos < dev->size) {
-        int sector = dev->pos / dev->blksz; // Calculate current sector
-        int offset = dev->pos % dev->blksz; // Calculate offset within the block
-
-        // Request Header
-        dev->vq.req_header.type = VIRTIO_BLK_T_IN;
-        dev->vq.req_header.reserved = 0;
-        dev->vq.req_header.sector = sector;
-        dev->bufblkno = sector;
-
-        // Descriptor 0 - Indirect
-        dev->vq.desc[0].addr = (uint64_t)&dev->vq.desc[1];  
-        dev->vq.desc[0].len = sizeof(struct virtq_desc) * 3;  
-        dev->vq.desc[0].flags = VIRTQ_DESC_F_INDIRECT;      
-        dev->vq.desc[0].next = -1; // End of chain
-
-        // Descriptor 1 - Request 
-        dev->vq.desc[1].addr = (uint64_t)&dev->vq.req_header;   
-        dev->vq.desc[1].len = sizeof(struct vioblk_request_header); 
-        dev->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;         
-        dev->vq.desc[1].next = 1;
-
-        // Descriptor 2 - Data
-        dev->vq.desc[2].addr = (uint64_t)dev->blkbuf;      
-        dev->vq.desc[2].len = dev->blksz;                    
-        dev->vq.desc[2].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT; 
-        dev->vq.desc[2].next = 2;
-
-        // Descriptor 3 - Status
-        dev->vq.desc[3].addr = (uint64_t)&dev->vq.req_status;   
-        dev->vq.desc[3].len = sizeof(dev->vq.req_status);       
-        dev->vq.desc[3].flags = VIRTQ_DESC_F_WRITE;
-        dev->vq.desc[3].next = -1; // End of chain
-
-        dev->vq.avail.ring[0] = 0; // Add descriptor to available ring
-        __sync_synchronize();
-        dev->vq.avail.idx++;
-        __sync_synchronize();
+    return result;
+}
 
-        virtio_notify_avail(dev->regs, VIRTQ_ID); // Notify the device about the available descriptor
-        __sync_synchronize();
+/*
+Purpose: Writes n number of bytes from the parameter buf to the disk at the current position. See
+vioblk_writeat. Advances the current position by the number of bytes written.
+Arguments: io (64-bit), buf (64-bit), n (64-bit)
+Side Effects: block device receives n bytes from the buf overwritten on its memory
+*/
+long vioblk_write(struct io_intf * restrict io, const void * restrict buf, unsigned long n) {
+    struct vioblk_device * const dev = (struct vioblk_device *)((void *)io - offsetof(struct vioblk_device, io_intf));
+    long result;
+
+    result = vioblk_writeat(io, dev->pos, buf, n);
+    if (result > 0) { dev->pos += result; } // Update position
+
+    return result;
+}
+
+/*
+Purpose: Reads bufsz number of bytes from the disk starting at byte offset pos and writes them to buf.
+Whole blocks are read straight into buf, up to req_max bytes per request, scatter-gathered over the
+physical pages of buf. Partial blocks, and blocks of buf that are not mapped, are read into the request's
+block buffer and copied out. Up to VIOBLK_BATCH requests are kept in flight, and they are collected
+oldest first, so the thread only waits when the oldest one is not yet done. The device is notified
+once per batch. Returns the number of
+bytes successfully read from the disk.
+Arguments: io (64-bit), pos (64-bit), buf (64-bit), bufsz (64-bit)
+Side Effects: The buf is populated with data coming from block device for bufsz num of bytes
+*/
+long vioblk_readat(struct io_intf * restrict io, unsigned long long pos, void * restrict buf, unsigned long bufsz) {
+    struct vioblk_device * const dev = (struct vioblk_device *)((void *)io - offsetof(struct vioblk_device, io_intf));
+    struct vioblk_queue * const q = vioblk_select_queue(dev);
+    struct vioblk_inflight fl[VIOBLK_BATCH];
+    struct vioblk_inflight * f;
+    unsigned int head = 0, tail = 0; // fl[head..tail) in flight, modulo VIOBLK_BATCH
+    unsigned long issued = 0;
+    unsigned long total_read = 0;
+    uint32_t len;
+    int result = 0;
+    int id;
 
-        int s = intr_disable();
-        while (dev->vq.used.idx != dev->vq.avail.idx) { // Wait until the device processes the request
-            condition_wait(&dev->vq.used_updated);
+    if (bufsz == 0) { return -EINVAL; } // Invalid buffer size
+    if (dev->opened == 0){ return -ENODEV; } // Device not open
+    if (pos > dev->size) { return 0; } // Position exceeds device size
+    if (dev->size - pos < bufsz) { bufsz = dev->size - pos; } // Stop at end of device
+
+    while (result == 0 && total_read < bufsz) {
+        // Fill the pipeline. Only wait for a free slot if we have nothing in flight.
+        while (issued < bufsz && tail - head < VIOBLK_BATCH) {
+            id = vioblk_get_req(q, tail == head);
+            if (id < 0) { break; }
+
+            f = &fl[tail++ % VIOBLK_BATCH];
+            f->id = id;
+            f->bufoff = issued;
+            f->blkoff = (pos + issued) % dev->blksz;
+            f->len = 0;
+
+            if (f->blkoff == 0 && dev->blksz <= bufsz - issued) {
+                len = (dev->req_max < bufsz - issued) ? dev->req_max : bufsz - issued;
+                f->len = vioblk_map(dev, q->reqs[id], (char *)buf + issued, len, VIRTIO_BLK_T_IN);
+            }
+
+            f->bounce = (f->len == 0);
+            if (f->bounce) {
+                vioblk_map_bounce(dev, q->reqs[id]);
+                f->len = ((dev->blksz - f->blkoff) < (bufsz - issued)) ? dev->blksz - f->blkoff : bufsz - issued;
+            }
+
+            vioblk_submit(dev, q, id, VIRTIO_BLK_T_IN, pos + issued - f->blkoff);
+            issued += f->len;
         }
-        intr_restore(s);
 
-        if (dev->vq.req_status != VIRTIO_BLK_S_OK) { return -EIO; } // Check for read errors
+        vioblk_notify(dev, q); // One notification for the whole batch
 
-        int read_size = ((dev->blksz - offset) < (bufsz - total_read)) ? dev->blksz - offset : bufsz - total_read;
-        memcpy((char *)buf + total_read, dev->blkbuf + offset, read_size); // Copy data to buffer
-        
-        total_read += read_size;
-        dev->pos += read_size; // Update position
+        f = &fl[head++ % VIOBLK_BATCH];
+        result = vioblk_wait_req(dev, q, f->id);
+        if (result == 0) {
+            if (f->bounce) // Copy data to buffer
+                memcpy((char *)buf + f->bufoff, q->reqs[f->id]->buf + f->blkoff, f->len);
+            total_read += f->len;
+        }
+        vioblk_release_req(q, f->id);
+    }
+
+    // After an error, collect the requests still in flight before returning,
+    // since they may be transferring into buf. (After a timeout, the queue has
+    // been reset, so they have already failed.)
+    while (head != tail) {
+        f = &fl[head++ % VIOBLK_BATCH];
+        vioblk_wait_req(dev, q, f->id);
+        vioblk_release_req(q, f->id);
     }
-    lock_release(&vioblk_lock);
-    return total_read;
+
+    return (result != 0) ? result : total_read;
 }
 
 /*
-Purpose: Writes n number of bytes from the parameter buf to the disk. The size of the virtio device should
-not change. You should only overwrite existing data. Write should also not create any new files.
-Achieves this by filling up the block buffer cache and then setting the appropriate registers to request
-the disk write the contents of the cache to the specified block location. Thread sleeps while waiting
-for the disk to service the request. Returns the number of bytes successfully written to the disk.
-Arguments: io (64-bit), buf (64-bit), n (64-bit)
+Purpose: Writes n number of bytes from the parameter buf to the disk starting at byte offset pos. The
+size of the virtio device should not change. You should only overwrite existing data. Whole blocks are
+written straight from buf, up to req_max bytes per request, with up to VIOBLK_BATCH requests in flight.
+Blocks of buf that are not mapped are copied into the request's block buffer first. A block that is
+only partially overwritten is written by vioblk_rmw once the requests before it are done. Returns the
+number of bytes successfully written to the disk.
+Arguments: io (64-bit), pos (64-bit), buf (64-bit), n (64-bit)
 Side Effects: block device receives n bytes from the buf overwritten on its memory
 */
-long vioblk_write(struct io_intf * restrict io, const void * restrict buf, unsigned long n) {
-    lock_acquire(&vioblk_lock);
+long vioblk_writeat(struct io_intf * restrict io, unsigned long long pos, const void * restrict buf, unsigned long n) {
     struct vioblk_device * const dev = (struct vioblk_device *)((void *)io - offsetof(struct vioblk_device, io_intf));
-    
+    struct vioblk_queue * const q = vioblk_select_queue(dev);
+    struct vioblk_inflight fl[VIOBLK_BATCH];
+    struct vioblk_inflight * f;
+    unsigned int head = 0, tail = 0; // fl[head..tail) in flight, modulo VIOBLK_BATCH
+    unsigned long issued = 0;
+    unsigned long total_written = 0;
+    uint32_t blkoff, len;
+    int result = 0;
+    int id;
+
     if (dev->readonly == 1) { return -EIO; } // Check if the device is read-only
-    if (dev->pos > dev->size) { return 0; } // Position exceeds device size
+    if (pos > dev->size) { return 0; } // Position exceeds device size
     if (dev->opened == 0){ return -ENODEV; } // Device not open
     if (n == 0) { return -EINVAL; } // Invalid buffer size
+    if (dev->size - pos < n) { n = dev->size - pos; } // Stop at end of device
+
+    while (result == 0 && total_written < n) {
+        while (result == 0 && issued < n && tail - head < VIOBLK_BATCH) {
+            blkoff = (pos + issued) % dev->blksz;
+            len = ((dev->blksz - blkoff) < (n - issued)) ? dev->blksz - blkoff : n - issued;
+
+            // Partial block: drain the pipeline, then read-modify-write it
+            if (len != dev->blksz) {
+                if (tail != head) { break; }
+                result = vioblk_rmw(dev, pos + issued - blkoff, blkoff, (const char *)buf + issued, len);
+                if (result == 0) {
+                    issued += len;
+                    total_written += len;
+                }
+                continue;
+            }
+
+            id = vioblk_get_req(q, tail == head);
+            if (id < 0) { break; }
+
+            // Whole blocks, but not past a trailing partial block
+            len = (dev->req_max < n - issued) ? dev->req_max : n - issued;
+            len = vioblk_map(dev, q->reqs[id], (const char *)buf + issued, len, VIRTIO_BLK_T_OUT);
+
+            f = &fl[tail++ % VIOBLK_BATCH];
+            f->id = id;
+            f->bufoff = issued;
+            f->blkoff = 0;
+            f->len = len;
+            f->bounce = (len == 0);
+
+            if (f->bounce) {
+                f->len = dev->blksz;
+                vioblk_map_bounce(dev, q->reqs[id]);
+                memcpy(q->reqs[id]->buf, (const char *)buf + issued, f->len); // Copy data to block buffer
+            }
+
+            vioblk_submit(dev, q, id, VIRTIO_BLK_T_OUT, pos + issued);
+            issued += f->len;
+        }
 
-    int total_written = 0;
-    
-    while (total_written < n) {
-        int sector = dev->pos / dev->blksz; // Calculate current sector
-        int offset = dev->pos % dev->blksz; // Calculate offset within the block
-        
-        int write_size = ((dev->blksz - offset) < (n - total_written)) ? dev->blksz - offset : n - total_written;
-        memcpy(dev->blkbuf + offset, (const char *)buf + total_written, write_size); // Copy data to block buffer at offset
-
-        // Request Header
-        dev->vq.req_header.type = VIRTIO_BLK_T_OUT;
-        dev->vq.req_header.reserved = 0;
-        dev->vq.req_header.sector = sector;
-
-        // Descriptor 0 - Indirect
-        dev->vq.desc[0].addr = (uint64_t)&dev->vq.desc[1];  
-        dev->vq.desc[0].len = sizeof(dev->vq.desc[1]) * 3;  
-        dev->vq.desc[0].flags = VIRTQ_DESC_F_INDIRECT;      
-        dev->vq.desc[0].next = -1; // End of chain
-
-        // Descriptor 1 - Request
-        dev->vq.desc[1].addr = (uint64_t)&dev->vq.req_header;
-        dev->vq.desc[1].len = sizeof(struct vioblk_request_header);
-        dev->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[1].next = 1;
-
-        // Descriptor 2 - Data
-        dev->vq.desc[2].addr = (uint64_t)dev->blkbuf;
-        dev->vq.desc[2].len = dev->blksz;
-        dev->vq.desc[2].flags = VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[2].next = 2;
-
-        // Descriptor 3 - Status
-        dev->vq.desc[3].addr = (uint64_t)&dev->vq.req_status;
-        dev->vq.desc[3].len = 1;
-        dev->vq.desc[3].flags = VIRTQ_DESC_F_WRITE;
-        dev->vq.desc[3].next = -1; // End of chain
-
-        dev->vq.avail.ring[dev->vq.avail.idx % 1] = 0; // Add descriptor to available ring
-        __sync_synchronize();
-        dev->vq.avail.idx++;
-        __sync_synchronize();
+        if (head == tail) { continue; }
+
+        vioblk_notify(dev, q); // One notification for the whole batch
+
+        f = &fl[head++ % VIOBLK_BATCH];
+        result = vioblk_wait_req(dev, q, f->id);
+        if (result == 0) { total_written += f->len; }
+        vioblk_release_req(q, f->id);
+    }
+
+    // After an error, collect the requests still in flight before returning,
+    // since they may be transferring from buf. (After a timeout, the queue has
+    // been reset, so they have already failed.)
+    while (head != tail) {
+        f = &fl[head++ % VIOBLK_BATCH];
+        vioblk_wait_req(dev, q, f->id);
+        vioblk_release_req(q, f->id);
+    }
+
+    return (result != 0) ? result : total_written;
+}
+
+/*
+Purpose: Allocates and initializes the descriptor table, the avail and used rings and one request per
+slot for virtqueue qid, and gives the queue to the device. The queue is as long as the device allows,
+up to VIOBLK_QLEN. The table and the rings share one page. If the device uses packed virtqueues, the page
+holds the descriptor ring and the two event suppression structures instead.
+Arguments: dev (64-bit), q (64-bit), qid (32-bit)
+Side Effects: returns 0 on success, -ENODEV if the device does not offer the queue
+*/
+int vioblk_init_queue(struct vioblk_device * dev, struct vioblk_queue * q, int qid) {
+    struct vioblk_req * req;
+    size_t used_off;
+    uint_fast32_t len;
+    void * page;
+    int i;
+
+    dev->regs->queue_sel = qid;
+    __sync_synchronize();
+    len = dev->regs->queue_num_max;
+
+    if (VIOBLK_QLEN < len) { len = VIOBLK_QLEN; }
+    while ((len & (len - 1)) != 0) { len &= len - 1; } // Round down to a power of two
+    if (len == 0) { return -ENODEV; }
+
+    page = memory_alloc_page();
+    memset(page, 0, PAGE_SIZE);
+
+    memset(q, 0, sizeof(struct vioblk_queue));
+    q->qid = qid;
+    q->len = len;
+    q->packed = dev->packed;
+
+    if (!q->packed) {
+        // Descriptor table, then avail ring (with used_event), then used ring (with avail_event)
+        used_off = len * sizeof(struct virtq_desc) + VIRTQ_AVAIL_SIZE(len) + sizeof(uint16_t);
+        used_off = (used_off + 3) & ~(size_t)3;
+
+        q->desc = page;
+        q->avail = page + len * sizeof(struct virtq_desc);
+        q->used = page + used_off;
+        q->used_event = (volatile uint16_t *)&q->avail->ring[len];
+        q->avail_event = (volatile uint16_t *)&q->used->ring[len];
+    } else {
+        // Descriptor ring, then driver and device event suppression. Both
+        // wrap counters start at 1, so the zeroed ring holds nothing.
+        q->ring = page;
+        q->driver_event = page + len * sizeof(struct virtq_packed_desc);
+        q->device_event = q->driver_event + 1;
+        q->avail_wrap = 1;
+        q->used_wrap = 1;
+    }
+
+    q->poll_time = VIOBLK_POLL_MAX;
+    condition_init(&q->slot_free, "vioblk.slot");
+
+    for (i = 0; i < len; i++) {
+        req = kmalloc(sizeof(struct vioblk_req));
+        memset(req, 0, sizeof(struct vioblk_req));
+        req->buf = kmalloc(dev->blksz);
+        condition_init(&req->done_cond, "vioblk.done");
+        req->next_free = (i + 1 < len) ? i + 1 : -1;
+
+        req->itab[0].addr = (uint64_t)&req->hdr;
+        req->itab[0].len = sizeof(struct vioblk_request_header);
+
+        if (!q->packed) {
+            req->itab[0].flags = VIRTQ_DESC_F_NEXT;
+            req->itab[0].next = 1;
+
+            q->desc[i].addr = (uint64_t)req->itab;
+            q->desc[i].flags = VIRTQ_DESC_F_INDIRECT;
+            q->desc[i].next = -1;
+        }
+
+        q->reqs[i] = req;
+    }
+
+    q->free_head = 0;
+
+    if (!q->packed)
+        virtio_attach_virtq(dev->regs, qid, len, (uint64_t)q->desc, (uint64_t)q->used, (uint64_t)q->avail);
+    else
+        virtio_attach_virtq(dev->regs, qid, len, (uint64_t)q->ring, (uint64_t)q->device_event, (uint64_t)q->driver_event);
+    return 0;
+}
+
+/*
+Purpose: Picks the queue the running thread submits to. Each thread always uses the same queue, so its
+requests stay in order with respect to each other, and threads spread out over the queues so that they
+do not compete for one ring and its request slots.
+Arguments: dev (64-bit)
+Side Effects: none
+*/
+struct vioblk_queue * vioblk_select_queue(const struct vioblk_device * dev) {
+    return dev->vqs[running_thread() % dev->nvq];
+}
+
+/*
+Purpose: Takes a free request slot from the queue. If there is none, waits for one if wait is set and
+returns -1 otherwise.
+Arguments: q (64-bit), wait (32-bit)
+Side Effects: returns the slot number
+*/
+int vioblk_get_req(struct vioblk_queue * q, int wait) {
+    struct vioblk_req * req;
+    int s = intr_disable();
+    int id;
+
+    while (q->free_head < 0) {
+        if (!wait) { intr_restore(s); return -1; }
+        condition_wait(&q->slot_free);
+    }
+
+    id = q->free_head;
+    req = q->reqs[id];
+    q->free_head = req->next_free;
+    req->done = 0;
+    req->ioreq = NULL;
+
+    intr_restore(s);
+    return id;
+}
+
+/*
+Purpose: Returns a request slot to the free list and wakes up threads waiting for one. Must be called
+with interrupts disabled.
+Arguments: q (64-bit), id (32-bit)
+Side Effects: none
+*/
+void vioblk_put_req(struct vioblk_queue * q, int id) {
+    q->reqs[id]->next_free = q->free_head;
+    q->free_head = id;
+    condition_broadcast(&q->slot_free);
+}
+
+/*
+Purpose: Points the data descriptors of req at up to len bytes of buf, which must start on a block
+boundary. Each page of buf is translated to its physical address, and physically contiguous pages are
+merged into one segment of at most size_max bytes. Stops at the device's segment limit or at a page
+that is not mapped with the access the device needs, then drops any trailing partial block.
+Arguments: dev (64-bit), req (64-bit), buf (64-bit), len (32-bit), type (32-bit)
+Side Effects: returns the number of bytes mapped, a multiple of blksz, which is 0 if not even one block could be mapped
+*/
+uint32_t vioblk_map(const struct vioblk_device * dev, struct vioblk_req * req, const void * buf, uint32_t len, uint32_t type) {
+    // The device writes the buffer for reads and reads it for writes
+    const uint_fast8_t flags = (type == VIRTIO_BLK_T_IN) ? PTE_W : PTE_R;
+    struct virtq_desc * seg = NULL;
+    uint32_t mapped = 0;
+    uint32_t excess;
+    uintptr_t pa;
+    uint32_t n;
+
+    req->nseg = 0;
+
+    while (mapped < len) {
+        pa = memory_translate((const char *)buf + mapped, flags);
+        if (pa == 0) { break; } // Not mapped (yet): let the caller bounce
+
+        n = PAGE_SIZE - pa % PAGE_SIZE; // Up to the end of the page
+        if (len - mapped < n) { n = len - mapped; }
+
+        if (seg != NULL && seg->addr + seg->len == pa && n <= dev->size_max - seg->len) {
+            seg->len += n; // Extend the current segment
+        } else {
+            if (req->nseg == dev->seg_max) { break; }
+            if (dev->size_max < n) { n = dev->size_max; }
+            seg = &req->itab[++req->nseg];
+            seg->addr = pa;
+            seg->len = n;
+        }
+
+        mapped += n;
+    }
 
-        virtio_notify_avail(dev->regs, VIRTQ_ID); // Notify the device about the available descriptor
+    // Trim back to whole blocks
+    excess = mapped % dev->blksz;
+    while (excess != 0) {
+        seg = &req->itab[req->nseg];
+        n = (excess < seg->len) ? excess : seg->len;
+        seg->len -= n;
+        excess -= n;
+        mapped -= n;
+        if (seg->len == 0) { req->nseg--; }
+    }
+
+    return mapped;
+}
 
-        int s = intr_disable();
-        while (dev->vq.used.idx != dev->vq.avail.idx) { // Wait until the device processes the request
-            condition_wait(&dev->vq.used_updated);
+/*
+Purpose: Points the single data descriptor of req at the request's own block buffer.
+Arguments: dev (64-bit), req (64-bit)
+Side Effects: none
+*/
+void vioblk_map_bounce(const struct vioblk_device * dev, struct vioblk_req * req) {
+    req->itab[1].addr = (uint64_t)req->buf;
+    req->itab[1].len = dev->blksz;
+    req->nseg = 1;
+}
+
+/*
+Purpose: Fills in the header and the rest of the descriptor table of request id, whose data descriptors
+were set up by vioblk_map or vioblk_map_bounce, and places it in the avail ring (or, for a packed
+virtqueue, makes the next ring descriptor point to it). The device only sees it after the next
+vioblk_notify, so that callers submitting several requests notify the device once. The type is
+VIRTIO_BLK_T_IN (disk to memory), VIRTIO_BLK_T_OUT (memory to disk) or VIRTIO_BLK_T_FLUSH (no data
+descriptors), and pos is the byte offset on the disk, which must be a multiple of the sector size.
+Arguments: dev (64-bit), q (64-bit), id (32-bit), type (32-bit), pos (64-bit)
+Side Effects: the device owns the request until the ISR marks it done; on a broken device, the request
+fails right away
+*/
+void vioblk_submit(struct vioblk_device * dev, struct vioblk_queue * q, int id, uint32_t type, uint64_t pos) {
+    struct vioblk_req * const req = q->reqs[id];
+    // Entries of a packed indirect table have flags where split ones have next
+    struct virtq_packed_desc * const ptab = (void *)req->itab;
+    volatile struct virtq_packed_desc * d;
+    int s;
+    int i;
+
+    // Request Header
+    req->hdr.type = type;
+    req->hdr.reserved = 0;
+    req->hdr.sector = pos / VIRTIO_BLK_SECTOR_SIZE;
+
+    if (!q->packed) {
+        // Data descriptors: device writes them for reads
+        for (i = 1; i <= req->nseg; i++) {
+            req->itab[i].flags = VIRTQ_DESC_F_NEXT;
+            if (type == VIRTIO_BLK_T_IN)
+                req->itab[i].flags |= VIRTQ_DESC_F_WRITE;
+            req->itab[i].next = i + 1;
         }
+
+        // Status
+        req->itab[i].addr = (uint64_t)&req->status;
+        req->itab[i].len = sizeof(req->status);
+        req->itab[i].flags = VIRTQ_DESC_F_WRITE;
+        req->itab[i].next = -1; // End of chain
+
+        q->desc[id].len = (req->nseg + 2) * sizeof(struct virtq_desc);
+    } else {
+        // Chained by position
+        ptab[0].flags = 0;
+        for (i = 1; i <= req->nseg; i++)
+            ptab[i].flags = (type == VIRTIO_BLK_T_IN) ? VIRTQ_DESC_F_WRITE : 0;
+
+        ptab[i].addr = (uint64_t)&req->status;
+        ptab[i].len = sizeof(req->status);
+        ptab[i].flags = VIRTQ_DESC_F_WRITE;
+    }
+
+    // Other threads submit to the same ring
+    s = intr_disable();
+
+    if (dev->broken) { // The device no longer gets requests
+        req->status = VIRTIO_BLK_S_IOERR;
+        vioblk_complete_req(q, id);
         intr_restore(s);
+        return;
+    }
+
+    if (!q->packed) {
+        q->avail->ring[q->avail->idx % q->len] = id; // Add descriptor to available ring
+        __sync_synchronize();
+        q->avail->idx++;
+    } else {
+        d = &q->ring[q->next_avail];
+        d->addr = (uint64_t)req->itab;
+        d->len = (req->nseg + 2) * sizeof(struct virtq_packed_desc);
+        d->id = id;
+        __sync_synchronize(); // The flags hand the descriptor to the device
+        d->flags = VIRTQ_DESC_F_INDIRECT |
+            (q->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+
+        if (++q->next_avail == q->len) {
+            q->next_avail = 0;
+            q->avail_wrap = !q->avail_wrap;
+        }
+    }
+
+    req->submitted = 1;
+    q->avail_idx++;
+    q->inflight++;
+    intr_restore(s);
+}
+
+/*
+Purpose: Tells the device about the requests submitted since the last notification, unless it asked not to
+be told. With VIRTIO_F_EVENT_IDX, the device asks to be notified once the avail ring index passes avail_event;
+otherwise it sets VIRTQ_USED_F_NO_NOTIFY while it is processing the ring anyway. A packed virtqueue has the
+same two choices in device_event, with a ring position and wrap counter in place of the index.
+Arguments: dev (64-bit), q (64-bit)
+Side Effects: may write the queue notify register
+*/
+void vioblk_notify(struct vioblk_device * dev, struct vioblk_queue * q) {
+    struct virtq_event_suppress ev;
+    uint16_t old, new, event;
+    int kick;
+    int s;
+
+    s = intr_disable();
+    __sync_synchronize(); // avail ring before event index or flags
+    old = q->notified;
+    new = q->avail_idx;
+    q->notified = new;
+
+    if (old == new) // Nothing new
+        kick = 0;
+    else if (!q->packed) {
+        if (dev->event_idx) // Did the index pass avail_event?
+            kick = (uint16_t)(new - *q->avail_event - 1) < (uint16_t)(new - old);
+        else
+            kick = !(q->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    } else {
+        ev = *q->device_event;
+        if (ev.flags == VIRTQ_EVENT_F_DESC) {
+            // Same test on ring positions. An event position from the
+            // previous lap counts as one ring length earlier.
+            event = ev.off_wrap & ~VIRTQ_EVENT_WRAP;
+            if (!(ev.off_wrap & VIRTQ_EVENT_WRAP) != !q->avail_wrap)
+                event -= q->len;
+            old = q->next_avail - (uint16_t)(new - old);
+            new = q->next_avail;
+            kick = (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+        } else
+            kick = (ev.flags != VIRTQ_EVENT_F_DISABLE);
+    }
+
+    intr_restore(s);
+
+    if (kick)
+        virtio_notify_avail(dev->regs, q->qid); // Notify the device about the available descriptors
+}
+
+/*
+Purpose: Waits until the device completes request id, giving up after VIOBLK_TIMEOUT timer ticks
+without a completion. The thread first polls the used ring for up to poll_time ticks with interrupts
+from the device suppressed, since a fast device completes the request sooner than an interrupt and a
+thread switch would take. Only then does it enable interrupts and sleep. The poll time doubles when
+polling pays off and halves when it does not. If the request times out, the queue is reset (see
+vioblk_reset_queue), since the device could otherwise still transfer data to or from the caller's buffer
+after we return.
+Arguments: dev (64-bit), q (64-bit), id (32-bit)
+Side Effects: returns 0 on success, -EIO if the device reports an error, -ETIMEDOUT if it does not answer
+*/
+int vioblk_wait_req(struct vioblk_device * dev, struct vioblk_queue * q, int id) {
+    struct vioblk_req * const req = q->reqs[id];
+    uint64_t start, elapsed = 0;
+    int s = intr_disable();
+
+    if (!req->done && q->poll_time != 0) {
+        q->npolling++;
+        vioblk_poll_used(dev, q); // Also suppresses interrupts
+        start = csrr_time();
+
+        while (!req->done && (elapsed = csrr_time() - start) < q->poll_time) {
+            intr_restore(s); // Let other interrupts in
+            s = intr_disable();
+            vioblk_poll_used(dev, q);
+        }
+
+        q->npolling--;
+        vioblk_poll_used(dev, q); // Stop suppressing interrupts
+
+        if (req->done && q->poll_time < 2 * elapsed)
+            q->poll_time = (2 * elapsed < VIOBLK_POLL_MAX) ? 2 * elapsed : VIOBLK_POLL_MAX;
+        else if (!req->done)
+            q->poll_time = (VIOBLK_POLL_MIN < q->poll_time / 2) ? q->poll_time / 2 : VIOBLK_POLL_MIN;
+    }
+
+    if (!req->done) {
+        q->nwaiting++;
+        vioblk_poll_used(dev, q); // Enables interrupts
+
+        while (!req->done) {
+            if (condition_wait_timeout(&req->done_cond, VIOBLK_TIMEOUT) != 0 && !req->done) {
+                kprintf("%p: virtio block device request timed out\n", dev->regs);
+                q->nwaiting--;
+                vioblk_reset_queue(dev, q);
+                intr_restore(s);
+                return -ETIMEDOUT;
+            }
+        }
+
+        q->nwaiting--;
+    }
+
+    intr_restore(s);
+
+    if (req->status != VIRTIO_BLK_S_OK) { return -EIO; } // Check for errors
+
+    return 0;
+}
+
+/*
+Purpose: Takes queue q away from the device and gives it back empty. Once the reset is complete, the
+device no longer touches the rings or the buffers of the requests on them, so the requests still in
+flight fail with VIRTIO_BLK_S_IOERR: their waiters are woken up and asynchronous requests completed.
+Used when the device stops answering, so that no request can transfer data after its caller gave up on
+it. If the device does not complete the reset within VIOBLK_RESET_TIMEOUT, it is marked broken, and
+vioblk_submit fails all later requests with VIRTIO_BLK_S_IOERR instead of giving them to the device.
+Must be called with interrupts disabled.
+Arguments: dev (64-bit), q (64-bit)
+Side Effects: all requests in flight on q complete with an error
+*/
+void vioblk_reset_queue(struct vioblk_device * dev, struct vioblk_queue * q) {
+    const uint64_t start = csrr_time();
+    int i;
+
+    virtio_reset_virtq(dev->regs, q->qid);
+
+    // Wait until the device lets go of the queue. A device that does not is
+    // given up on, so that it cannot hang the machine.
+    while (dev->regs->queue_reset != 1) {
+        if (VIOBLK_RESET_TIMEOUT <= csrr_time() - start) {
+            kprintf("%p: virtio block device queue reset timed out\n", dev->regs);
+            dev->broken = 1;
+            break;
+        }
+    }
+
+    for (i = 0; i < q->len; i++) {
+        if (q->reqs[i]->submitted) {
+            q->reqs[i]->status = VIRTIO_BLK_S_IOERR;
+            vioblk_complete_req(q, i);
+        }
+    }
+
+    if (dev->broken) { return; }
+
+    // Same empty rings as vioblk_init_queue. The descriptor table of a split
+    // virtqueue only points at the requests, so it stays as it is.
+    if (!q->packed) {
+        memset(q->avail, 0, PAGE_SIZE - q->len * sizeof(struct virtq_desc));
+        virtio_attach_virtq(dev->regs, q->qid, q->len, (uint64_t)q->desc, (uint64_t)q->used, (uint64_t)q->avail);
+    } else {
+        memset((void *)q->ring, 0, PAGE_SIZE);
+        q->next_avail = 0;
+        q->avail_wrap = 1;
+        q->used_wrap = 1;
+        virtio_attach_virtq(dev->regs, q->qid, q->len, (uint64_t)q->ring, (uint64_t)q->device_event, (uint64_t)q->driver_event);
+    }
 
-        if (dev->vq.req_status != VIRTIO_BLK_S_OK) { return -EIO; } // Check for write errors
+    q->avail_idx = 0;
+    q->last_used = 0;
+    q->notified = 0;
+    q->inflight = 0;
 
-        total_written += write_size;
-        dev->pos += write_size; // Update position
+    virtio_enable_virtq(dev->regs, q->qid);
+    vioblk_update_intr(dev, q);
+}
+
+/*
+Purpose: Frees the slot of a request returned by vioblk_wait_req.
+Arguments: q (64-bit), id (32-bit)
+Side Effects: none
+*/
+void vioblk_release_req(struct vioblk_queue * q, int id) {
+    int s = intr_disable();
+    vioblk_put_req(q, id);
+    intr_restore(s);
+}
+
+/*
+Purpose: Overwrites len bytes at offset blkoff of the block at byte offset blkpos with src, keeping the rest of the block.
+Reads the block into a request's block buffer, patches it and writes it back, holding rmw_lock so that
+concurrent partial writes to the same block do not undo each other.
+Arguments: dev (64-bit), blkpos (64-bit), blkoff (32-bit), src (64-bit), len (32-bit)
+Side Effects: returns 0 on success or a negative error code
+*/
+int vioblk_rmw(struct vioblk_device * dev, uint64_t blkpos, uint32_t blkoff, const void * src, uint32_t len) {
+    struct vioblk_queue * const q = vioblk_select_queue(dev);
+    int result;
+    int id;
+
+    lock_acquire(&dev->rmw_lock);
+    id = vioblk_get_req(q, 1);
+    vioblk_map_bounce(dev, q->reqs[id]);
+
+    vioblk_submit(dev, q, id, VIRTIO_BLK_T_IN, blkpos);
+    vioblk_notify(dev, q);
+    result = vioblk_wait_req(dev, q, id);
+
+    if (result == 0) {
+        memcpy(q->reqs[id]->buf + blkoff, src, len);
+        q->reqs[id]->done = 0;
+        vioblk_submit(dev, q, id, VIRTIO_BLK_T_OUT, blkpos);
+        vioblk_notify(dev, q);
+        result = vioblk_wait_req(dev, q, id);
     }
-    lock_release(&vioblk_lock);
-    return total_written;
+
+    vioblk_release_req(q, id);
+    lock_release(&dev->rmw_lock);
+    return result;
 }
 
 
@@ -449,26 +1299,252 @@ int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
         return vioblk_setpos(dev, arg);
     case IOCTL_GETBLKSZ:
         return vioblk_getblksz(dev, arg);
+    case IOCTL_FLUSH:
+        return vioblk_flush(dev);
+    case IOCTL_DISCARD:
+        return vioblk_range(dev, arg, VIRTIO_BLK_T_DISCARD);
+    case IOCTL_WRITE_ZEROES:
+        return vioblk_range(dev, arg, VIRTIO_BLK_T_WRITE_ZEROES);
     default:
         return -ENOTSUP;
     }
 }
 
 /*
-Purpose: Sets the appropriate device registers and wakes the thread up after waiting for the disk to finish ser-
-vicing a request.
+Purpose: Starts an asynchronous read or write (see iosubmit). Block-aligned requests are served natively: the
+transfer is split into requests of up to req_max bytes that go straight to req->buf, and the ISR completes
+req when the last of them is done, so the caller does not wait for the device. The parts may complete in
+any order. If even the first block of req->buf cannot be mapped, or the request is not block-aligned, it
+is handed to the generic workers instead. A later block that cannot be mapped ends the transfer early,
+like a short read or write. Requests in flight cannot be cancelled.
+Arguments: io (64-bit), req (64-bit)
+Side Effects: returns 0 if the request was started or a negative error code
+*/
+int vioblk_iosubmit(struct io_intf * io, struct io_req * req) {
+    struct vioblk_device * const dev = (void*)io - offsetof(struct vioblk_device, io_intf);
+    struct vioblk_queue * const q = vioblk_select_queue(dev);
+    const uint32_t type = (req->op == IO_REQ_READ) ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+    unsigned long len, issued = 0;
+    uint32_t n;
+    int s;
+    int id;
+
+    if (dev->opened == 0) { return -ENODEV; } // Device not open
+    if (req->op == IO_REQ_WRITE && dev->readonly == 1) { return -EIO; } // Check if the device is read-only
+
+    if (req->pos % dev->blksz != 0 || req->len % dev->blksz != 0 || req->len == 0 || req->pos >= dev->size)
+        return iosubmit_generic(io, req);
+
+    len = (dev->size - req->pos < req->len) ? dev->size - req->pos : req->len; // Stop at end of device
+
+    // We hold one count ourselves, so the ISR cannot complete req before we
+    // have submitted all parts
+    req->pending = 1;
+
+    while (issued < len) {
+        id = vioblk_get_req(q, 1);
+        n = (dev->req_max < len - issued) ? dev->req_max : len - issued;
+        n = vioblk_map(dev, q->reqs[id], (char *)req->buf + issued, n, type);
+
+        if (n == 0) {
+            s = intr_disable();
+            vioblk_put_req(q, id);
+            intr_restore(s);
+
+            if (issued == 0) // Nothing in flight yet
+                return iosubmit_generic(io, req);
+            break;
+        }
+
+        if (q->free_head < 0) // Let the device start on what we have before we wait for a slot
+            vioblk_notify(dev, q);
+
+        q->reqs[id]->ioreq = req;
+        q->reqs[id]->iolen = n;
+
+        s = intr_disable();
+        req->pending++;
+        intr_restore(s);
+
+        vioblk_submit(dev, q, id, type, req->pos + issued);
+        issued += n;
+    }
+
+    vioblk_notify(dev, q);
+
+    s = intr_disable();
+    vioblk_ioreq_done(req);
+    intr_restore(s);
+
+    return 0;
+}
+
+/*
+Purpose: Drops one pending count of an asynchronous request and completes it when none are left. Must be
+called with interrupts disabled.
+Arguments: req (64-bit)
+Side Effects: may call the request's completion callback
+*/
+void vioblk_ioreq_done(struct io_req * req) {
+    if (--req->pending == 0)
+        io_req_complete(req, req->result);
+}
+
+/*
+Purpose: Completes the requests the device has placed in the used rings of all queues since the last interrupt
+and wakes up the thread waiting for each of them.
 Arguments: irqno (32-bit), aux (64-bit)
-Side Effects: runs with isr is triggered, broadcasts condition to continue operation for read/write, ackowledge interrupts to registers
+Side Effects: runs with isr is triggered, marks requests done, acknowledges interrupts to registers
 */
 void vioblk_isr(int irqno, void * aux) {
-    struct vioblk_device *dev = (struct vioblk_device *)aux;
+    struct vioblk_device * const dev = (struct vioblk_device *)aux;
+    const uint32_t isr_status = dev->regs->interrupt_status;
+    int i;
+
+    // Acknowledge first, so that completions after our walk raise a new interrupt
+    dev->regs->interrupt_ack = isr_status;
+    __sync_synchronize();
+
+    // All queues share the interrupt
+    for (i = 0; i < dev->nvq; i++)
+        vioblk_poll_used(dev, dev->vqs[i]);
+}
+
+/*
+Purpose: Completes the requests in the used ring, then tells the device when to interrupt next (see
+vioblk_update_intr). Completions that arrive while we do so may not raise an interrupt, so we look at
+the used ring again until it has nothing new. Must be called with interrupts disabled.
+Arguments: dev (64-bit), q (64-bit)
+Side Effects: marks requests done
+*/
+void vioblk_poll_used(struct vioblk_device * dev, struct vioblk_queue * q) {
+    do {
+        vioblk_process_used(dev, q);
+        vioblk_update_intr(dev, q);
+        __sync_synchronize(); // used_event or flags before used ring index
+    } while (vioblk_used_ready(q));
+}
+
+/*
+Purpose: Checks whether the device has completed a request we have not looked at yet: whether the used ring
+index moved past last_used or, for a packed virtqueue, whether the descriptor at last_used is marked used in
+the current lap.
+Arguments: q (64-bit)
+Side Effects: returns 1 if there is a completed request and 0 otherwise
+*/
+int vioblk_used_ready(const struct vioblk_queue * q) {
+    uint16_t flags;
+
+    if (!q->packed)
+        return (q->last_used != q->used->idx);
+
+    flags = q->ring[q->last_used].flags;
+    return (!(flags & VIRTQ_DESC_F_AVAIL) == !q->used_wrap &&
+        !(flags & VIRTQ_DESC_F_USED) == !q->used_wrap);
+}
+
+/*
+Purpose: Takes the next completed request, which vioblk_used_ready reported, from the used ring.
+Arguments: q (64-bit)
+Side Effects: returns the request id
+*/
+int vioblk_next_used(struct vioblk_queue * q) {
+    uint16_t id;
+
+    __sync_synchronize(); // idx or flags before ring entry
+
+    if (!q->packed)
+        return q->used->ring[q->last_used++ % q->len].id;
+
+    id = q->ring[q->last_used].id;
+    if (++q->last_used == q->len) {
+        q->last_used = 0;
+        q->used_wrap = !q->used_wrap;
+    }
 
-    // Check if the interrupt status indicates used buffer notification
-    if (dev->regs->interrupt_status & VIRTQ_USED_F_NO_NOTIFY) {
-        condition_broadcast(&dev->vq.used_updated); // Wake up waiting thread
+    return id;
+}
+
+/*
+Purpose: Completes the requests the device has placed in the used ring since we last looked (see
+vioblk_complete_req). Must be called with interrupts disabled.
+Arguments: dev (64-bit), q (64-bit)
+Side Effects: marks requests done
+*/
+void vioblk_process_used(struct vioblk_device * dev, struct vioblk_queue * q) {
+    while (vioblk_used_ready(q)) {
+        q->inflight--;
+        vioblk_complete_req(q, vioblk_next_used(q));
     }
+}
 
-    dev->regs->interrupt_ack |= VIRTIO_STAT_ACKNOWLEDGE; // Acknowledge the interrupt
+/*
+Purpose: Marks request id done and wakes up the thread waiting for it. A part of an asynchronous request is
+freed and counted instead. Must be called with interrupts disabled.
+Arguments: q (64-bit), id (32-bit)
+Side Effects: marks the request done
+*/
+void vioblk_complete_req(struct vioblk_queue * q, int id) {
+    struct vioblk_req * const req = q->reqs[id];
+
+    req->submitted = 0;
+    req->done = 1;
+
+    if (req->ioreq != NULL) {
+        if (req->status != VIRTIO_BLK_S_OK)
+            req->ioreq->result = -EIO;
+        else if (req->ioreq->result >= 0)
+            req->ioreq->result += req->iolen;
+        vioblk_put_req(q, id);
+        vioblk_ioreq_done(req->ioreq);
+    } else
+        condition_broadcast(&req->done_cond); // Wake up the owner only
+}
+
+/*
+Purpose: Tells the device when to interrupt next. While threads poll and none sleeps, interrupts are
+suppressed: with VIRTIO_F_EVENT_IDX by moving used_event out of reach, otherwise with
+VIRTQ_AVAIL_F_NO_INTERRUPT (or VIRTQ_EVENT_F_DISABLE in a packed virtqueue). While a thread sleeps, the
+next completion interrupts, since it may be the one it waits for. With only asynchronous requests in
+flight and VIRTIO_F_EVENT_IDX, the device interrupts after up to VIOBLK_INTR_BATCH of them complete.
+Must be called with interrupts disabled.
+Arguments: dev (64-bit), q (64-bit)
+Side Effects: writes used_event, the avail ring flags or driver_event
+*/
+void vioblk_update_intr(struct vioblk_device * dev, struct vioblk_queue * q) {
+    const int suppress = (q->nwaiting == 0 && q->npolling != 0);
+    uint16_t batch, pos;
+    int wrap;
+
+    batch = 1;
+    if (q->nwaiting == 0 && 1 < q->inflight)
+        batch = (q->inflight < VIOBLK_INTR_BATCH) ? q->inflight : VIOBLK_INTR_BATCH;
+
+    if (q->packed) {
+        if (suppress)
+            q->driver_event->flags = VIRTQ_EVENT_F_DISABLE;
+        else if (dev->event_idx) {
+            // Ring position and lap of the batch-th next used descriptor
+            pos = q->last_used + batch - 1;
+            wrap = q->used_wrap;
+            if (q->len <= pos) {
+                pos -= q->len;
+                wrap = !wrap;
+            }
+            q->driver_event->off_wrap = pos | (wrap ? VIRTQ_EVENT_WRAP : 0);
+            __sync_synchronize(); // off_wrap before flags
+            q->driver_event->flags = VIRTQ_EVENT_F_DESC;
+        } else
+            q->driver_event->flags = VIRTQ_EVENT_F_ENABLE;
+    } else if (suppress) {
+        if (dev->event_idx)
+            *q->used_event = q->last_used - 1; // Reached only after the index wraps
+        else
+            q->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    } else if (dev->event_idx)
+        *q->used_event = q->last_used + batch - 1; // Interrupt when the used index passes it
+    else
+        q->avail->flags = 0;
 }
 
 /*
@@ -520,3 +1596,72 @@ int vioblk_getblksz(const struct vioblk_device * dev, uint32_t * blkszptr) {
     return dev->blksz; // Return the block size
 }
 
+/*
+Purpose: Ioctl helper function which makes all completed writes durable. Sends a flush request if the device
+has a write cache, which it only reports with VIRTIO_BLK_F_FLUSH. Otherwise writes are durable once completed.
+Arguments: dev (64-bit)
+Side Effects: returns 0 on success or a negative error code
+*/
+int vioblk_flush(struct vioblk_device * dev) {
+    struct vioblk_queue * const q = vioblk_select_queue(dev);
+    int result;
+    int id;
+
+    if (dev->opened == 0) { return -ENODEV; } // Device not open
+    if (!dev->flush) { return 0; } // No write cache
+
+    id = vioblk_get_req(q, 1);
+    q->reqs[id]->nseg = 0;
+    vioblk_submit(dev, q, id, VIRTIO_BLK_T_FLUSH, 0);
+    vioblk_notify(dev, q);
+    result = vioblk_wait_req(dev, q, id);
+    vioblk_release_req(q, id);
+
+    return result;
+}
+
+/*
+Purpose: Ioctl helper function which discards (type VIRTIO_BLK_T_DISCARD) or zeroes (VIRTIO_BLK_T_WRITE_ZEROES) a
+block-aligned range of the disk. Each request covers up to discard_max or wz_max bytes, so that a large range usually
+takes a single request and no data moves. The range goes in the request's block buffer.
+Arguments: dev (64-bit), range (64-bit), type (32-bit)
+Side Effects: returns 0 on success, -ENOTSUP if the device does not support the command or a negative error code
+*/
+int vioblk_range(struct vioblk_device * dev, const struct io_range * range, uint32_t type) {
+    struct vioblk_queue * const q = vioblk_select_queue(dev);
+    const uint64_t max = (type == VIRTIO_BLK_T_DISCARD) ? dev->discard_max : dev->wz_max;
+    struct vioblk_discard_write_zeroes * seg;
+    uint64_t done = 0;
+    uint64_t len;
+    int result = 0;
+    int id;
+
+    if (dev->opened == 0) { return -ENODEV; } // Device not open
+    if (max == 0) { return -ENOTSUP; } // Command not supported
+    if (dev->readonly == 1) { return -EIO; } // Check if the device is read-only
+    if (range == NULL || range->pos % dev->blksz != 0 || range->len % dev->blksz != 0 ||
+        dev->size < range->pos || dev->size - range->pos < range->len)
+        return -EINVAL;
+
+    while (result == 0 && done < range->len) {
+        len = (max < range->len - done) ? max : range->len - done;
+
+        id = vioblk_get_req(q, 1);
+        vioblk_map_bounce(dev, q->reqs[id]);
+        q->reqs[id]->itab[1].len = sizeof(struct vioblk_discard_write_zeroes);
+
+        seg = (void *)q->reqs[id]->buf;
+        seg->sector = (range->pos + done) / VIRTIO_BLK_SECTOR_SIZE;
+        seg->num_sectors = len / VIRTIO_BLK_SECTOR_SIZE;
+        seg->flags = (type == VIRTIO_BLK_T_WRITE_ZEROES && dev->wz_unmap) ? VIRTIO_BLK_WZ_F_UNMAP : 0;
+
+        vioblk_submit(dev, q, id, type, 0);
+        vioblk_notify(dev, q);
+        result = vioblk_wait_req(dev, q, id);
+        vioblk_release_req(q, id);
+
+        done += len;
+    }
+
+    return result;
+}
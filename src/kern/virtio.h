@@ -21,6 +21,7 @@
 #define VIRTIO_F_INDIRECT_DESC		28
 #define VIRTIO_F_EVENT_IDX			29
 #define VIRTIO_F_ANY_LAYOUT			27
+#define VIRTIO_F_RING_PACKED        34
 #define VIRTIO_F_RING_RESET         40
 
 #define VIRTQ_LEN_MAX 32768
@@ -32,6 +33,20 @@
 #define VIRTQ_DESC_F_WRITE      	(1 << 1)
 #define VIRTQ_DESC_F_INDIRECT		(1 << 2)
 
+// Packed virtqueue descriptor flags. A descriptor is available when its AVAIL
+// flag equals the driver's wrap counter and its USED flag does not; it is used
+// when both equal the wrap counter.
+
+#define VIRTQ_DESC_F_AVAIL          (1 << 7)
+#define VIRTQ_DESC_F_USED           (1 << 15)
+
+// Packed virtqueue event suppression flags (see struct virtq_event_suppress)
+
+#define VIRTQ_EVENT_F_ENABLE        0
+#define VIRTQ_EVENT_F_DISABLE       1
+#define VIRTQ_EVENT_F_DESC          2 // needs VIRTIO_F_EVENT_IDX
+#define VIRTQ_EVENT_WRAP            (1 << 15) // wrap counter bit of off_wrap
+
 //           length of feature vector
 #define VIRTIO_FEATLEN 4
 
@@ -149,6 +164,24 @@ struct virtq_used {
 #define VIRTQ_USED_SIZE(n) \
     (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem))
 
+// With VIRTIO_F_RING_PACKED, a virtqueue is a single ring of descriptors that
+// the driver makes available and the device overwrites with used ones, plus
+// one event suppression structure for each side. Descriptors in an indirect
+// table have the same layout; their id is ignored, and they are chained by
+// position instead of with VIRTQ_DESC_F_NEXT.
+
+struct virtq_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct virtq_event_suppress {
+    uint16_t off_wrap; // descriptor ring offset and wrap counter
+    uint16_t flags; // VIRTQ_EVENT_F_*
+};
+
 
 //           EXPORTED FUNCTION DEFINITIONS
 //          
@@ -169,6 +202,10 @@ extern int virtio_negotiate_features (
 
 static inline void virtio_notify_avail (volatile struct virtio_mmio_regs * regs, int qid);
 
+//           Gives a virtqueue to the device. For a packed virtqueue, /desc_addr/ is the
+//           descriptor ring, and /used_addr/ and /avail_addr/ are the device and driver
+//           event suppression structures.
+
 extern void virtio_attach_virtq (volatile struct virtio_mmio_regs * regs, int qid, uint_fast16_t len,
     uint64_t desc_addr, uint64_t used_addr, uint64_t avail_addr);
 
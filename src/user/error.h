@@ -14,5 +14,10 @@
 #define EACCESS     8
 #define EBADFD      9
 #define EMFILE     10
+#define ETIMEDOUT  11
+#define ENOMEM     12
+#define EAGAIN     13
+#define ECANCELED  14
+#define EINTR      15
 
 #endif // _ERROR_H_
@@ -0,0 +1,84 @@
+// fpthread.c - Floating point in a second thread and after fork
+//
+// A thread does floating-point work and exits while main waits for it, then
+// main does floating-point work of its own. Then the process forks, and parent
+// and child each sum a different series, yielding the CPU to each other as
+// they go. Each result is checked against the same sum computed beforehand.
+// Exercises lazy FPU switching, thread exit of an FPU owner and fork by an FPU
+// owner.
+//
+
+#include "syscall.h"
+#include "string.h"
+
+static void worker(void * arg);
+static double series(unsigned int n, unsigned int step, int yield);
+static void check(const char * what, double got, double want);
+
+static char worker_stack[4096] __attribute__ ((aligned (16)));
+static volatile double worker_result;
+
+void main(void) {
+    double want_parent, want_child;
+    int tid;
+
+    tid = _thread_create(worker, (void *)1000,
+        worker_stack + sizeof(worker_stack), NULL);
+
+    if (tid < 0) {
+        _msgout("fpthread: _thread_create failed");
+        _exit();
+    }
+
+    _thread_join(tid);
+    check("thread", worker_result, series(1000, 1, 0));
+
+    want_parent = series(2000, 1, 0);
+    want_child = series(2000, 2, 0);
+
+    tid = _fork();
+
+    if (tid < 0) {
+        _msgout("fpthread: _fork failed");
+        _exit();
+    }
+
+    if (tid == 0) {
+        check("fork child", series(2000, 2, 1), want_child);
+        _exit();
+    }
+
+    check("fork parent", series(2000, 1, 1), want_parent);
+    _wait(tid);
+    _exit();
+}
+
+void worker(void * arg) {
+    worker_result = series((unsigned long)arg, 1, 0);
+    _thread_exit();
+}
+
+// Returns the sum of 1/(k*step) for k from 1 to n. If yield is set, gives up
+// the CPU every 64 terms, so that the sum is in progress across thread
+// switches.
+
+double series(unsigned int n, unsigned int step, int yield) {
+    double sum = 0.0;
+    unsigned int k;
+
+    for (k = 1; k <= n; k++) {
+        sum += 1.0 / (k * step);
+        if (yield && k % 64 == 0)
+            _sched_yield();
+    }
+
+    return sum;
+}
+
+void check(const char * what, double got, double want) {
+    char linebuf[80];
+
+    snprintf(linebuf, sizeof(linebuf), "fpthread: %s: %s (%u/1000)\n",
+        what, (got == want) ? "ok" : "FAILED", (unsigned int)(got * 1000));
+    _msgout(linebuf);
+}
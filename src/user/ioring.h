@@ -0,0 +1,92 @@
+// ioring.h - Shared submission and completion rings
+//
+// A process may set up one pair of rings with _ioring_setup, which maps a page
+// shared with the kernel and returns a pointer to it. To submit operations,
+// the process fills in submission queue entries (SQEs), advances sq_tail and
+// calls _ioring_enter. A kernel worker thread carries out the operations in
+// order and posts a completion queue entry (CQE) for each. The process reaps
+// CQEs by reading them and advancing cq_head, which needs no system call.
+// _ioring_enter can also wait for a number of completions, so one call can
+// both submit a batch of operations and collect their results.
+//
+
+#ifndef _IORING_H_
+#define _IORING_H_
+
+#include <stdint.h>
+
+#define IORING_SQ_ENTRIES 32 // must be a power of two
+#define IORING_CQ_ENTRIES 64 // must be a power of two
+
+// Operation codes
+
+#define IORING_OP_NOP   0
+#define IORING_OP_READ  1 // read len bytes at off from fd into addr
+#define IORING_OP_WRITE 2 // write len bytes from addr to fd at off
+#define IORING_OP_IOCTL 3 // ioctl(fd, len, addr)
+
+// An /off/ of IORING_OFF_CUR means the current position of the file, which is
+// advanced as for _read and _write.
+
+#define IORING_OFF_CUR ((uint64_t)-1)
+
+struct ioring_sqe {
+    uint8_t op;
+    uint8_t flags; // reserved, must be 0
+    uint16_t reserved;
+    int32_t fd;
+    uint64_t addr;
+    uint64_t len;
+    uint64_t off;
+    uint64_t user_data; // copied to the CQE
+};
+
+struct ioring_cqe {
+    uint64_t user_data;
+    int64_t res; // result of the operation as for the equivalent system call
+};
+
+// The ring indices count up freely; the slot of index /i/ is i % ENTRIES. The
+// process writes sq_tail and cq_head, the kernel writes sq_head and cq_tail.
+
+struct ioring {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    struct ioring_sqe sq[IORING_SQ_ENTRIES];
+    struct ioring_cqe cq[IORING_CQ_ENTRIES];
+};
+
+// Returns the next free SQE, or NULL if the submission queue is full. The
+// entry is submitted by ioring_sqe_push.
+
+static inline struct ioring_sqe * ioring_get_sqe(struct ioring * ring) {
+    if (ring->sq_tail - ring->sq_head == IORING_SQ_ENTRIES)
+        return NULL;
+    else
+        return &ring->sq[ring->sq_tail % IORING_SQ_ENTRIES];
+}
+
+static inline void ioring_sqe_push(struct ioring * ring) {
+    __sync_synchronize(); // SQE contents before tail
+    ring->sq_tail += 1;
+}
+
+// Returns the oldest unreaped CQE, or NULL if there is none. Once the caller
+// is done with it, it must release it with ioring_cqe_seen.
+
+static inline struct ioring_cqe * ioring_peek_cqe(struct ioring * ring) {
+    if (ring->cq_head == ring->cq_tail)
+        return NULL;
+
+    __sync_synchronize(); // tail before CQE contents
+    return &ring->cq[ring->cq_head % IORING_CQ_ENTRIES];
+}
+
+static inline void ioring_cqe_seen(struct ioring * ring) {
+    __sync_synchronize();
+    ring->cq_head += 1;
+}
+
+#endif // _IORING_H_
@@ -0,0 +1,55 @@
+// mutex.h - User-space mutex built on futexes
+//
+// The mutex word is 0 when unlocked, 1 when locked with no waiters and 2 when
+// locked with (possibly) waiting threads. Locking and unlocking an uncontended
+// mutex are single atomic instructions; only contention makes system calls.
+//
+
+#ifndef _MUTEX_H_
+#define _MUTEX_H_
+
+#include "syscall.h"
+
+struct mutex {
+    volatile int state;
+};
+
+#define MUTEX_INITIALIZER { .state = 0 }
+
+static inline void mutex_init(struct mutex * mtx) {
+    mtx->state = 0;
+}
+
+static inline int mutex_trylock(struct mutex * mtx) {
+    int c = 0;
+
+    return __atomic_compare_exchange_n(&mtx->state, &c, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void mutex_lock(struct mutex * mtx) {
+    int c = 0;
+
+    if (__atomic_compare_exchange_n(&mtx->state, &c, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    // Mark the mutex contended and sleep until it is released. Whoever takes
+    // it after sleeping leaves it marked contended, since others may still be
+    // waiting.
+
+    if (c != 2)
+        c = __atomic_exchange_n(&mtx->state, 2, __ATOMIC_ACQUIRE);
+
+    while (c != 0) {
+        _futex_wait(&mtx->state, 2, 0);
+        c = __atomic_exchange_n(&mtx->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline void mutex_unlock(struct mutex * mtx) {
+    if (__atomic_exchange_n(&mtx->state, 0, __ATOMIC_RELEASE) == 2)
+        _futex_wake(&mtx->state, 1);
+}
+
+#endif // _MUTEX_H_
@@ -19,5 +19,17 @@
 
 #define SYSCALL_USLEEP  40
 #define SYSCALL_WAIT    41
+#define SYSCALL_SCHED_DEADLINE 42
+#define SYSCALL_SCHED_YIELD    43
+#define SYSCALL_CPU_QUOTA      44
+
+#define SYSCALL_THREAD_CREATE 45
+#define SYSCALL_THREAD_JOIN   46
+#define SYSCALL_THREAD_EXIT   47
+#define SYSCALL_FUTEX_WAIT    48
+#define SYSCALL_FUTEX_WAKE    49
+
+#define SYSCALL_IORING_SETUP 50
+#define SYSCALL_IORING_ENTER 51
 
 #endif // _SCNUM_H_
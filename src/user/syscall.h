@@ -6,6 +6,8 @@
 
 #include <stddef.h>
 
+struct ioring; // ioring.h
+
 extern void __attribute__ ((noreturn)) _exit(void);
 extern void _msgout(const char * msg);
 extern int _close(int fd);
@@ -18,5 +20,17 @@ extern int _exec(int fd);
 extern int _fork(void);
 extern int _wait(int tid);
 extern int _usleep(unsigned long us);
+extern int _sched_deadline(unsigned long runtime_us,
+    unsigned long deadline_us, unsigned long period_us);
+extern int _sched_yield(void);
+extern int _cpu_quota(unsigned long quota_us, unsigned long period_us);
+extern int _thread_create(void (*start)(void *), void * arg,
+    void * stack, void * tls);
+extern int _thread_join(int tid);
+extern void __attribute__ ((noreturn)) _thread_exit(void);
+extern int _futex_wait(volatile int * uaddr, int val, unsigned long us);
+extern int _futex_wake(volatile int * uaddr, int cnt);
+extern struct ioring * _ioring_setup(void);
+extern int _ioring_enter(unsigned int to_submit, unsigned int min_complete);
 
 #endif // _SYSCALL_H_